@@ -0,0 +1,804 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_bench.c
+//  Description    : This is the benchmark harness for the CART stack. It drives
+//                   the public cart_driver.h interface with a synthetic,
+//                   seeded workload against the local cart_server and writes
+//                   the results as JSON, so runs can be compared by script.
+//
+//                   Every file is first written in full (the preload), then
+//                   <ops> reads and writes are issued at sequential or random
+//                   offsets. Reads are checked against a shadow copy of the
+//                   files, so the benchmark also catches corrupted data.
+//
+//                   By default the loop is closed. With -R the operations are
+//                   sent on an open loop schedule instead, and the run is
+//                   repeated for each target rate to give a throughput versus
+//                   latency curve.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <errno.h>
+#include <stddef.h>
+#include <getopt.h>
+
+// Project Includes
+#include <cart_driver.h>
+#include <cart_cache.h>
+#include <cart_network.h>
+#include <cart_timing.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define CART_BENCH_ARGUMENTS "hvl:n:f:z:s:w:rc:a:S:o:R:PZD:H:k:mxF:X:"
+#define BENCH_IDLE_POLL 0.001	// Longest idle sleep while the defragmenter or scrubber has work
+#define USAGE \
+	"USAGE: cart_bench [-h] [-v] [-l <logfile>] [-n <ops>] [-f <files>] [-z <bytes>] [-s <min>[:<max>]]\n" \
+	"                  [-w <pct>] [-r] [-c <sz>] [-a <strategy>] [-S <seed>] [-o <json>]\n" \
+	"                  [-R <rate>[:<max>:<step>]] [-P] [-Z] [-D <frames/s>] [-H <hint>] [-k <drives>] [-m]\n" \
+	"                  [-x] [-F <cart>] [-X <frames/s>] [--lru|--lfu|--random|--twoq]\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -v - verbose output\n" \
+	"    -l - write log messages to the filename <logfile>\n" \
+	"    -n - number of measured operations (default 20000)\n" \
+	"    -f - number of files (default 8)\n" \
+	"    -z - size of each file in bytes (default 262144)\n" \
+	"    -s - request size, fixed or uniform in <min>:<max> bytes (default 1024)\n" \
+	"    -w - percentage of operations that are writes (default 50)\n" \
+	"    -r - random offsets (default sequential)\n" \
+	"    -c - set the cart block cache to size <sz>\n" \
+	"    -a - allocation strategy: random, linear, balanced or affinity (default random)\n" \
+	"    -S - workload seed (default 1)\n" \
+	"    -o - write the JSON results to <json> (default stdout)\n" \
+	"    -R - open loop at <rate> ops/sec, or stepping from <rate> to <max> by <step>\n" \
+	"    -P - Poisson arrivals for the open loop (default fixed interval)\n" \
+	"    -Z - ask the server for packed (compressed) frames\n" \
+	"    -D - defragment in the open loop's idle time, moving at most <frames/s>\n" \
+	"    -H - advise each file as random or sequential:<width> and preallocate it\n" \
+	"    -k - spread the cartridges over <drives> servers, on ports 21785 and up\n" \
+	"    -m - mirror every frame onto a second cartridge\n" \
+	"    -x - keep XOR parity over each group of 8 cartridges\n" \
+	"    -F - fail cartridge <cart> after the preload, so reads of it are degraded\n" \
+	"    -X - scrub in the open loop's idle time, verifying at most <frames/s>\n" \
+	"    --lru, --lfu, --random, --twoq - cache replacement policy (default LRU)\n" \
+	"\n"
+
+// The benchmark configuration
+typedef struct {
+	uint32_t ops;		// measured operations
+	uint32_t files;		// number of files
+	uint32_t file_size;	// bytes in each file
+	uint32_t size_min;	// smallest request
+	uint32_t size_max;	// largest request
+	uint32_t write_pct;	// percentage of writes
+	int random;		// random rather than sequential offsets
+	uint32_t cache_size;	// cache frames (0 for the driver default)
+	ReplacementPolicy policy;	// cache replacement policy
+	AllocStrategy alloc;	// frame allocation strategy
+	uint64_t seed;		// workload seed
+	double rate_min;	// first open loop rate, 0 for closed loop
+	double rate_max;	// last open loop rate
+	double rate_step;	// increase between open loop rates
+	int poisson;		// Poisson rather than fixed arrivals
+	uint32_t defrag;	// defragmenter rate in frames/sec, 0 if off
+	CartAdvice advice;	// advice given for each file, with a preallocation
+	uint32_t stripe;	// stripe width of SEQUENTIAL advice
+	int mirror;		// mirror every frame
+	int parity;		// keep parity over cartridge groups
+	int failed;		// cartridge failed after the preload, -1 if none
+	uint32_t scrub;		// scrubber rate in frames/sec, 0 if off
+} BenchConfig;
+
+// The state of one benchmark file
+typedef struct {
+	int16_t fhandle;	// handle of the open file
+	uint32_t cursor;	// next offset for sequential access
+	char *shadow;		// what the file should contain
+} BenchFile;
+
+// One chosen operation
+typedef struct {
+	BenchFile *file;	// the file
+	int is_write;		// write rather than read
+	uint32_t size;		// bytes to transfer
+	uint32_t offset;	// where in the file
+	int error;		// set if a read returned the wrong data
+} BenchOp;
+
+// The results of one measured phase
+typedef struct {
+	double *latency;	// latency of each operation (usec), sorted after the phase
+	double *service;	// issue to completion of each operation (usec), sorted
+	uint32_t ops;		// operations run (counters from here are reset per phase)
+	uint64_t reads;		// reads issued
+	uint64_t writes;	// writes issued
+	uint64_t bytes;		// bytes transferred
+	uint64_t errors;	// reads that returned the wrong data
+	uint64_t bus[CART_OP_MAXVAL];	// bus requests per opcode
+	uint64_t wire;		// bytes on the wire
+	CartCacheStats cache;	// cache counters of the phase
+	uint64_t moved;		// frames the defragmenter moved
+	uint64_t degraded;	// frames read from the copies of a failed cartridge
+	uint64_t scrubbed;	// frames the scrubber verified
+	uint64_t corrupt;	// frames read that failed their checksum
+	double rate;		// target rate, 0 for closed loop
+	double seconds;		// wall time of the phase
+} BenchPhase;
+
+//
+// Global Data
+
+uint64_t bench_rng;		// Workload generator state
+
+const char *policy_names[CART_CACHE_POLICIES] = { "lru", "lfu", "random", "twoq" };
+
+const char *alloc_names[] = { "random", "linear", "balanced", "affinity" };
+
+const char *advice_names[] = { "none", "sequential", "random" };
+
+const char *opcode_names[CART_OP_MAXVAL] = { "INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF" };
+
+//
+// Functional Prototypes
+
+int run_benchmark(BenchConfig *config, FILE *out);	// preload, run and report
+int bench_preload(BenchConfig *config, BenchFile *files, double *seconds);	// create and fill the files
+int bench_phase(BenchConfig *config, BenchFile *files, char *buf, double rate, BenchPhase *phase);	// one measured phase
+void bench_prepare(BenchConfig *config, BenchFile *files, char *buf, BenchOp *bop);	// choose an operation
+int bench_issue(BenchOp *bop, char *buf, uint32_t op);	// run an operation
+void write_phase(FILE *out, BenchConfig *config, BenchPhase *phase);	// phase results as JSON
+uint64_t bench_random(void);				// next value of the workload generator
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the CART benchmark
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful run, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, verbose = 0, log_initialized = 0, ret;
+	unsigned long long seed;
+	char *outfile = NULL;
+	FILE *out = stdout;
+	BenchConfig config = {
+		.ops = 20000, .files = 8, .file_size = 262144, .size_min = 1024, .size_max = 1024, .write_pct = 50,
+		.policy = LRU, .alloc = CARTALLOC_RANDOM, .seed = 1, .advice = CART_ADVICE_NORMAL, .failed = -1
+	};
+	struct option long_option[] =
+	{
+		{"lru", no_argument, (int *)&config.policy, LRU},
+		{"lfu", no_argument, (int *)&config.policy, LFU},
+		{"random", no_argument, (int *)&config.policy, RANDOM},
+		{"twoq", no_argument, (int *)&config.policy, TWOQ},
+		{0,0,0,0}
+	};
+
+	// Process the command line parameters
+	while ((ch = getopt_long(argc, argv, CART_BENCH_ARGUMENTS, long_option, NULL)) != -1) {
+
+		switch (ch) {
+		case 0: // Replacement policy, stored by getopt_long
+			break;
+
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'v': // Verbose Flag
+			verbose = 1;
+			break;
+
+		case 'l': // Set the log filename
+			initializeLogWithFilename( optarg );
+			log_initialized = 1;
+			break;
+
+		case 'n': // Number of operations
+			if ( sscanf( optarg, "%u", &config.ops ) != 1 ) {
+				fprintf( stderr, "Bad operation count [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'f': // Number of files
+			if ( (sscanf( optarg, "%u", &config.files ) != 1) || (config.files == 0) ) {
+				fprintf( stderr, "Bad file count [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'z': // File size
+			if ( (sscanf( optarg, "%u", &config.file_size ) != 1) || (config.file_size == 0) ) {
+				fprintf( stderr, "Bad file size [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 's': // Request size, fixed or a range
+			ret = sscanf( optarg, "%u:%u", &config.size_min, &config.size_max );
+			if ( ret == 1 ) {
+				config.size_max = config.size_min;
+			}
+			if ( (ret < 1) || (config.size_min == 0) || (config.size_max < config.size_min) ) {
+				fprintf( stderr, "Bad request size [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'w': // Write percentage
+			if ( (sscanf( optarg, "%u", &config.write_pct ) != 1) || (config.write_pct > 100) ) {
+				fprintf( stderr, "Bad write percentage [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'r': // Random offsets
+			config.random = 1;
+			break;
+
+		case 'c': // Set cache size
+			if ( sscanf( optarg, "%u", &config.cache_size ) != 1 ) {
+				fprintf( stderr, "Bad cache size [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'a': // Allocation strategy
+			if ( strcmp( optarg, "random" ) == 0 ) {
+				config.alloc = CARTALLOC_RANDOM;
+			} else if ( strcmp( optarg, "linear" ) == 0 ) {
+				config.alloc = CARTALLOC_LINEAR;
+			} else if ( strcmp( optarg, "balanced" ) == 0 ) {
+				config.alloc = CARTALLOC_BALANCED;
+			} else if ( strcmp( optarg, "affinity" ) == 0 ) {
+				config.alloc = CARTALLOC_AFFINITY;
+			} else {
+				fprintf( stderr, "Bad allocation strategy [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'S': // Workload seed
+			if ( sscanf( optarg, "%llu", &seed ) != 1 ) {
+				fprintf( stderr, "Bad seed [%s]\n", optarg );
+				return( -1 );
+			}
+			config.seed = seed;
+			break;
+
+		case 'R': // Open loop rates
+			ret = sscanf( optarg, "%lf:%lf:%lf", &config.rate_min, &config.rate_max, &config.rate_step );
+			if ( ret == 1 ) {
+				config.rate_max = config.rate_min;
+				config.rate_step = 0.0;
+			}
+			if ( (ret != 1 && ret != 3) || (config.rate_min <= 0) || (config.rate_max < config.rate_min) ||
+				(ret == 3 && config.rate_step <= 0) ) {
+				fprintf( stderr, "Bad open loop rate [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'P': // Poisson arrivals
+			config.poisson = 1;
+			break;
+
+		case 'D': // Defragmenter rate
+			if ( sscanf( optarg, "%u", &config.defrag ) != 1 ) {
+				fprintf( stderr, "Bad defragmenter rate [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'H': // Per file advice and preallocation
+			if ( strcmp( optarg, "random" ) == 0 ) {
+				config.advice = CART_ADVICE_RANDOM;
+			} else if ( (sscanf( optarg, "sequential:%u", &config.stripe ) == 1) && (config.stripe > 0) ) {
+				config.advice = CART_ADVICE_SEQUENTIAL;
+			} else {
+				fprintf( stderr, "Bad file hint [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'k': // Number of drives
+			if ( (sscanf( optarg, "%d", &cart_network_drives ) != 1) ||
+				(cart_network_drives < 1) || (cart_network_drives > CART_MAX_DRIVES) ) {
+				fprintf( stderr, "Bad drive count [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'm': // Mirror frames
+			config.mirror = 1;
+			break;
+
+		case 'x': // Parity over cartridge groups
+			config.parity = 1;
+			break;
+
+		case 'F': // Fail a cartridge after the preload
+			if ( (sscanf( optarg, "%d", &config.failed ) != 1) || (config.failed < 0) ) {
+				fprintf( stderr, "Bad cartridge [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'X': // Scrubber rate
+			if ( sscanf( optarg, "%u", &config.scrub ) != 1 ) {
+				fprintf( stderr, "Bad scrubber rate [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'Z': // Packed frames, if the server agrees
+			cart_network_compress = 1;
+			break;
+
+		case 'o': // JSON output file
+			outfile = optarg;
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// Requests must fit in a file
+	if ( config.size_max > config.file_size ) {
+		fprintf( stderr, "Request size larger than the file size, aborting.\n" );
+		return( -1 );
+	}
+
+	// Setup the log as needed
+	if ( ! log_initialized ) {
+		initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	}
+	if ( verbose ) {
+		enableLogLevels( LOG_INFO_LEVEL );
+	}
+
+	// Open the results file
+	if ( outfile != NULL ) {
+		if ( (out = fopen( outfile, "w" )) == NULL ) {
+			logMessage( LOG_ERROR_LEVEL, "Failed to open results file [%s]", outfile );
+			return( -1 );
+		}
+	}
+
+	ret = run_benchmark( &config, out );
+
+	if ( out != stdout ) {
+		fclose( out );
+	}
+
+	// Return the result of the run
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : run_benchmark
+// Description  : Preload the files, run the measured operations and write the
+//                results as JSON. Closed loop runs one phase; open loop runs
+//                one phase per target rate and reports the curve.
+//
+// Inputs       : config - the benchmark configuration
+//                out - where to write the results
+// Outputs      : 0 if successful, -1 if failure
+
+int run_benchmark(BenchConfig *config, FILE *out) {
+
+	// Local variables
+	BenchFile *files;
+	BenchPhase phase;
+	CartCacheStats stats;
+	uint64_t errors = 0;
+	double preload_time, rate;
+	char *buf;
+	uint32_t i;
+	int ret = 0, step = 0;
+
+	// Setup the workload
+	bench_rng = config->seed * 0x9e3779b97f4a7c15ULL + 1;
+	srand( (unsigned int)config->seed );
+	files = calloc( config->files, sizeof(BenchFile) );
+	phase.latency = malloc( ((config->ops > 0) ? config->ops : 1) * sizeof(double) );
+	phase.service = malloc( ((config->ops > 0) ? config->ops : 1) * sizeof(double) );
+	buf = malloc( config->size_max );
+	if ( (files == NULL) || (phase.latency == NULL) || (phase.service == NULL) || (buf == NULL) ) {
+		logMessage( LOG_ERROR_LEVEL, "Benchmark allocation failed, aborting." );
+		return( -1 );
+	}
+
+	// Configure and start the driver
+	set_replacement_policy( config->policy );
+	if ( config->cache_size != 0 ) {
+		set_cart_cache_size( config->cache_size );
+	}
+	cart_setMode( config->alloc );
+	cart_setDefragRate( config->defrag );
+	cart_setScrubRate( config->scrub );
+	if ( (cart_setMirror( config->mirror ) != 0) || (cart_setParity( config->parity ) != 0) ) {
+		return( -1 );
+	}
+	if ( cart_poweron() != 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART poweron failed, is cart_server running?" );
+		return( -1 );
+	}
+	if ( bench_preload( config, files, &preload_time ) != 0 ) {
+		return( -1 );
+	}
+	if ( (config->failed != -1) && (cart_fail_cartridge( config->failed ) != 0) ) {
+		return( -1 );
+	}
+	get_cart_cache_stats( &stats );
+
+	// Write the configuration
+	fprintf( out, "{\n" );
+	fprintf( out, "  \"benchmark\": \"cart_bench\",\n" );
+	fprintf( out, "  \"config\": {\"ops\": %u, \"files\": %u, \"file_size\": %u, \"size_min\": %u, \"size_max\": %u, "
+		"\"write_pct\": %u, \"pattern\": \"%s\", \"cache_frames\": %u, \"policy\": \"%s\", \"alloc\": \"%s\", \"seed\": %llu, "
+		"\"mode\": \"%s\", \"arrivals\": \"%s\", \"compress\": %s, \"defrag_rate\": %u, \"hint\": \"%s\", \"stripe\": %u, \"drives\": %d, \"mirror\": %s, \"parity\": %s, \"failed_cart\": %d, \"scrub_rate\": %u},\n",
+		config->ops, config->files, config->file_size, config->size_min, config->size_max, config->write_pct,
+		config->random ? "random" : "sequential", stats.capacity, policy_names[config->policy],
+		alloc_names[config->alloc], (unsigned long long)config->seed,
+		(config->rate_min > 0) ? "open" : "closed",
+		(config->rate_min == 0) ? "none" : (config->poisson ? "poisson" : "fixed"),
+		cart_network_compress ? "true" : "false", config->defrag, advice_names[config->advice], config->stripe, cart_network_drives, config->mirror ? "true" : "false",
+		config->parity ? "true" : "false", config->failed, config->scrub );
+	fprintf( out, "  \"preload\": {\"bytes\": %llu, \"seconds\": %.6f},\n",
+		(unsigned long long)config->files * config->file_size, preload_time );
+
+	if ( config->rate_min == 0 ) {
+
+		// Closed loop, each operation issued when the last completes
+		ret = bench_phase( config, files, buf, 0.0, &phase );
+		fprintf( out, "  \"results\": " );
+		write_phase( out, config, &phase );
+		fprintf( out, "\n}\n" );
+		errors += phase.errors;
+
+	} else {
+
+		// Open loop, one phase per target rate
+		fprintf( out, "  \"curve\": [\n" );
+		for ( rate = config->rate_min; ret == 0 && rate <= config->rate_max; rate += config->rate_step, step++ ) {
+			ret = bench_phase( config, files, buf, rate, &phase );
+			fprintf( out, "%s    ", (step > 0) ? ",\n" : "" );
+			write_phase( out, config, &phase );
+			errors += phase.errors;
+			if ( config->rate_step <= 0 ) {
+				break;
+			}
+		}
+		fprintf( out, "\n  ]\n}\n" );
+	}
+
+	// Shut the driver down and clean up
+	for ( i = 0; i < config->files; i++ ) {
+		cart_close( files[i].fhandle );
+		free( files[i].shadow );
+	}
+	cart_poweroff();
+	free( files );
+	free( phase.latency );
+	free( phase.service );
+	free( buf );
+
+	if ( errors > 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "%llu reads returned the wrong data.", (unsigned long long)errors );
+		return( -1 );
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_preload
+// Description  : Create every file and write it in full, in frame sized chunks
+//
+// Inputs       : config - the benchmark configuration
+//                files - the benchmark files
+//                seconds - the time the preload took
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_preload(BenchConfig *config, BenchFile *files, double *seconds) {
+
+	char fname[CART_MAX_PATH_LENGTH];
+	double start = cart_now();
+	uint32_t i, pos, size;
+
+	for ( i = 0; i < config->files; i++ ) {
+		snprintf( fname, CART_MAX_PATH_LENGTH, "bench-%04u", i );
+		if ( ((files[i].fhandle = cart_open( fname )) == -1) ||
+			((files[i].shadow = malloc( config->file_size )) == NULL) ) {
+			logMessage( LOG_ERROR_LEVEL, "Failed to create benchmark file [%s]", fname );
+			return( -1 );
+		}
+		if ( (config->advice != CART_ADVICE_NORMAL) &&
+			((cart_fadvise( files[i].fhandle, config->advice, config->stripe ) != 0) ||
+			(cart_fallocate( files[i].fhandle, config->file_size ) == -1)) ) {
+			logMessage( LOG_ERROR_LEVEL, "Failed to advise benchmark file [%s]", fname );
+			return( -1 );
+		}
+		for ( pos = 0; pos < config->file_size; pos++ ) {
+			files[i].shadow[pos] = (char)bench_random();
+		}
+		for ( pos = 0; pos < config->file_size; pos += size ) {
+			size = ( config->file_size - pos < CART_FRAME_SIZE ) ? config->file_size - pos : CART_FRAME_SIZE;
+			if ( cart_write( files[i].fhandle, &files[i].shadow[pos], size ) != size ) {
+				logMessage( LOG_ERROR_LEVEL, "Preload write failed [%s]", fname );
+				return( -1 );
+			}
+		}
+	}
+
+	*seconds = cart_now() - start;
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_phase
+// Description  : Run config->ops operations and collect their counters.
+//                Closed loop (rate 0) issues each operation when the last
+//                completes. Open loop schedules the operations at the
+//                target rate, fixed or Poisson, and measures latency from
+//                the scheduled time, so a slow response also charges the
+//                operations queued behind it (no coordinated omission).
+//
+// Inputs       : config - the benchmark configuration
+//                files - the benchmark files
+//                buf - a buffer of config->size_max bytes
+//                rate - target operations per second, 0 for closed loop
+//                phase - the phase to fill in
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_phase(BenchConfig *config, BenchFile *files, char *buf, double rate, BenchPhase *phase) {
+
+	// Local variables
+	CartCacheStats before;
+	CartDriverStats driver_before, driver_after;
+	uint64_t bus_before[CART_OP_MAXVAL], wire_before;
+	double start, intended, issued, done, idle;
+	struct timespec wake;
+	BenchOp bop;
+	uint32_t i, op;
+
+	memset( &phase->ops, 0x0, sizeof(BenchPhase) - offsetof(BenchPhase, ops) );
+	phase->rate = rate;
+
+	// Snapshot the counters so the phase reports only its own work
+	get_cart_cache_stats( &before );
+	get_cart_driver_stats( &driver_before );
+	memcpy( bus_before, cart_network_ops, sizeof(bus_before) );
+	wire_before = cart_network_bytes;
+
+	start = intended = cart_now();
+	for ( op = 0; op < config->ops; op++ ) {
+
+		// Choose the operation and fill write data outside the timed section
+		bench_prepare( config, files, buf, &bop );
+
+		// Open loop waits for the scheduled send time, if it is ahead
+		if ( rate > 0 ) {
+			intended += config->poisson ? -log( 1.0 - (bench_random() >> 11) * (1.0 / 9007199254740992.0) ) / rate : 1.0 / rate;
+			while ( intended > cart_now() ) {
+
+				// Idle time goes to the defragmenter and scrubber, which wait for the driver to go quiet
+				if ( (config->defrag > 0 && cart_defrag_step() > 0) || (config->scrub > 0 && cart_scrub_step() > 0) ) {
+					continue;
+				}
+				idle = (config->defrag > 0 || config->scrub > 0) ? fmin( intended, cart_now() + BENCH_IDLE_POLL ) : intended;
+				wake.tv_sec = (time_t)idle;
+				wake.tv_nsec = (long)((idle - wake.tv_sec) * 1e9);
+				while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL ) == EINTR );
+			}
+		}
+
+		issued = cart_now();
+		if ( bench_issue( &bop, buf, op ) != 0 ) {
+			return( -1 );
+		}
+		done = cart_now();
+
+		phase->service[op] = (done - issued) * 1e6;
+		phase->latency[op] = (rate > 0) ? (done - intended) * 1e6 : phase->service[op];
+		phase->reads += !bop.is_write;
+		phase->writes += bop.is_write;
+		phase->errors += bop.error;
+		phase->bytes += bop.size;
+		phase->ops++;
+	}
+	phase->seconds = cart_now() - start;
+
+	// Collect the counters of the phase
+	get_cart_cache_stats( &phase->cache );
+	phase->cache.hits -= before.hits;
+	phase->cache.misses -= before.misses;
+	phase->cache.evictions -= before.evictions;
+	for ( i = 0; i < CART_OP_MAXVAL; i++ ) {
+		phase->bus[i] = cart_network_ops[i] - bus_before[i];
+	}
+	phase->wire = cart_network_bytes - wire_before;
+	get_cart_driver_stats( &driver_after );
+	phase->moved = driver_after.frames_moved - driver_before.frames_moved;
+	phase->degraded = driver_after.degraded_reads - driver_before.degraded_reads;
+	phase->scrubbed = driver_after.frames_scrubbed - driver_before.frames_scrubbed;
+	phase->corrupt = driver_after.checksum_errors - driver_before.checksum_errors;
+	qsort( phase->latency, phase->ops, sizeof(double), cart_compare_samples );
+	qsort( phase->service, phase->ops, sizeof(double), cart_compare_samples );
+
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_prepare
+// Description  : Choose the next operation; fill the buffer for a write
+//
+// Inputs       : config - the benchmark configuration
+//                files - the benchmark files
+//                buf - the transfer buffer
+//                bop - the operation to fill in
+// Outputs      : none
+
+void bench_prepare(BenchConfig *config, BenchFile *files, char *buf, BenchOp *bop) {
+
+	uint32_t pos;
+
+	bop->file = &files[bench_random() % config->files];
+	bop->is_write = (bench_random() % 100) < config->write_pct;
+	bop->size = config->size_min + bench_random() % (config->size_max - config->size_min + 1);
+	bop->error = 0;
+
+	// Pick the offset, sequential access wraps at the end of the file
+	if ( config->random ) {
+		bop->offset = bench_random() % (config->file_size - bop->size + 1);
+	} else {
+		if ( bop->file->cursor + bop->size > config->file_size ) {
+			bop->file->cursor = 0;
+		}
+		bop->offset = bop->file->cursor;
+		bop->file->cursor += bop->size;
+	}
+
+	if ( bop->is_write ) {
+		for ( pos = 0; pos < bop->size; pos++ ) {
+			buf[pos] = (char)bench_random();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_issue
+// Description  : Seek and transfer one operation, checking reads against the
+//                shadow copy and updating it on writes
+//
+// Inputs       : bop - the operation
+//                buf - the transfer buffer
+//                op - operation number, for messages
+// Outputs      : 0 if successful, -1 if failure
+
+int bench_issue(BenchOp *bop, char *buf, uint32_t op) {
+
+	if ( cart_seek( bop->file->fhandle, bop->offset ) != 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "Seek failed at operation %u", op );
+		return( -1 );
+	}
+	if ( bop->is_write ) {
+		if ( cart_write( bop->file->fhandle, buf, bop->size ) != bop->size ) {
+			logMessage( LOG_ERROR_LEVEL, "Write failed at operation %u", op );
+			return( -1 );
+		}
+		memcpy( &bop->file->shadow[bop->offset], buf, bop->size );
+	} else {
+		if ( cart_read( bop->file->fhandle, buf, bop->size ) != bop->size ) {
+			logMessage( LOG_ERROR_LEVEL, "Read failed at operation %u", op );
+			return( -1 );
+		}
+		bop->error = ( memcmp( buf, &bop->file->shadow[bop->offset], bop->size ) != 0 );
+	}
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : write_phase
+// Description  : Write the results of a phase as a JSON object
+//
+// Inputs       : out - where to write
+//                config - the benchmark configuration
+//                phase - the finished phase
+// Outputs      : none
+
+void write_phase(FILE *out, BenchConfig *config, BenchPhase *phase) {
+
+	uint64_t bus_ops = 0, lookups = phase->cache.hits + phase->cache.misses;
+	uint32_t i;
+
+	for ( i = 0; i < CART_OP_MAXVAL; i++ ) {
+		bus_ops += phase->bus[i];
+	}
+
+	fprintf( out, "{" );
+	if ( phase->rate > 0 ) {
+		fprintf( out, "\"target_ops_per_sec\": %.1f, ", phase->rate );
+	}
+	fprintf( out, "\"ops\": %u, \"reads\": %llu, \"writes\": %llu, \"bytes\": %llu, \"seconds\": %.6f, ",
+		phase->ops, (unsigned long long)phase->reads, (unsigned long long)phase->writes,
+		(unsigned long long)phase->bytes, phase->seconds );
+	fprintf( out, "\"ops_per_sec\": %.1f, \"mb_per_sec\": %.3f, ",
+		(phase->seconds > 0) ? phase->ops / phase->seconds : 0.0,
+		(phase->seconds > 0) ? phase->bytes / phase->seconds / 1048576.0 : 0.0 );
+	fprintf( out, "\"latency_usec\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}, ",
+		cart_samples_mean( phase->latency, phase->ops ), cart_samples_percentile( phase->latency, phase->ops, 50.0 ),
+		cart_samples_percentile( phase->latency, phase->ops, 90.0 ), cart_samples_percentile( phase->latency, phase->ops, 99.0 ),
+		cart_samples_percentile( phase->latency, phase->ops, 99.9 ), cart_samples_percentile( phase->latency, phase->ops, 100.0 ) );
+	if ( phase->rate > 0 ) {
+		fprintf( out, "\"service_usec\": {\"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f}, ",
+			cart_samples_percentile( phase->service, phase->ops, 50.0 ), cart_samples_percentile( phase->service, phase->ops, 99.0 ),
+			cart_samples_percentile( phase->service, phase->ops, 100.0 ) );
+	}
+	fprintf( out, "\"bus_ops\": {" );
+	for ( i = 0; i < CART_OP_MAXVAL; i++ ) {
+		fprintf( out, "%s\"%s\": %llu", (i > 0) ? ", " : "", opcode_names[i], (unsigned long long)phase->bus[i] );
+	}
+	fprintf( out, "}, " );
+	fprintf( out, "\"bus_ops_per_byte\": %.6f, \"wire_bytes_per_byte\": %.4f, \"cart_loads_per_op\": %.4f, ",
+		(phase->bytes > 0) ? (double)bus_ops / phase->bytes : 0.0,
+		(phase->bytes > 0) ? (double)phase->wire / phase->bytes : 0.0,
+		(phase->ops > 0) ? (double)phase->bus[CART_OP_LDCART] / phase->ops : 0.0 );
+	if ( config->defrag > 0 ) {
+		fprintf( out, "\"frames_moved\": %llu, ", (unsigned long long)phase->moved );
+	}
+	if ( config->failed != -1 ) {
+		fprintf( out, "\"degraded_reads\": %llu, ", (unsigned long long)phase->degraded );
+	}
+	if ( config->scrub > 0 ) {
+		fprintf( out, "\"frames_scrubbed\": %llu, ", (unsigned long long)phase->scrubbed );
+	}
+	fprintf( out, "\"checksum_errors\": %llu, ", (unsigned long long)phase->corrupt );
+	fprintf( out, "\"cache\": {\"hits\": %llu, \"misses\": %llu, \"hit_ratio\": %.4f, \"evictions\": %llu}, ",
+		(unsigned long long)phase->cache.hits, (unsigned long long)phase->cache.misses,
+		(lookups > 0) ? (double)phase->cache.hits / lookups : 0.0, (unsigned long long)phase->cache.evictions );
+	fprintf( out, "\"verify_errors\": %llu}", (unsigned long long)phase->errors );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : bench_random
+// Description  : Next value of the workload generator (xorshift64*), so a
+//                seed always replays the same workload
+//
+// Inputs       : none
+// Outputs      : the pseudo-random value
+
+uint64_t bench_random(void) {
+	bench_rng ^= bench_rng >> 12;
+	bench_rng ^= bench_rng << 25;
+	bench_rng ^= bench_rng >> 27;
+	return( bench_rng * 0x2545f4914f6cdd1dULL );
+}
@@ -13,7 +13,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 // Project includes
 #include <cart_controller.h>
@@ -22,102 +24,189 @@
 #include <cmpsc311_util.h>
 
 // Defines
+#define CACHE_LINE_SIZE 64			// Alignment of the frame payload slab
+#define CACHE_HUGEPAGE_THRESHOLD (2 * 1024 * 1024)	// Slabs this large are mmap'd and hinted for hugepages
+#define CACHE_FRAME_DATA(idx) (cache_data + (size_t)(idx) * CART_FRAME_SIZE)
+
+#define CACHE_QUEUE_A1IN 0		// 2Q probation queue (FIFO, first reference)
+#define CACHE_QUEUE_AM   1		// 2Q protected queue (LRU, re-referenced)
+#define CACHE_LFU_AGING_FACTOR 8	// LFU counts are halved every max*factor references
+
 typedef struct{
-	char data[CART_FRAME_SIZE];	// the text in the frame
-	unsigned int indicator;		// indicator of last use or hit times base on cache mode
-	int cart;
-	int frame;
-}CacheFrame;
+	uint32_t key;	// packed cart/frame, CACHE_EMPTY_KEY if the slot is unused
+	int idx;	// index of the cache frame holding it
+}CacheIndexEntry;
+
+#define CACHE_KEY(cart, frame) (((uint32_t)(cart) << 16) | (uint32_t)(frame))
+#define CACHE_KEY_CART(key) ((key) >> 16)
+#define CACHE_KEY_FRAME(key) ((key) & 0xffff)
+#define CACHE_EMPTY_KEY 0xffffffff
+#define CACHE_HASH_MULTIPLIER 2654435761u	// Knuth multiplicative hash
 
 // Global data
 uint32_t max;
 
-CacheFrame *cache;	// All the cache frame
+// Cache frame metadata lives in dense parallel arrays, apart from the payload,
+// so victim scans and bookkeeping never pull frame data into the CPU cache
+
+unsigned int *cache_indicator;	// indicator of last use or hit times base on cache mode
+
+uint32_t *cache_key;		// packed cart/frame held by each cache frame
+
+unsigned char *cache_queue;	// 2Q queue each cache frame belongs to (TWOQ only)
+
+char *cache_data;		// Frame payload slab, CART_FRAME_SIZE bytes per cache frame
+
+size_t cache_slab_mapped;	// Length of the slab if it was mmap'd, 0 if from posix_memalign
+
+int slab_alloc_fail;		// Unit test hook, slab allocations fail while set
+
+int cache_initialized;		// Flag indicating the cache is live (between init and close)
+
+unsigned int *cache_last_use;	// Lookup clock at the last use of each cache frame (for victim age)
+
+unsigned int reference_clock;	// Lookups and puts seen by the cache
 
-int cache_map_table[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	// Idx of the cach frame for each frame
+CartCacheStats cache_stats;	// Counters reported by get_cart_cache_stats
+
+uint32_t stats_interval;	// Log the counters every this many lookups, 0 if off
+
+FILE *trace_file;		// Lookup trace being recorded, NULL if off
+
+CacheIndexEntry *cache_index;	// Open-addressing index from cart/frame to cache frame
+
+uint32_t index_bits;	// The index holds 1 << index_bits slots
 
 unsigned int count;	// The number of frame left
 
 ReplacementPolicy replacement_policy = LRU;
 
+unsigned int access_clock;	// Logical clock for LRU/2Q recency
+
+unsigned int lfu_references;	// References since the last LFU aging pass
+
+unsigned int probation_count;	// Number of frames in the 2Q A1in queue
+
+int *ghost_list;		// Ring of keys recently evicted from A1in (2Q A1out)
+
+unsigned int ghost_max;		// Capacity of the ghost ring
+
+unsigned int ghost_next;	// Next slot to overwrite in the ghost ring
+
+CacheIndexEntry *ghost_index;	// Open-addressing set of the ghost keys, to their ring slots
+
+uint32_t ghost_bits;		// The ghost index holds 1 << ghost_bits slots
+
 //
 // Functions
 
 // Determine the frame to replace from cache
-int frame_to_replace(int *cart, int *frame);
+int frame_to_replace(void);
 
 // Update the indicator base on the replacement policy
-int update_indicator(CacheFrame *cache);
+int update_indicator(int idx);
+
+// Allocate an aligned frame payload slab
+char *alloc_frame_slab(uint32_t frames, size_t *mapped);
+
+// Release a frame payload slab
+int free_frame_slab(char *slab, size_t mapped);
+
+// Build the index for the current capacity from the frames held
+int build_cache_index(void);
+
+// Take a frame out of the cache, keeping the frame arrays dense
+int remove_frame(int idx);
+
+// Grow or shrink a live cache, keeping as many frames as fit
+int resize_cart_cache(uint32_t max_frames);
+
+// Account a frame leaving the cache to make room
+int note_eviction(int idx);
+
+// Find the cache frame holding a cart/frame
+int index_lookup(int cart, int frame);
+
+// Record the cache frame holding a cart/frame
+int index_insert(int cart, int frame, int idx);
+
+// Forget the cache frame holding a cart/frame
+int index_remove(int cart, int frame);
+
+// Find a key in an open-addressing table
+int probe_lookup(CacheIndexEntry *table, uint32_t bits, uint32_t key);
+
+// Add or update a key in an open-addressing table
+int probe_insert(CacheIndexEntry *table, uint32_t bits, uint32_t key, int idx);
+
+// Take a key out of an open-addressing table
+int probe_remove(CacheIndexEntry *table, uint32_t bits, uint32_t key);
+
+// Halve every LFU reference count
+int age_lfu_counts(void);
+
+// Set up the replacement state of a frame entering the cache
+int admit_frame(int idx);
+
+// Check (and consume) a frame in the 2Q ghost ring
+int ghost_lookup(int cart, int frame);
+
+// Remember a frame evicted from the 2Q probation queue
+int ghost_insert(int cart, int frame);
+
+// Allocate an empty ghost ring and its index for the current capacity
+int alloc_ghost_ring(void);
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function	: frame_to_replace
 // Description	: Determine the frame to replace
 // 
-// Input	: cart - Output parameter for the cart of the frame
-// 		: frame - Output parameter for the frame number
-// Output	: 0 if successful
+// Input	: none
+// Output	: the index of the cache frame to replace
 
-int frame_to_replace(int *cart, int *frame){
+int frame_to_replace(void){
+
+	int victim = 0;
 
 	//Check the replacement policy
-	if (replacement_policy == LRU){
-		//LRU replacement policy
+	if (replacement_policy == LRU || replacement_policy == LFU){
+		//LRU replacement policy, or LFU with counts aged in update_indicator
 		unsigned int min = 0;
 		min = ~min;		//flip the bit set to max
 
 		//find the frame with minmum indicator
 		for (unsigned int i = 0; i < count; ++i){
-			if (min > cache[i].indicator){
-				*cart = cache[i].cart;
-				*frame = cache[i].frame;
-				min = cache[i].indicator;
+			if (min > cache_indicator[i]){
+				victim = i;
+				min = cache_indicator[i];
 			}
 		}
-	} else if (replacement_policy == LFU){
-		//LFU relacement policy
-		int set = 0;		// Flag indicate if the victim is determined
+
+	} else if (replacement_policy == TWOQ){
+		//2Q replacement policy
 		unsigned int min = 0;
+		int queue;
 		min = ~min;
-		
-		//find the frame with minmum indicator and greater than 100
-		for (unsigned int i = 0; i  < count; ++i){
-			// Check if the indicator greater than 100
-			if (cache[i].indicator >= 100){
-				if (min > cache[i].indicator){
-					*cart = cache[i].cart;
-					*frame = cache[i].frame;
-					min = cache[i].indicator;	
-					set = 1;
-				}
-			}
 
-		
-		}
-		
-		// Check if the victim is ont determined
-		if (set == 0){
-			for (unsigned int i = 0; i < count; ++i){
-				if (min > cache[i].indicator){
-					*cart = cache[i].cart;
-					*frame = cache[i].frame;
-					min = cache[i].indicator;
-				}
-			
+		//evict from probation while it is over its share, protected otherwise
+		queue = (probation_count > (max / 4) || probation_count == count) ? CACHE_QUEUE_A1IN : CACHE_QUEUE_AM;
+
+		//find the oldest frame in the chosen queue
+		for (unsigned int i = 0; i < count; ++i){
+			if (cache_queue[i] == queue && min > cache_indicator[i]){
+				victim = i;
+				min = cache_indicator[i];
 			}
-			
-		} 
-		
+		}
+
 	} else {
 		// Random replacement policy
-		int idx;
-		idx = getRandomValue(0, count-1);
-		*cart = cache[idx].cart;
-		*frame = cache[idx].frame;
+		victim = getRandomValue(0, count-1);
 
 	}
 
-	return 0;
+	return victim;
 
 }
 
@@ -126,22 +215,34 @@ int frame_to_replace(int *cart, int *frame){
 // Function	: update_indicator
 // Description	: Update the indicator base on the replacement policy etermine the frame to replace
 // 
-// Input	: cache - the frame whose indicator need to be updated
+// Input	: idx - the cache frame whose indicator need to be updated
 // Output	: 0 if successful
 
-int update_indicator(CacheFrame *cache){
+int update_indicator(int idx){
 
 	//Check the replacement policy
 	if (replacement_policy == LRU){
 		//LRU replacement policy
-		static unsigned int recent_used = 0;
-		cache->indicator = recent_used;
-		recent_used += 1;
+		cache_indicator[idx] = access_clock;
+		access_clock += 1;
 		
 	} else if (replacement_policy == LFU){
 		//LFU replacement policy
-		cache->indicator += 1;
+		cache_indicator[idx] += 1;
+		lfu_references += 1;
+
+		//age all counts so old popularity decays
+		if (lfu_references >= max * CACHE_LFU_AGING_FACTOR){
+			age_lfu_counts();
+		}
 		
+	} else if (replacement_policy == TWOQ){
+		//2Q replacement policy, only protected frames are reordered
+		if (cache_queue[idx] == CACHE_QUEUE_AM){
+			cache_indicator[idx] = access_clock;
+			access_clock += 1;
+		}
+
 	} else {
 		//Random replacement policy
 		
@@ -151,16 +252,545 @@ int update_indicator(CacheFrame *cache){
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: probe_lookup
+// Description	: Find a key in an open-addressing table, probing linearly
+//		  from the hashed slot
+// 
+// Input	: table - the table
+// 		: bits - the table holds 1 << bits slots
+// 		: key - the packed cart/frame
+// Output	: the value stored with the key, -1 if not there
+
+int probe_lookup(CacheIndexEntry *table, uint32_t bits, uint32_t key){
+
+	uint32_t mask = (1u << bits) - 1;
+	uint32_t slot = (key * CACHE_HASH_MULTIPLIER) >> (32 - bits);
+
+	// walk the probe sequence until the key or an empty slot
+	while (table[slot].key != CACHE_EMPTY_KEY){
+		if (table[slot].key == key){
+			return table[slot].idx;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return -1;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: probe_insert
+// Description	: Add a key to an open-addressing table, or update its value
+// 
+// Input	: table - the table (kept at most half full)
+// 		: bits - the table holds 1 << bits slots
+// 		: key - the packed cart/frame
+// 		: idx - the value to store with it
+// Output	: 0 if successful
+
+int probe_insert(CacheIndexEntry *table, uint32_t bits, uint32_t key, int idx){
+
+	uint32_t mask = (1u << bits) - 1;
+	uint32_t slot = (key * CACHE_HASH_MULTIPLIER) >> (32 - bits);
+
+	// the table is at most half full, so a free slot always exists
+	while (table[slot].key != CACHE_EMPTY_KEY && table[slot].key != key){
+		slot = (slot + 1) & mask;
+	}
+
+	table[slot].key = key;
+	table[slot].idx = idx;
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: probe_remove
+// Description	: Take a key out of an open-addressing table, shifting later
+//		  entries of the probe run back so no tombstones are needed
+// 
+// Input	: table - the table
+// 		: bits - the table holds 1 << bits slots
+// 		: key - the packed cart/frame
+// Output	: the value that was stored with the key, -1 if not there
+
+int probe_remove(CacheIndexEntry *table, uint32_t bits, uint32_t key){
+
+	uint32_t mask = (1u << bits) - 1;
+	uint32_t slot = (key * CACHE_HASH_MULTIPLIER) >> (32 - bits);
+	int idx;
+
+	// find the slot of the key
+	while (table[slot].key != key){
+		if (table[slot].key == CACHE_EMPTY_KEY) return -1;
+		slot = (slot + 1) & mask;
+	}
+	idx = table[slot].idx;
+
+	// backward shift the rest of the run into the hole
+	uint32_t hole = slot;
+	uint32_t next = (slot + 1) & mask;
+	while (table[next].key != CACHE_EMPTY_KEY){
+		uint32_t home = (table[next].key * CACHE_HASH_MULTIPLIER) >> (32 - bits);
+
+		// move the entry if its home is not between the hole and its slot
+		if (((next - home) & mask) >= ((next - hole) & mask)){
+			table[hole] = table[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	table[hole].key = CACHE_EMPTY_KEY;
+
+	return idx;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: index_lookup
+// Description	: Find the cache frame holding a cart/frame
+// 
+// Input	: cart - the cart of the frame
+// 		: frame - the frame number
+// Output	: the cache frame index, -1 if not cached
+
+int index_lookup(int cart, int frame){
+
+	if (cache_index == NULL) return -1;
+
+	return probe_lookup(cache_index, index_bits, CACHE_KEY(cart, frame));
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: index_insert
+// Description	: Record the cache frame holding a cart/frame
+// 
+// Input	: cart - the cart of the frame
+// 		: frame - the frame number
+// 		: idx - the cache frame holding it
+// Output	: 0 if successful
+
+int index_insert(int cart, int frame, int idx){
+
+	return probe_insert(cache_index, index_bits, CACHE_KEY(cart, frame), idx);
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: index_remove
+// Description	: Forget the cache frame holding a cart/frame
+// 
+// Input	: cart - the cart of the frame
+// 		: frame - the frame number
+// Output	: 0 if successful, -1 if not in the index
+
+int index_remove(int cart, int frame){
+
+	return (probe_remove(cache_index, index_bits, CACHE_KEY(cart, frame)) == -1) ? -1 : 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: age_lfu_counts
+// Description	: Halve every LFU reference count, so frames that were popular
+//		  long ago do not pin the cache forever
+// 
+// Input	: none
+// Output	: 0 if successful
+
+int age_lfu_counts(void){
+
+	for (unsigned int i = 0; i < count; ++i){
+		cache_indicator[i] >>= 1;
+	}
+	lfu_references = 0;
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: admit_frame
+// Description	: Set up the replacement state of a frame entering the cache,
+//		  under 2Q frames seen again shortly after leaving probation
+//		  go straight to the protected queue
+// 
+// Input	: idx - the cache frame being admitted (key already set)
+// Output	: 0 if successful
+
+int admit_frame(int idx){
+
+	cache_indicator[idx] = 0;
+
+	if (replacement_policy == TWOQ){
+		if (ghost_lookup(CACHE_KEY_CART(cache_key[idx]), CACHE_KEY_FRAME(cache_key[idx]))){
+			cache_queue[idx] = CACHE_QUEUE_AM;
+		} else {
+			cache_queue[idx] = CACHE_QUEUE_A1IN;
+			probation_count += 1;
+		}
+		cache_indicator[idx] = access_clock;
+		access_clock += 1;
+	} else {
+		cache_queue[idx] = CACHE_QUEUE_AM;
+		update_indicator(idx);
+	}
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: ghost_lookup
+// Description	: Check if a frame is remembered in the 2Q ghost ring, and
+//		  consume the entry if it is
+// 
+// Input	: cart - the cart of the frame
+// 		: frame - the frame number
+// Output	: 1 if found, 0 if not
+
+int ghost_lookup(int cart, int frame){
+
+	int slot;
+
+	if (ghost_index == NULL) return 0;
+
+	slot = probe_remove(ghost_index, ghost_bits, CACHE_KEY(cart, frame));
+	if (slot == -1) return 0;
+	ghost_list[slot] = -1;
+
+	return 1;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: ghost_insert
+// Description	: Remember a frame evicted from the 2Q probation queue
+// 
+// Input	: cart - the cart of the frame
+// 		: frame - the frame number
+// Output	: 0 if successful
+
+int ghost_insert(int cart, int frame){
+
+	uint32_t key = CACHE_KEY(cart, frame);
+	int slot;
+
+	if (ghost_max == 0 || ghost_index == NULL) return 0;
+
+	// a frame already remembered moves to the new end of the ring
+	if ((slot = probe_remove(ghost_index, ghost_bits, key)) != -1){
+		ghost_list[slot] = -1;
+	}
+
+	// overwrite the oldest ghost
+	if (ghost_list[ghost_next] != -1){
+		probe_remove(ghost_index, ghost_bits, (uint32_t)ghost_list[ghost_next]);
+	}
+	ghost_list[ghost_next] = key;
+	probe_insert(ghost_index, ghost_bits, key, ghost_next);
+	ghost_next = (ghost_next + 1) % ghost_max;
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: alloc_ghost_ring
+// Description	: Allocate an empty 2Q ghost ring of half the cache size, and
+//		  the index of its keys
+// 
+// Input	: none
+// Output	: 0 if successful, -1 if failure (2Q then runs without ghosts)
+
+int alloc_ghost_ring(void){
+
+	free(ghost_list);
+	free(ghost_index);
+	ghost_next = 0;
+
+	// size the index to at least twice the ring so probe runs stay short
+	ghost_max = max / 2;
+	ghost_bits = 4;
+	while ((1u << ghost_bits) < 2 * ghost_max) ghost_bits += 1;
+	ghost_list = malloc((ghost_max + 1) * sizeof(int));
+	ghost_index = malloc((1u << ghost_bits) * sizeof(CacheIndexEntry));
+	if (ghost_list == NULL || ghost_index == NULL){
+		free(ghost_list);
+		free(ghost_index);
+		ghost_list = NULL;
+		ghost_index = NULL;
+		ghost_max = 0;
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < ghost_max; ++i){
+		ghost_list[i] = -1;
+	}
+	for (uint32_t i = 0; i < (1u << ghost_bits); ++i){
+		ghost_index[i].key = CACHE_EMPTY_KEY;
+	}
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: alloc_frame_slab
+// Description	: Allocate the frame payload slab on a cache line boundary,
+//		  large slabs are mmap'd and hinted for transparent hugepages
+// 
+// Input	: frames - the number of frames the slab holds
+//		  mapped - output, the mapped length, 0 if not mmap'd
+// Output	: pointer to the slab, NULL if failure
+
+char *alloc_frame_slab(uint32_t frames, size_t *mapped){
+
+	size_t size = (size_t)frames * CART_FRAME_SIZE;
+	void *slab = NULL;
+
+	*mapped = 0;
+	if (size == 0) return NULL;
+
+	// The unit test makes it fail on purpose
+	if (slab_alloc_fail){
+		logMessage(LOG_ERROR_LEVEL, "Cache slab allocation of %u frames failed.", frames);
+		return NULL;
+	}
+
+	// Check if it is worth backing by hugepages
+	if (size >= CACHE_HUGEPAGE_THRESHOLD){
+		slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slab != MAP_FAILED){
+#ifdef MADV_HUGEPAGE
+			madvise(slab, size, MADV_HUGEPAGE);
+#endif
+			*mapped = size;
+			return slab;
+		}
+	}
+
+	if (posix_memalign(&slab, CACHE_LINE_SIZE, size) != 0){
+		logMessage(LOG_ERROR_LEVEL, "Cache slab allocation of %u frames failed.", frames);
+		return NULL;
+	}
+
+	return slab;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: free_frame_slab
+// Description	: Release a frame payload slab
+// 
+// Input	: slab - the slab to release
+//		  mapped - the mapped length from alloc_frame_slab
+// Output	: 0 if successful
+
+int free_frame_slab(char *slab, size_t mapped){
+
+	if (mapped){
+		munmap(slab, mapped);
+	} else {
+		free(slab);
+	}
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: build_cache_index
+// Description	: Allocate the index for the current capacity and fill it
+//		  from the frames held, keeping the old index if that fails
+// 
+// Input	: none
+// Output	: 0 if successful, -1 if failure
+
+int build_cache_index(void){
+
+	CacheIndexEntry *new_index;
+	uint32_t new_bits = 4;
+
+	// size the index to at least twice the cache so probe runs stay short
+	while ((1u << new_bits) < 2 * max) new_bits += 1;
+	new_index = malloc((1u << new_bits) * sizeof(CacheIndexEntry));
+	if (new_index == NULL) return -1;
+	free(cache_index);
+	cache_index = new_index;
+	index_bits = new_bits;
+	for (uint32_t i = 0; i < (1u << index_bits); ++i){
+		cache_index[i].key = CACHE_EMPTY_KEY;
+	}
+
+	for (unsigned int i = 0; i < count; ++i){
+		index_insert(CACHE_KEY_CART(cache_key[i]), CACHE_KEY_FRAME(cache_key[i]), i);
+	}
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: remove_frame
+// Description	: Take a frame out of the cache, moving the last frame into
+//		  the hole so the frame arrays stay dense
+// 
+// Input	: idx - the cache frame to remove
+// Output	: 0 if successful
+
+int remove_frame(int idx){
+
+	// Invalidate map
+	index_remove(CACHE_KEY_CART(cache_key[idx]), CACHE_KEY_FRAME(cache_key[idx]));
+	if (cache_queue[idx] == CACHE_QUEUE_A1IN) probation_count -= 1;
+
+	// Move the last frame into the hole
+	count -= 1;
+	if (idx != count){
+		cache_indicator[idx] = cache_indicator[count];
+		cache_key[idx] = cache_key[count];
+		cache_queue[idx] = cache_queue[count];
+		cache_last_use[idx] = cache_last_use[count];
+		memcpy(CACHE_FRAME_DATA(idx), CACHE_FRAME_DATA(count), CART_FRAME_SIZE);
+		index_insert(CACHE_KEY_CART(cache_key[idx]), CACHE_KEY_FRAME(cache_key[idx]), idx);
+	}
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: resize_cart_cache
+// Description	: Grow or shrink a live cache. Growing keeps every frame,
+//		  shrinking evicts by the replacement policy until the rest fit
+// 
+// Input	: max_frames - the new capacity
+// Output	: 0 if successful, -1 if failure
+
+int resize_cart_cache(uint32_t max_frames){
+
+	uint32_t old_max = max;
+	size_t new_mapped = 0;
+	char *new_data;
+	unsigned int *new_indicator, *new_last_use;
+	uint32_t *new_key;
+	unsigned char *new_queue;
+
+	// the new slab comes first, a grow without one changes nothing
+	new_data = alloc_frame_slab(max_frames, &new_mapped);
+	if (new_data == NULL && max_frames > old_max){
+		logMessage(LOG_ERROR_LEVEL, "Cache resize from %u to %u frames failed.", old_max, max_frames);
+		return -1;
+	}
+
+	// evict down to the new capacity
+	max = max_frames;
+	while (count > max){
+		int victim = frame_to_replace();
+		note_eviction(victim);
+		if (replacement_policy == TWOQ && cache_queue[victim] == CACHE_QUEUE_A1IN){
+			ghost_insert(CACHE_KEY_CART(cache_key[victim]), CACHE_KEY_FRAME(cache_key[victim]));
+		}
+		remove_frame(victim);
+	}
+
+	// metadata arrays follow the capacity, a failed shrink keeps the larger array
+	new_indicator = realloc(cache_indicator, (max + 1) * sizeof(unsigned int));
+	if (new_indicator != NULL) cache_indicator = new_indicator;
+	new_key = realloc(cache_key, (max + 1) * sizeof(uint32_t));
+	if (new_key != NULL) cache_key = new_key;
+	new_queue = realloc(cache_queue, (max + 1) * sizeof(unsigned char));
+	if (new_queue != NULL) cache_queue = new_queue;
+	new_last_use = realloc(cache_last_use, (max + 1) * sizeof(unsigned int));
+	if (new_last_use != NULL) cache_last_use = new_last_use;
+	if (max > old_max && (new_indicator == NULL || new_key == NULL || new_queue == NULL || new_last_use == NULL)){
+		logMessage(LOG_ERROR_LEVEL, "Cache resize from %u to %u frames failed.", old_max, max);
+		free_frame_slab(new_data, new_mapped);
+		max = old_max;
+		return -1;
+	}
+
+	// move the payload to the new slab, a failed shrink keeps the larger one
+	if (new_data != NULL || max == 0){
+		if (count > 0) memcpy(new_data, cache_data, (size_t)count * CART_FRAME_SIZE);
+		free_frame_slab(cache_data, cache_slab_mapped);
+		cache_data = new_data;
+		cache_slab_mapped = new_mapped;
+	}
+
+	// the old index is sized for the old capacity, which every array still fits
+	if (build_cache_index() == -1){
+		logMessage(LOG_ERROR_LEVEL, "Cache resize from %u to %u frames failed.", old_max, max);
+		if (max > old_max) max = old_max;
+		return -1;
+	}
+
+	// the ghost ring restarts at half the new size
+	alloc_ghost_ring();
+
+	logMessage(LOG_INFO_LEVEL, "Cache resized from %u to %u frames, %u frames kept.", old_max, max, count);
+
+	return 0;
+
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: note_eviction
+// Description	: Account a frame leaving the cache to make room
+// 
+// Input	: idx - the victim cache frame
+// Output	: 0 if successful
+
+int note_eviction(int idx){
+
+	unsigned int age = reference_clock - cache_last_use[idx];
+
+	cache_stats.evictions += 1;
+	cache_stats.policy_evictions[replacement_policy] += 1;
+	cache_stats.policy_victim_age[replacement_policy] += age;
+	if (age > cache_stats.victim_age_max) cache_stats.victim_age_max = age;
+	if (age > cache_stats.policy_victim_age_max[replacement_policy]) cache_stats.policy_victim_age_max[replacement_policy] = age;
+
+	return 0;
+
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : set_cart_cache_size
-// Description  : Set the size of the cache (must be called before init)
+// Description  : Set the size of the cache, a live cache is resized in place
 //
 // Inputs       : max_frames - the maximum number of items your cache can hold
 // Outputs      : 0 if successful, -1 if failure
 
 int set_cart_cache_size(uint32_t max_frames) {
 	
+	// Check if the cache is live
+	if (cache_initialized){
+		return resize_cart_cache(max_frames);
+	}
+
 	max = max_frames;
 	
 	return 0;
@@ -176,18 +806,29 @@ int set_cart_cache_size(uint32_t max_frames) {
 
 int init_cart_cache(void) {
 	
-	//allocate memory for cache
-	cache = malloc(max * sizeof(CacheFrame));
-	
-	// initilize cache map
-	for (int i = 0; i < CART_MAX_CARTRIDGES; ++i){
-		for (int j = 0; j < CART_CARTRIDGE_SIZE; ++j){
-			cache_map_table[i][j] = -1;
-		}
-	}
+	//allocate memory for cache metadata and payload
+	cache_indicator = malloc(max * sizeof(unsigned int));
+	cache_key = malloc(max * sizeof(uint32_t));
+	cache_queue = malloc(max * sizeof(unsigned char));
+	cache_last_use = malloc(max * sizeof(unsigned int));
+	cache_data = alloc_frame_slab(max, &cache_slab_mapped);
+
+	//allocate the 2Q ghost ring, half the cache size
+	alloc_ghost_ring();
 	
 	// initilize number of frame
 	count = 0;
+	probation_count = 0;
+	lfu_references = 0;
+
+	// start the counters over
+	memset(&cache_stats, 0x0, sizeof(CartCacheStats));
+	reference_clock = 0;
+
+	// build the empty index
+	build_cache_index();
+
+	cache_initialized = 1;
 
 	return 0;
 }
@@ -202,8 +843,25 @@ int init_cart_cache(void) {
 
 int close_cart_cache(void) {
 	
-	free(cache);
-	cache = NULL;
+	free(cache_indicator);
+	cache_indicator = NULL;
+	free(cache_key);
+	cache_key = NULL;
+	free(cache_queue);
+	cache_queue = NULL;
+	free(cache_last_use);
+	cache_last_use = NULL;
+	free_frame_slab(cache_data, cache_slab_mapped);
+	cache_data = NULL;
+	cache_slab_mapped = 0;
+	free(cache_index);
+	cache_index = NULL;
+	free(ghost_list);
+	ghost_list = NULL;
+	free(ghost_index);
+	ghost_index = NULL;
+	ghost_max = 0;
+	cache_initialized = 0;
 	return 0;
 }
 
@@ -221,26 +879,32 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
 	
 	if (max == 0) return 0;
 
+	int idx = index_lookup(cart, frm);
+	reference_clock += 1;
+
 	//Check if the frame in the cache
-	if (cache_map_table[cart][frm] != -1){
+	if (idx != -1){
 
 		// have a deep copy of the data
-		memcpy(cache[cache_map_table[cart][frm]].data, buf, CART_FRAME_SIZE);
-		update_indicator(cache + cache_map_table[cart][frm]);
+		memcpy(CACHE_FRAME_DATA(idx), buf, CART_FRAME_SIZE);
+		update_indicator(idx);
+		cache_last_use[idx] = reference_clock;
+		cache_stats.updates += 1;
 		
 	} else if (count < max){
 		// cache is not full
 		
 		// have a deep copy of the data
-		memcpy(cache[count].data, buf, CART_FRAME_SIZE);
+		memcpy(CACHE_FRAME_DATA(count), buf, CART_FRAME_SIZE);
 
 		// update the info of the frame
-		update_indicator(cache + count);
-		cache[count].cart = cart;
-		cache[count].frame = frm;
+		cache_key[count] = CACHE_KEY(cart, frm);
+		cache_last_use[count] = reference_clock;
+		admit_frame(count);
+		cache_stats.insertions += 1;
 
 		// set the map table
-		cache_map_table[cart][frm] = count;
+		index_insert(cart, frm, count);
 
 		// update left_count
 		count += 1;
@@ -252,21 +916,32 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
 		int curCacheIdx;		// Current working frame that need to be replaced
 
 		// determind which frame to be replaced
-		frame_to_replace(&curCart, &curFrame);
-		curCacheIdx = cache_map_table[curCart][curFrame];
+		curCacheIdx = frame_to_replace();
+		note_eviction(curCacheIdx);
+		curCart = CACHE_KEY_CART(cache_key[curCacheIdx]);
+		curFrame = CACHE_KEY_FRAME(cache_key[curCacheIdx]);
 
 		// have a deep copy of the data
-		memcpy(cache[curCacheIdx].data, buf, CART_FRAME_SIZE);
+		memcpy(CACHE_FRAME_DATA(curCacheIdx), buf, CART_FRAME_SIZE);
+
+		// check if the victim leaves the 2Q probation queue, whatever the policy is now
+		int probation_victim = (cache_queue[curCacheIdx] == CACHE_QUEUE_A1IN);
 
 		// update the info of the frame
-		if (replacement_policy == LFU) cache[curCacheIdx].indicator = 0;	//Reset the indicator
-		update_indicator(cache + curCacheIdx);
-		cache[curCacheIdx].cart = cart;
-		cache[curCacheIdx].frame = frm;
+		cache_key[curCacheIdx] = CACHE_KEY(cart, frm);
+		cache_last_use[curCacheIdx] = reference_clock;
+		admit_frame(curCacheIdx);
+		cache_stats.insertions += 1;
+
+		// remember probation victims so a quick return is promoted
+		if (probation_victim){
+			probation_count -= 1;
+			if (replacement_policy == TWOQ) ghost_insert(curCart, curFrame);
+		}
 		
 		// update the map table
-		cache_map_table[cart][frm] = curCacheIdx;
-		cache_map_table[curCart][curFrame] = -1;	//Invalidate 
+		index_remove(curCart, curFrame);	//Invalidate 
+		index_insert(cart, frm, curCacheIdx);
 
 	}
 
@@ -284,19 +959,58 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *buf)  {
 
 void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
 
+	int idx = index_lookup(cart, frm);
+	reference_clock += 1;
+
+	// Record the reference if tracing
+	if (trace_file != NULL){
+		uint32_t key = CACHE_KEY(cart, frm);
+		fwrite(&key, sizeof(key), 1, trace_file);
+	}
+
+	// Log the counters periodically if asked to
+	if (stats_interval != 0 && (cache_stats.hits + cache_stats.misses + 1) % stats_interval == 0){
+		log_cart_cache_stats(LOG_INFO_LEVEL);
+	}
+
 	// Check if it is in the cache
-	if (cache_map_table[cart][frm] == -1){
+	if (idx == -1){
 		//not in the cache
+		cache_stats.misses += 1;
 		return NULL;
 	}
 	
 	// Update the indicator
-	update_indicator(cache + cache_map_table[cart][frm]);
+	update_indicator(idx);
+	cache_last_use[idx] = reference_clock;
+	cache_stats.hits += 1;
 
-	return (void *)cache[cache_map_table[cart][frm]].data;	
+	return (void *)CACHE_FRAME_DATA(idx);	
 	
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : peek_cart_cache
+// Description  : Look a frame up without counting it as a use: no hit or
+//                miss, no recency update and no trace record
+//
+// Inputs       : cart - the cartridge number of the cartridge to find
+//                frm - the  number of the frame to find
+// Outputs      : pointer to cached frame or NULL if not found
+
+void * peek_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
+
+	int idx = index_lookup(cart, frm);
+
+	if (idx == -1){
+		return NULL;
+	}
+
+	return (void *)CACHE_FRAME_DATA(idx);
+
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : delete_cart_cache
@@ -308,18 +1022,19 @@ void * get_cart_cache(CartridgeIndex cart, CartFrameIndex frm) {
 
 void * delete_cart_cache(CartridgeIndex cart, CartFrameIndex blk) {
 	void *buf;	//buf to store the data
+	int idx = index_lookup(cart, blk);
+
+	// Check if it is in the cache
+	if (idx == -1) return NULL;
 	
 	// Allocate memory
 	buf = malloc(CART_FRAME_SIZE * sizeof(char));
 
 	// Have a deep copy of data
-	memcpy(buf, cache[cache_map_table[cart][blk]].data, CART_FRAME_SIZE);
+	memcpy(buf, CACHE_FRAME_DATA(idx), CART_FRAME_SIZE);
 
-	// Set the indicator to zero
-	cache[cache_map_table[cart][blk]].indicator = 0;
-
-	// Invalidate map
-	cache_map_table[cart][blk] = -1;
+	// Invalidate map and keep the cache dense
+	remove_frame(idx);
 
 	return buf;	
 }
@@ -339,6 +1054,97 @@ int set_replacement_policy(ReplacementPolicy policy){
 	return 0;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : get_cart_cache_stats
+// Description  : Copy out the cache counters
+//
+// Inputs       : stats - the structure to fill
+// Outputs      : 0 if success 
+
+int get_cart_cache_stats(CartCacheStats *stats){
+
+	*stats = cache_stats;
+	stats->frames = count;
+	stats->capacity = max;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : log_cart_cache_stats
+// Description  : Write the cache counters to the log
+//
+// Inputs       : lvl - the log level to write at
+// Outputs      : 0 if success 
+
+int log_cart_cache_stats(unsigned long lvl){
+
+	const char *policy_names[CART_CACHE_POLICIES] = { "LRU", "LFU", "RANDOM", "2Q" };
+	CartCacheStats stats;
+	uint64_t lookups;
+
+	get_cart_cache_stats(&stats);
+	lookups = stats.hits + stats.misses;
+
+	logMessage(lvl, "Cache [%s] %u/%u frames, %" PRIu64 " lookups, %" PRIu64 " hits, %" PRIu64 " misses, hit rate %.2f%%",
+		policy_names[replacement_policy], stats.frames, stats.capacity, lookups, stats.hits,
+		stats.misses, (lookups == 0) ? 0.0 : 100.0 * stats.hits / lookups);
+	logMessage(lvl, "Cache %" PRIu64 " insertions, %" PRIu64 " updates, %" PRIu64 " evictions, %" PRIu64 " write-backs",
+		stats.insertions, stats.updates, stats.evictions, stats.writebacks);
+	for (int i = 0; i < CART_CACHE_POLICIES; ++i){
+		if (stats.policy_evictions[i] == 0) continue;
+		logMessage(lvl, "Cache %s victims: %" PRIu64 ", mean age %.1f references (oldest %" PRIu64 ")", policy_names[i],
+			stats.policy_evictions[i], (double)stats.policy_victim_age[i] / stats.policy_evictions[i],
+			stats.policy_victim_age_max[i]);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_stats_interval
+// Description  : Log the counters every "lookups" cache lookups
+//
+// Inputs       : lookups - the logging period, 0 disables it
+// Outputs      : 0 if success 
+
+int set_cart_cache_stats_interval(uint32_t lookups){
+
+	stats_interval = lookups;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : set_cart_cache_trace
+// Description  : Start recording every cache lookup to a trace file, for
+//                offline sizing with cart_mrc
+//
+// Inputs       : path - the trace file to create, NULL to stop tracing
+// Outputs      : 0 if success, -1 if failure
+
+int set_cart_cache_trace(const char *path){
+
+	// Close any trace in progress
+	if (trace_file != NULL){
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+
+	if (path == NULL) return 0;
+
+	if ((trace_file = fopen(path, "w")) == NULL){
+		logMessage(LOG_ERROR_LEVEL, "Failure opening cache trace [%s].", path);
+		return -1;
+	}
+
+	return 0;
+}
+
 //
 // Unit test
 
@@ -355,42 +1161,226 @@ int cartCacheUnitTest(void) {
 	void *randomData;
 	int cart;
 	int frame;
-
-	init_cart_cache();
+	ReplacementPolicy saved_policy = replacement_policy;
 
 	randomData = malloc(1024 * sizeof(char));
 
-	for (int i = 0; i < 10000; ++i){
+	// exercise every replacement policy
+	for (int policy = LRU; policy <= TWOQ; ++policy){
 
-		// generata
-		cart = getRandomValue(0, 63);
-		frame = getRandomValue(0, 1023);
-		getRandomData((char *)randomData, 1024);
-		
-		// Check if it is in the cache
-		if (cache_map_table[cart][frame] == -1){
-			// Not in the frame
-			if (get_cart_cache(cart, frame) != NULL) return -1;	// Test Fail if data read from cahce
+		set_replacement_policy(policy);
+		init_cart_cache();
 
-		} else {
-			// In the frame
-			if (get_cart_cache(cart, frame) == NULL) return -1;	// Test Fail if data read from cahce
+		for (int i = 0; i < 10000; ++i){
+
+			// generata
+			cart = getRandomValue(0, 63);
+			frame = getRandomValue(0, 1023);
+			getRandomData((char *)randomData, 1024);
+			
+			// Check if it is in the cache
+			if (index_lookup(cart, frame) == -1){
+				// Not in the frame
+				if (get_cart_cache(cart, frame) != NULL) return -1;	// Test Fail if data read from cahce
+
+			} else {
+				// In the frame
+				if (get_cart_cache(cart, frame) == NULL) return -1;	// Test Fail if data read from cahce
+			}
+
+			// generate random number
+			cart = getRandomValue(0, 63);
+			frame = getRandomValue(0, 1023);
+
+			// random frame put
+			put_cart_cache(cart, frame, randomData);
+			
+			if (i%100 == 0) printf("Unit Test Complete: %d%%\r", (i/100));
+			fflush(stdout);
+		}
+
+		// drop a few frames, then every cached frame must be found where it is
+		for (int i = 0; i < 16 && count > 0; ++i){
+			free(delete_cart_cache(CACHE_KEY_CART(cache_key[count / 2]), CACHE_KEY_FRAME(cache_key[count / 2])));
+		}
+		for (unsigned int i = 0; i < count; ++i){
+			if (index_lookup(CACHE_KEY_CART(cache_key[i]), CACHE_KEY_FRAME(cache_key[i])) != (int)i){
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test: index lost frame %u.", i);
+				return -1;
+			}
 		}
 
-		// generate random number
-		cart = getRandomValue(0, 63);
-		frame = getRandomValue(0, 1023);
+		// every ghost must be indexed at its ring slot, and nothing else
+		unsigned int ghosts = 0;
+		for (unsigned int i = 0; i < ghost_max; ++i){
+			if (ghost_list[i] == -1) continue;
+			ghosts += 1;
+			if (probe_lookup(ghost_index, ghost_bits, (uint32_t)ghost_list[i]) != (int)i){
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test: ghost index lost slot %u.", i);
+				return -1;
+			}
+		}
+		for (uint32_t i = 0; ghost_index != NULL && i < (1u << ghost_bits); ++i){
+			ghosts -= (ghost_index[i].key != CACHE_EMPTY_KEY);
+		}
+		if (ghosts != 0){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: ghost index out of step with the ring.");
+			return -1;
+		}
 
-		// random frame put
-		put_cart_cache(cart, frame, randomData);
-		
-		if (i%100 == 0) printf("Unit Test Complete: %d%%\r", (i/100));
-		fflush(stdout);
+		close_cart_cache();
 	}
 
-	free(randomData);
+	// 2Q must keep a re-referenced working set across a long scan
+	if (max >= 4 && max <= 8192){
+		unsigned int hot = max / 2;
 
-	close_cart_cache();
+		set_replacement_policy(TWOQ);
+		init_cart_cache();
+
+		// first touch of the hot set, then push it out of probation
+		for (unsigned int i = 0; i < hot; ++i) put_cart_cache(0, i, randomData);
+		for (unsigned int i = 0; i < max; ++i) put_cart_cache(1 + i / 1024, i % 1024, randomData);
+
+		// second touch promotes the hot set, then scan 4x the cache
+		for (unsigned int i = 0; i < hot; ++i) put_cart_cache(0, i, randomData);
+		for (unsigned int i = max; i < 5 * max; ++i) put_cart_cache(1 + i / 1024, i % 1024, randomData);
+
+		for (unsigned int i = 0; i < hot; ++i){
+			if (get_cart_cache(0, i) == NULL){
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test: 2Q lost hot frame %u to a scan.", i);
+				return -1;
+			}
+		}
+
+		close_cart_cache();
+	}
+
+	// a live resize must keep the contents that still fit
+	if (max >= 4){
+		uint32_t saved_max = max;
+		char *cached;
+
+		init_cart_cache();
+		for (unsigned int i = 0; i < max; ++i){
+			memset(randomData, i & 0xff, CART_FRAME_SIZE);
+			put_cart_cache(2, i, randomData);
+		}
+
+		// shrink to half, then grow back past the original size
+		set_cart_cache_size(saved_max / 2);
+		if (count != saved_max / 2) return -1;
+		set_cart_cache_size(saved_max * 2);
+		for (unsigned int i = 0; i < saved_max; ++i){
+			if ((cached = get_cart_cache(2, i)) == NULL) continue;
+			if (cached[0] != (char)(i & 0xff) || cached[CART_FRAME_SIZE - 1] != (char)(i & 0xff)){
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test: frame %u corrupted by resize.", i);
+				return -1;
+			}
+		}
+		if (count != saved_max / 2) return -1;
+
+		close_cart_cache();
+		set_cart_cache_size(saved_max);
+	}
+
+	// a resize that cannot get its slab leaves a cache that still works:
+	// a shrink keeps the larger slab, a grow keeps the old size
+	{
+		uint32_t saved_max = max;
+		char *cached;
+
+		set_cart_cache_size(64);
+		init_cart_cache();
+		for (unsigned int i = 0; i < 64; ++i){
+			memset(randomData, i & 0xff, CART_FRAME_SIZE);
+			put_cart_cache(3, i, randomData);
+		}
+		slab_alloc_fail = 1;
+		if (set_cart_cache_size(16) != 0 || max != 16 || count != 16){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: shrink without a new slab failed.");
+			slab_alloc_fail = 0;
+			return -1;
+		}
+		if (set_cart_cache_size(128) != -1 || max != 16){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: grow without a new slab changed the size.");
+			slab_alloc_fail = 0;
+			return -1;
+		}
+		slab_alloc_fail = 0;
+
+		// fill it well past the size, every frame found must be whole
+		for (unsigned int i = 0; i < 1024; ++i){
+			memset(randomData, i & 0xff, CART_FRAME_SIZE);
+			put_cart_cache(4, i, randomData);
+		}
+		for (unsigned int i = 0; i < 1024; ++i){
+			if ((cached = get_cart_cache(4, i)) == NULL) continue;
+			if (cached[0] != (char)(i & 0xff) || cached[CART_FRAME_SIZE - 1] != (char)(i & 0xff)){
+				logMessage(LOG_ERROR_LEVEL, "Cache unit test: frame %u corrupted after a failed resize.", i);
+				return -1;
+			}
+		}
+		if (count != 16 || set_cart_cache_size(128) != 0 || max != 128){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: resize after a failed resize went wrong.");
+			return -1;
+		}
+
+		close_cart_cache();
+		set_cart_cache_size(saved_max);
+	}
+
+	// a peek finds the frame but leaves the counters and recency alone
+	{
+		CartCacheStats before;
+		uint32_t saved_max = max;
+		char *cached;
+
+		set_cart_cache_size(16);
+		init_cart_cache();
+		memset(randomData, 0x5a, CART_FRAME_SIZE);
+		put_cart_cache(5, 5, randomData);
+		get_cart_cache_stats(&before);
+		cached = peek_cart_cache(5, 5);
+		if (cached == NULL || cached[0] != 0x5a || peek_cart_cache(5, 6) != NULL ||
+			cache_stats.hits != before.hits || cache_stats.misses != before.misses){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: a peek counted as a lookup.");
+			return -1;
+		}
+		close_cart_cache();
+		set_cart_cache_size(saved_max);
+	}
+
+	// probation frames left by 2Q still leave the count when another policy evicts them
+	{
+		uint32_t saved_max = max;
+		unsigned int in_probation = 0;
+
+		set_cart_cache_size(16);
+		set_replacement_policy(TWOQ);
+		init_cart_cache();
+		for (unsigned int i = 0; i < 16; ++i){
+			put_cart_cache(6, i, randomData);
+		}
+		set_replacement_policy(LRU);
+		delete_cart_cache(6, 0);
+		for (unsigned int i = 16; i < 48; ++i){
+			put_cart_cache(6, i, randomData);
+		}
+		for (unsigned int i = 0; i < count; ++i){
+			in_probation += (cache_queue[i] == CACHE_QUEUE_A1IN);
+		}
+		if (probation_count != in_probation){
+			logMessage(LOG_ERROR_LEVEL, "Cache unit test: probation count %u after a policy change, %u frames in probation.",
+				probation_count, in_probation);
+			return -1;
+		}
+		close_cart_cache();
+		set_cart_cache_size(saved_max);
+	}
+
+	set_replacement_policy(saved_policy);
+	free(randomData);
 
 	// Return successfully
 	logMessage(LOG_OUTPUT_LEVEL, "Cache unit test completed successfully.");
@@ -20,13 +20,31 @@
 typedef	enum {
 	LRU = 0,
 	LFU = 1,
-	RANDOM = 2
+	RANDOM = 2,
+	TWOQ = 3	// 2Q: scan-resistant probation/protected queues
 } ReplacementPolicy;
+
+#define CART_CACHE_POLICIES 4	// Number of replacement policies
+
+typedef struct {
+	uint64_t hits;		// lookups that found the frame
+	uint64_t misses;	// lookups that did not
+	uint64_t insertions;	// frames admitted into the cache
+	uint64_t updates;	// puts that overwrote a cached frame
+	uint64_t evictions;	// frames displaced to make room (or by a shrink)
+	uint64_t writebacks;	// dirty frames written back on eviction (0 while the driver writes through)
+	uint64_t policy_evictions[CART_CACHE_POLICIES];	// evictions under each policy
+	uint64_t policy_victim_age[CART_CACHE_POLICIES];	// summed victim age under each policy
+	uint64_t policy_victim_age_max[CART_CACHE_POLICIES];	// oldest victim under each policy
+	uint64_t victim_age_max;	// oldest victim, in references since its last use
+	uint32_t frames;	// frames currently cached
+	uint32_t capacity;	// capacity in frames
+} CartCacheStats;
 ///
 // Cache Interfaces
 
 int set_cart_cache_size(uint32_t max_frames);
-	// Set the size of the cache (must be called before init)
+	// Set the size of the cache (resizes in place once initialized)
 
 int init_cart_cache(void);
 	// Initialize the cache 
@@ -40,8 +58,27 @@ int put_cart_cache(CartridgeIndex cart, CartFrameIndex frm, void *frame);
 void * get_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
 	// Get an object from the cache (and return it)
 
+void * peek_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
+	// Look an object up for the driver's own use, not counted as a cache lookup
+
+void * delete_cart_cache(CartridgeIndex dsk, CartFrameIndex blk);
+	// Remove an object from the cache, returning a copy the caller frees (NULL if not cached)
+
 int set_replacement_policy(ReplacementPolicy policy);
 	// Set the replacement policy
+
+int get_cart_cache_stats(CartCacheStats *stats);
+	// Copy out the cache counters (kept across close, reset by init)
+
+int log_cart_cache_stats(unsigned long lvl);
+	// Write the cache counters to the log at the given level
+
+int set_cart_cache_stats_interval(uint32_t lookups);
+	// Log the counters every "lookups" lookups (0 disables)
+
+int set_cart_cache_trace(const char *path);
+	// Record every lookup to "path" as 32-bit (cart << 16 | frame) keys
+	// in host order (NULL stops and closes the trace)
 //
 // Unit test
 
@@ -12,78 +12,168 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <gcrypt.h>
 
 // Project Include Files
 #include <cart_network.h>
+#include <cart_codec.h>
+#include <cart_latency.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
+// One drive: a server with its own loaded cartridge
+typedef struct {
+	int socket;			// Connection to the drive's server, -1 if none
+	int loaded_cart;		// Cartridge the last LDCART loaded, -1 if none
+	gcry_cipher_hd_t cipher;	// AES-128 CTR handle of the drive's thread
+} CartDrive;
+
 //
 //  Global data
-int client_socket = -1;
 int                cart_network_shutdown = 0;   // Flag indicating shutdown
 unsigned char     *cart_network_address = NULL; // Address of CART server
 unsigned short     cart_network_port = 0;       // Port of CART serve
+uint64_t           cart_network_ops[CART_OP_MAXVAL]; // Requests sent, per opcode
+uint64_t           cart_network_bytes = 0;      // Bytes sent and received
+int                cart_network_compress = 0;   // Ask the server for packed frames
+int                cart_network_packed = 0;     // Server agreed to packed frames
+int                cart_network_drives = 1;     // Drives, one server each on consecutive ports
 unsigned long      CartControllerLLevel = 0; // Controller log level (global)
 unsigned long      CartDriverLLevel = 0;     // Driver log level (global)
 unsigned long      CartSimulatorLLevel = 0;  // Driver log level (global)
 char key[16];		// Key for encryption
 int key_generated = 0; 		// Flag indicating if key is generated
+CartDrive client_drives[CART_MAX_DRIVES];	// The drives, their cipher handles opened once
+int client_drive = 0;		// Drive of the last cartridge loaded, where frame requests go
+pthread_mutex_t client_stats_lock = PTHREAD_MUTEX_INITIALIZER;	// Protects the counters between drive threads
+uint32_t frame_version[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	// Writes per frame under the key, never reset
+char frame_zeroed[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	// 1 if zeroed by INITMS or BZERO since its last write
 
 //
 // Functions
 
+// Open the frame cipher and generate the key
+int init_frame_cipher(void);
+
+// Encrypt or decrypt one frame (whole or packed) in CTR mode
+int crypt_frame(int drive, int cart, int frame, uint32_t version, void *out, const void *in, int len);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : client_cart_bus_request
 // Description  : This the client operation that sends a request to the CART
-//                server process.   It will:
+//                server process. With more than one drive it is the
+//                controller in front of them: INITMS and POWOFF go to every
+//                drive, LDCART to the drive holding the cartridge, and the
+//                other requests to the drive of the last cartridge loaded.
+//
+// Inputs       : reg - the request reqisters for the command
+//                buf - the block to be read/written from (READ/WRITE)
+// Outputs      : the response structure encoded as needed
+
+CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+
+	int ky1 = reg >> 56;		// the opcode in reg
+	int ct1 = (reg >> 31) & 0xffff;	// the cartridge in reg
+	CartXferRegister rcode = 0;
+
+	if (cart_network_drives < 1 || cart_network_drives > CART_MAX_DRIVES) {
+		logMessage(LOG_ERROR_LEVEL, "Bad drive count [%d]\n", cart_network_drives);
+		return -1;
+	}
+
+	if (ky1 == CART_OP_INITMS || ky1 == CART_OP_POWOFF) {
+		for (int drive = 0; drive < cart_network_drives; drive++) {
+			rcode = client_drive_request(drive, reg, buf);
+			if (rcode == (CartXferRegister)-1 || ((rcode >> 47) & 0x1)) {
+				break;
+			}
+		}
+		client_drive = 0;
+		return rcode;
+	}
+
+	if (ky1 == CART_OP_LDCART) {
+		client_drive = ct1 % cart_network_drives;
+	}
+
+	return client_drive_request(client_drive, reg, buf);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : client_drive_request
+// Description  : Send a request to one drive's server and return the
+//                result. It will:
 //
 //                1) if INIT make a connection to the server
 //                2) send any request to the server, returning results
 //                3) if CLOSE, will close the connection
 //
-// Inputs       : reg - the request reqisters for the command
+//                With several drives, an LDCART of the cartridge the drive
+//                has loaded is answered without going to the server.
+//                Requests to different drives may run in parallel threads:
+//                each drive has its own connection and cipher handle, and
+//                the counters are updated under a lock.
+//
+// Inputs       : drive - the drive, its server listens on port + drive
+//                reg - the request reqisters for the command
 //                buf - the block to be read/written from (READ/WRITE)
 // Outputs      : the response structure encoded as needed
 
-CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
+CartXferRegister client_drive_request(int drive, CartXferRegister reg, void *buf) {
 
 	struct sockaddr_in addr;		
 	char *cart_ip = CART_DEFAULT_IP;	// server ip
+	CartDrive *dr = &client_drives[drive];	// the drive
 	uint64_t code = htonll64(reg);		// network order command to send
 	uint64_t rcode;			// return code
 	int ky1 = reg >> 56;		// the opcode in reg
 	char *message;			// the message to send to the server
 	char *response;			// the response from the server
-	char encrypted[1024];		// the encrypted fram
-	char decrypted[1024];		// decrypted frame
-	gcry_cipher_hd_t hd;		// gcrypt handler
+	char decrypted[CART_PACKED_MAX];	// decrypted frame, packed or whole
+	unsigned char packed[CART_PACKED_MAX];	// the packed frame
+	int size = CART_FRAME_SIZE;	// bytes of frame on the wire
+	int ct1 = (reg >> 31) & 0xffff;	// the cartridge in reg
+	int fm1 = (reg >> 15) & 0xffff;	// the frame in reg
+	uint32_t version = 0;		// version of the frame read or written
+	uint64_t bytes = 0;		// bytes on the wire
 
-	// Initialize gcrypt
-	if (!gcry_check_version("1.6.5")){
-		printf("gcrypt version doesn't match\n");
+	CART_LATENCY_START(bus_start);	// the whole round trip, cipher included
+
+	// Initialize gcrypt and the key once
+	if (!key_generated && init_frame_cipher() == -1) {
 		return -1;
 	}
 
-	gcry_control(GCRYCTL_DISABLE_SECMEM, 0);	// disable secured memory
-	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);	// finish initialization
-	
-	gcry_cipher_open(&hd, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_ECB, 0);	// open gcrypt handler
+	// With several drives a cartridge may still be loaded from before
+	if (ky1 == CART_OP_LDCART && cart_network_drives > 1 && dr->loaded_cart == ct1) {
+		return reg;
+	}
 
-	// generate key
-	if (!key_generated) {
-		getRandomData(key, 16);
-		key_generated = 1;
+	// Frame transfers need a frame of the loaded cartridge
+	if ((ky1 == CART_OP_RDFRME || ky1 == CART_OP_WRFRME) &&
+		(dr->loaded_cart < 0 || dr->loaded_cart >= CART_MAX_CARTRIDGES || fm1 >= CART_CARTRIDGE_SIZE)) {
+		logMessage(LOG_ERROR_LEVEL, "Bad frame address [%d/%d]\n", dr->loaded_cart, fm1);
+		return -1;
 	}
 
-	gcry_cipher_setkey(hd, key, 16);	// set key
+	// Ask for packed frames when the session starts
+	if (ky1 == CART_OP_INITMS && cart_network_compress) {
+		code = htonll64(reg | ((uint64_t)CART_CAP_PACKED << 48));
+	}
 
-	cart_network_port = CART_DEFAULT_PORT;		// set the default port
+	// The server given on the command line, or the default
+	if (cart_network_address != NULL) {
+		cart_ip = (char *)cart_network_address;
+	}
+	if (cart_network_port == 0) {
+		cart_network_port = CART_DEFAULT_PORT;
+	}
 
 	addr.sin_family = AF_INET;
-	addr.sin_port = htons(cart_network_port);
+	addr.sin_port = htons(cart_network_port + drive);
 
 	// if initial cart establish connection
 	if (ky1 == CART_OP_INITMS){
@@ -92,14 +182,16 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 			return -1;
 		}
 
-		client_socket = socket(PF_INET, SOCK_STREAM, 0);
-		if (client_socket == -1){
+		dr->socket = socket(PF_INET, SOCK_STREAM, 0);
+		if (dr->socket == -1){
 			logMessage(LOG_ERROR_LEVEL, "Error on socket creation\n");
 			return -1;
 		}
 
-		if ( connect(client_socket, (const struct sockaddr *)&addr, sizeof(addr)) == -1){
-			logMessage(LOG_ERROR_LEVEL, "Error on connect\n");
+		if ( connect(dr->socket, (const struct sockaddr *)&addr, sizeof(addr)) == -1){
+			logMessage(LOG_ERROR_LEVEL, "Error on connect to drive %d (port %d)\n", drive, cart_network_port + drive);
+			close(dr->socket);
+			dr->socket = -1;
 			return -1;
 		}
 		cart_network_shutdown = 1;
@@ -109,16 +201,37 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 	// Check if it is write frame
 	if (ky1 == CART_OP_WRFRME){
 		// if it is write frame
-		message = malloc(1032*sizeof(char));		// Allocata memory for sent message
+		version = frame_version[dr->loaded_cart][fm1] + 1;		// a new counter for every write
+		if (version == 0) {
+			logMessage(LOG_ERROR_LEVEL, "Frame [%d/%d] has used every counter under the key\n", dr->loaded_cart, fm1);
+			return -1;
+		}
+		message = malloc(8 + 2 + CART_PACKED_MAX);		// Allocata memory for sent message
+
+		// Pack the frame (before encrypting it) when the server takes packed
+		// frames and it comes out smaller, otherwise send all 1024 bytes
+		if (cart_network_packed && (size = pack_frame(buf, packed)) + 2 < CART_FRAME_SIZE) {
+			code = htonll64(reg | ((uint64_t)CART_XFER_PACKED << 48));
+			message[8] = size >> 8;
+			message[9] = size;
+			if (crypt_frame(drive, dr->loaded_cart, fm1, version, message+10, packed, size) == -1) {
+				return -1;
+			}
+			size += 2;
+		} else {
+			size = CART_FRAME_SIZE;
+			if (crypt_frame(drive, dr->loaded_cart, fm1, version, message+8, buf, size) == -1) {		// encrypt frame
+				return -1;
+			}
+		}
 		memcpy(message, &code, 8);		// Copy command code to the beginning of the message
-		gcry_cipher_encrypt(hd, encrypted, 1024, buf, 1024);		// encrypt frame
-		memcpy(message+8, encrypted, 1024);		// Follow by the content in the buf
 		
 		// Sent the message
-		if ( write (client_socket, message, 1032) != 1032){
+		if ( write (dr->socket, message, 8 + size) != 8 + size){
 			logMessage(LOG_ERROR_LEVEL, "Error sending command\n");
 			return -1;
 		}
+		bytes += 8 + size;
 
 	}else{
 		// not write frame
@@ -126,10 +239,11 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 		memcpy(message, &code, 8);		// Copy command code to the message
 
 		// Send the message
-		if ( write (client_socket, message, 8) != 8){
+		if ( write (dr->socket, message, 8) != 8){
 			logMessage(LOG_ERROR_LEVEL, "Error sending command\n");
 			return -1;
 		}
+		bytes += 8;
 
 	}
 	
@@ -137,18 +251,49 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 	if (ky1 == CART_OP_RDFRME){
 
 		// If it is read frame
-		response = malloc(1032*sizeof(char));		// Allocate memory to store the response	
+		response = malloc(8 + 2 + CART_PACKED_MAX);		// Allocate memory to store the response	
 
-		// Recieve the response
-		if (read(client_socket, response, 1032) != 1032){
+		// Recieve the register, then the frame in whichever form it came
+		if (recv(dr->socket, response, 8, MSG_WAITALL) != 8){
 			logMessage(LOG_ERROR_LEVEL, "Error reading return code \n");
 			return -1;
 		}
+		memcpy(&rcode, response, 8);		// Get the return code in network order
 
-		gcry_cipher_decrypt(hd, decrypted, 1024, response+8, 1024);
+		if (cart_network_packed && ((ntohll64(rcode) >> 48) & CART_XFER_PACKED)) {
+			if (recv(dr->socket, response+8, 2, MSG_WAITALL) != 2 ||
+				(size = ((unsigned char)response[8] << 8) | (unsigned char)response[9]) > CART_PACKED_MAX ||
+				recv(dr->socket, response+10, size, MSG_WAITALL) != size) {
+				logMessage(LOG_ERROR_LEVEL, "Error reading packed frame \n");
+				return -1;
+			}
+			bytes += 8 + 2 + size;
+		} else {
+			if (recv(dr->socket, response+8, CART_FRAME_SIZE, MSG_WAITALL) != CART_FRAME_SIZE){
+				logMessage(LOG_ERROR_LEVEL, "Error reading frame \n");
+				return -1;
+			}
+			bytes += 8 + CART_FRAME_SIZE;
+			size = CART_FRAME_SIZE;
+		}
 
-		memcpy(&rcode, response, 8);		// Get the return code in network order
-		memcpy(buf, decrypted, 1024);		// Copy the read content to the buf
+		// A frame never written since it was zeroed holds zeros
+		version = frame_version[dr->loaded_cart][fm1];
+		if (version == 0 || frame_zeroed[dr->loaded_cart][fm1]) {
+			memset(buf, 0x0, 1024);
+		} else if (size == CART_FRAME_SIZE) {
+			if (crypt_frame(drive, dr->loaded_cart, fm1, version, buf, response+8, size) == -1) {
+				return -1;
+			}
+		} else {
+			if (crypt_frame(drive, dr->loaded_cart, fm1, version, decrypted, response+10, size) == -1) {
+				return -1;
+			}
+			if (unpack_frame(decrypted, size, buf) == -1) {
+				logMessage(LOG_ERROR_LEVEL, "Bad packed frame [%d/%d]\n", dr->loaded_cart, fm1);
+				return -1;
+			}
+		}
 
 	}else {
 		
@@ -156,10 +301,11 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 		response = malloc(8 * sizeof(char));	// Allocate memory to store the reaponse
 
 		// Receive the response	
-		if (read(client_socket, response, 8) != 8){
+		if (read(dr->socket, response, 8) != 8){
 			logMessage(LOG_ERROR_LEVEL, "Error reading return code \n");
 			return -1;
 		}
+		bytes += 8;
 
 		memcpy(&rcode, response, 8);		// Get the return code in network order
 	
@@ -167,17 +313,126 @@ CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf) {
 
 	rcode = ntohll64(rcode);		// change to host order
 
+	// Track what the server now holds, on success
+	if (((rcode >> 47) & 0x1) == 0) {
+		if (ky1 == CART_OP_INITMS) {
+			if (drive == 0) {
+				memset(frame_zeroed, 0x1, sizeof(frame_zeroed));
+			}
+			dr->loaded_cart = -1;
+			cart_network_packed = cart_network_compress && ((rcode >> 48) & CART_CAP_PACKED_ACK);
+			if (cart_network_compress && !cart_network_packed) {
+				logMessage(LOG_WARNING_LEVEL, "Server does not take packed frames, sending whole frames\n");
+			}
+		} else if (ky1 == CART_OP_LDCART) {
+			dr->loaded_cart = ct1;
+		} else if (ky1 == CART_OP_BZERO && dr->loaded_cart >= 0 && dr->loaded_cart < CART_MAX_CARTRIDGES) {
+			memset(frame_zeroed[dr->loaded_cart], 0x1, sizeof(frame_zeroed[0]));
+		} else if (ky1 == CART_OP_WRFRME) {
+			frame_version[dr->loaded_cart][fm1] = version;
+			frame_zeroed[dr->loaded_cart][fm1] = 0;
+		}
+	}
+
 	// If is it poweroff
 	if (ky1 == CART_OP_POWOFF) {
 
 		// Close the socket
-		close(client_socket);
-		cart_network_shutdown = 0;		
+		close(dr->socket);
+		dr->socket = -1;
+		cart_network_shutdown = 0;
+		cart_network_packed = 0;
 	}
 	
 	// deallocate
 	free(message);
 	free(response);
+
+	pthread_mutex_lock(&client_stats_lock);
+	cart_network_bytes += bytes;
+	if (ky1 < CART_OP_MAXVAL) {
+		cart_network_ops[ky1] += 1;
+		CART_LATENCY_RECORD(CART_LAT_BUS + ky1, bus_start);
+	}
+	pthread_mutex_unlock(&client_stats_lock);
 	
 	return rcode;
 }
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : init_frame_cipher
+// Description  : Initialize gcrypt, generate the key and open the AES-128 CTR
+//                handle of each drive, used for its frames (gcrypt runs it
+//                on AES-NI when the processor has it)
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int init_frame_cipher(void) {
+
+	if (!gcry_check_version("1.6.5")){
+		printf("gcrypt version doesn't match\n");
+		return -1;
+	}
+
+	gcry_control(GCRYCTL_DISABLE_SECMEM, 0);	// disable secured memory
+	gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);	// finish initialization
+
+	getRandomData(key, 16);		// generate key
+
+	for (int drive = 0; drive < CART_MAX_DRIVES; drive++) {
+		if (gcry_cipher_open(&client_drives[drive].cipher, GCRY_CIPHER_AES128, GCRY_CIPHER_MODE_CTR, 0) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Error opening the frame cipher\n");
+			return -1;
+		}
+		gcry_cipher_setkey(client_drives[drive].cipher, key, 16);	// set key
+		client_drives[drive].socket = -1;
+		client_drives[drive].loaded_cart = -1;
+	}
+	key_generated = 1;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : crypt_frame
+// Description  : Encrypt or decrypt (the same in CTR mode) one frame, whole
+//                or packed (CTR keeps the length). The
+//                counter block is cartridge, frame and version followed by
+//                the block number. The key lives as long as the process and
+//                versions only grow (INITMS and BZERO mark frames zeroed
+//                rather than resetting them), so no counter repeats under
+//                the key across power cycles either.
+//
+// Inputs       : drive - the drive, whose cipher handle is used
+//                cart - the cartridge of the frame
+//                frame - the frame
+//                version - the write count of the frame
+//                out - the result
+//                in - the input
+//                len - bytes to process (1024, or the packed length)
+// Outputs      : 0 if successful, -1 if failure
+
+int crypt_frame(int drive, int cart, int frame, uint32_t version, void *out, const void *in, int len) {
+
+	unsigned char ctr[16] = { 0 };
+
+	ctr[0] = cart >> 8;
+	ctr[1] = cart;
+	ctr[2] = frame >> 8;
+	ctr[3] = frame;
+	ctr[4] = version >> 24;
+	ctr[5] = version >> 16;
+	ctr[6] = version >> 8;
+	ctr[7] = version;
+
+	if (gcry_cipher_setctr(client_drives[drive].cipher, ctr, 16) != 0 ||
+		gcry_cipher_encrypt(client_drives[drive].cipher, out, len, in, len) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Error on frame cipher\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,519 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_codec.c
+//  Description    : This is the implementation of the frame codec, a small
+//                   LZ77 in the LZ4 block layout. Each sequence is a token
+//                   (literal count high nibble, match length - 4 low nibble,
+//                   15 meaning more length bytes follow), the literals, then
+//                   a two byte little endian match offset. The last sequence
+//                   is literals only. Matches are found through a hash of the
+//                   next four bytes, one probe per position. The parity
+//                   kernel XORs frames 16 bytes at a time with SSE2 (8 bytes
+//                   at a time where SSE2 is missing). Frame checksums are
+//                   CRC32C, 8 bytes per SSE4.2 crc32 instruction when the
+//                   processor has it, else a byte at a time from a table.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CODEC_CRC32C_SSE42	// built with the SSE4.2 path, used if the processor has it
+#endif
+
+// Project includes
+#include <cart_codec.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define CODEC_MIN_MATCH 4
+#define CODEC_HASH_BITS 10
+#define CODEC_LAST_LITERALS 5	// the tail is never matched, so reads stay in the frame
+#define CODEC_CRC32C_POLY 0x82f63b78	// Castagnoli polynomial, bit reversed
+
+// Global data
+static uint32_t crc32c_table[256];	// CRC32C of each byte, for the table path
+static int crc32c_path = -1;		// 1 for SSE4.2, 0 for the table, -1 before the first use
+
+//
+// Functions
+
+// CRC32C with the SSE4.2 crc32 instruction
+#ifdef CODEC_CRC32C_SSE42
+static uint32_t crc32c_sse42(const unsigned char *p, size_t len, uint32_t crc) __attribute__((target("sse4.2")));
+#endif
+
+// Hash the four bytes at p
+static inline uint32_t codec_hash(const unsigned char *p);
+
+// Write a length extension (bytes of 255, then the rest)
+static inline int codec_put_length(unsigned char *out, int len);
+
+// Fill the table of the CRC32C table path
+static void crc32c_fill_table(void);
+
+// CRC32C a byte at a time from the table
+static uint32_t crc32c_table_run(const unsigned char *p, size_t len, uint32_t crc);
+
+// Pack and unpack a frame, checking it comes back whole
+static int codec_round_trip(const unsigned char *frame, const char *kind);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: codec_hash
+// Description	: Hash the four bytes at p
+//
+// Input	: p - the bytes
+// Output	: the hash table index
+
+static inline uint32_t codec_hash(const unsigned char *p) {
+
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v * 2654435761u) >> (32 - CODEC_HASH_BITS);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: codec_put_length
+// Description	: Write the part of a length above 14 as bytes of 255 and a
+//		  final byte below 255
+//
+// Input	: out - where to write
+//		  len - the length left after the nibble's 15
+// Output	: bytes written
+
+static inline int codec_put_length(unsigned char *out, int len) {
+
+	int o = 0;
+
+	while (len >= 255) {
+		out[o++] = 255;
+		len -= 255;
+	}
+	out[o++] = (unsigned char)len;
+	return(o);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: pack_frame
+// Description	: Compress a frame
+//
+// Input	: frame - the CART_FRAME_SIZE byte frame
+//		  packed - the output, at least CART_PACKED_MAX bytes
+// Output	: the packed length
+
+int pack_frame(const void *frame, void *packed) {
+
+	const unsigned char *in = frame;
+	unsigned char *out = packed;
+	uint16_t table[1 << CODEC_HASH_BITS];
+	int i = 0, anchor = 0, o = 0, limit = CART_FRAME_SIZE - CODEC_LAST_LITERALS;
+	int lit, len, ref;
+	uint32_t h;
+	unsigned char *token;
+
+	memset(table, 0xff, sizeof(table));
+
+	while (i + CODEC_MIN_MATCH <= limit) {
+
+		// One probe for an earlier copy of the next four bytes
+		h = codec_hash(&in[i]);
+		ref = table[h];
+		table[h] = i;
+		if (ref == 0xffff || memcmp(&in[ref], &in[i], CODEC_MIN_MATCH) != 0) {
+			i++;
+			continue;
+		}
+
+		// Extend the match up to the tail
+		len = CODEC_MIN_MATCH;
+		while (i + len < limit && in[ref + len] == in[i + len]) len++;
+
+		// Token, literals, offset and match length
+		lit = i - anchor;
+		token = &out[o++];
+		*token = (unsigned char)(((lit < 15) ? lit : 15) << 4);
+		if (lit >= 15) o += codec_put_length(&out[o], lit - 15);
+		memcpy(&out[o], &in[anchor], lit);
+		o += lit;
+		out[o++] = (unsigned char)(i - ref);
+		out[o++] = (unsigned char)((i - ref) >> 8);
+		len -= CODEC_MIN_MATCH;
+		*token |= (len < 15) ? len : 15;
+		if (len >= 15) o += codec_put_length(&out[o], len - 15);
+
+		i += len + CODEC_MIN_MATCH;
+		anchor = i;
+	}
+
+	// The rest goes out as literals
+	lit = CART_FRAME_SIZE - anchor;
+	out[o++] = (unsigned char)(((lit < 15) ? lit : 15) << 4);
+	if (lit >= 15) o += codec_put_length(&out[o], lit - 15);
+	memcpy(&out[o], &in[anchor], lit);
+	o += lit;
+
+	return(o);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: unpack_frame
+// Description	: Decompress a frame, rejecting input that does not decode to
+//		  exactly one frame or refers outside it
+//
+// Input	: packed - the packed bytes
+//		  len - number of packed bytes
+//		  frame - the CART_FRAME_SIZE byte output
+// Output	: 0 if successful, -1 if the input is malformed
+
+int unpack_frame(const void *packed, int len, void *frame) {
+
+	const unsigned char *in = packed;
+	unsigned char *out = frame;
+	int i = 0, o = 0, lit, mlen, off, b;
+
+	while (i < len) {
+
+		// Literals
+		b = in[i++];
+		lit = b >> 4;
+		if (lit == 15) {
+			do {
+				if (i >= len) return(-1);
+				lit += in[i];
+			} while (in[i++] == 255);
+		}
+		if (i + lit > len || o + lit > CART_FRAME_SIZE) return(-1);
+		memcpy(&out[o], &in[i], lit);
+		i += lit;
+		o += lit;
+
+		// The last sequence has no match
+		if (i == len) break;
+
+		// Match, copied forwards so overlapping runs repeat
+		if (i + 2 > len) return(-1);
+		off = in[i] | (in[i + 1] << 8);
+		i += 2;
+		mlen = (b & 0xf) + CODEC_MIN_MATCH;
+		if ((b & 0xf) == 15) {
+			do {
+				if (i >= len) return(-1);
+				mlen += in[i];
+			} while (in[i++] == 255);
+		}
+		if (off == 0 || off > o || o + mlen > CART_FRAME_SIZE) return(-1);
+		for (int k = 0; k < mlen; k++, o++) {
+			out[o] = out[o - off];
+		}
+	}
+
+	return((o == CART_FRAME_SIZE) ? 0 : -1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: xor_frame
+// Description	: XOR one frame into another, the add of GF(2^8) a byte at a
+//		  time, so parity is built and undone by the same call
+//
+// Input	: dst - the CART_FRAME_SIZE byte frame XORed into
+//		  src - the frame XORed in
+// Output	: none
+
+void xor_frame(void *dst, const void *src) {
+
+#ifdef __SSE2__
+	__m128i *d = dst;
+	const __m128i *s = src;
+
+	for (int i = 0; i < CART_FRAME_SIZE / 16; i += 4) {
+		__m128i a = _mm_xor_si128(_mm_loadu_si128(&d[i]), _mm_loadu_si128(&s[i]));
+		__m128i b = _mm_xor_si128(_mm_loadu_si128(&d[i + 1]), _mm_loadu_si128(&s[i + 1]));
+		__m128i c = _mm_xor_si128(_mm_loadu_si128(&d[i + 2]), _mm_loadu_si128(&s[i + 2]));
+		__m128i e = _mm_xor_si128(_mm_loadu_si128(&d[i + 3]), _mm_loadu_si128(&s[i + 3]));
+		_mm_storeu_si128(&d[i], a);
+		_mm_storeu_si128(&d[i + 1], b);
+		_mm_storeu_si128(&d[i + 2], c);
+		_mm_storeu_si128(&d[i + 3], e);
+	}
+#else
+	uint64_t w, v;
+
+	for (int i = 0; i < CART_FRAME_SIZE; i += 8) {
+		memcpy(&w, (char *)dst + i, 8);
+		memcpy(&v, (const char *)src + i, 8);
+		w ^= v;
+		memcpy((char *)dst + i, &w, 8);
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: crc32c
+// Description	: Checksum a buffer with CRC32C. The first call picks the
+//		  SSE4.2 instruction if the processor has it, else fills the
+//		  table.
+//
+// Input	: data - the bytes
+//		  len - number of bytes
+// Output	: the CRC32C
+
+uint32_t crc32c(const void *data, size_t len) {
+
+	const unsigned char *p = data;
+	uint32_t crc = 0xffffffff;
+
+	if (crc32c_path == -1) {
+#ifdef CODEC_CRC32C_SSE42
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2")) {
+			crc32c_path = 1;
+		}
+#endif
+		if (crc32c_path == -1) {
+			crc32c_fill_table();
+			crc32c_path = 0;
+		}
+	}
+
+#ifdef CODEC_CRC32C_SSE42
+	if (crc32c_path == 1) {
+		return ~crc32c_sse42(p, len, crc);
+	}
+#endif
+
+	return ~crc32c_table_run(p, len, crc);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: crc32c_fill_table
+// Description	: Fill the table of the CRC32C table path, the CRC of each
+//		  byte value
+//
+// Input	: none
+// Output	: none
+
+static void crc32c_fill_table(void) {
+
+	for (uint32_t b = 0; b < 256; b++) {
+		uint32_t c = b;
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ CODEC_CRC32C_POLY : c >> 1;
+		}
+		crc32c_table[b] = c;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: crc32c_table_run
+// Description	: Run CRC32C over a buffer a byte at a time from the table
+//
+// Input	: p - the bytes
+//		  len - number of bytes
+//		  crc - the running CRC
+// Output	: the running CRC after the bytes
+
+static uint32_t crc32c_table_run(const unsigned char *p, size_t len, uint32_t crc) {
+
+	for (size_t i = 0; i < len; i++) {
+		crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#ifdef CODEC_CRC32C_SSE42
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: crc32c_sse42
+// Description	: Run CRC32C over a buffer 8 bytes per crc32 instruction
+//
+// Input	: p - the bytes
+//		  len - number of bytes
+//		  crc - the running CRC
+// Output	: the running CRC after the bytes
+
+static uint32_t crc32c_sse42(const unsigned char *p, size_t len, uint32_t crc) {
+
+	uint64_t c = crc, w;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	for (; len > 0; len--, p++) {
+		c = _mm_crc32_u8((uint32_t)c, *p);
+	}
+
+	return (uint32_t)c;
+}
+#endif
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: codec_round_trip
+// Description	: Pack and unpack a frame, checking it comes back whole and
+//		  that no strict prefix of the packed bytes is accepted
+//
+// Input	: frame - the CART_FRAME_SIZE byte frame
+//		  kind - what the frame holds, for the log
+// Output	: the packed length, -1 if failure
+
+static int codec_round_trip(const unsigned char *frame, const char *kind) {
+
+	unsigned char packed[CART_PACKED_MAX], out[CART_FRAME_SIZE];
+	int len = pack_frame(frame, packed);
+
+	if (len <= 0 || len > CART_PACKED_MAX) {
+		logMessage(LOG_ERROR_LEVEL, "Codec unit test: %s frame packed to %d bytes.", kind, len);
+		return(-1);
+	}
+	if (unpack_frame(packed, len, out) != 0 || memcmp(frame, out, CART_FRAME_SIZE) != 0) {
+		logMessage(LOG_ERROR_LEVEL, "Codec unit test: %s frame did not come back.", kind);
+		return(-1);
+	}
+	for (int cut = 0; cut < len; cut++) {
+		if (unpack_frame(packed, cut, out) != -1) {
+			logMessage(LOG_ERROR_LEVEL, "Codec unit test: %s frame cut to %d bytes was accepted.", kind, cut);
+			return(-1);
+		}
+	}
+
+	return(len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cartCodecUnitTest
+// Description	: Run a UNIT test checking the frame codec: frames of zeros,
+//		  runs, text and random bytes come back whole (and the
+//		  compressible ones smaller), and truncated or out of range
+//		  input is rejected
+//
+// Input	: none
+// Output	: 0 if successful, -1 if failure
+
+int cartCodecUnitTest(void) {
+
+	unsigned char frame[CART_FRAME_SIZE], packed[CART_PACKED_MAX + 1], out[CART_FRAME_SIZE];
+	const char *words[] = { "the ", "cartridge ", "frame ", "of ", "driver ", "and ", "a ", "cache^", "server " };
+	const struct {
+		const char *what;		// what is wrong with it
+		unsigned char bytes[16];	// the packed bytes
+		int len;			// how many of them
+	} bad_input[] = {
+		{ "a match before the start of the frame", { 0x04, 0x01, 0x00 }, 3 },
+		{ "a zero offset", { 0x10, 'a', 0x00, 0x00 }, 4 },
+		{ "a match past the end of the frame", { 0x1f, 'a', 0x01, 0x00, 0xff, 0xff, 0xff, 0xff, 0xfe }, 9 },
+		{ "more literals than the input holds", { 0xf0, 0x05, 'a', 'b', 'c' }, 5 },
+		{ "a cut off length extension", { 0xf0, 0xff }, 2 },
+		{ "a cut off offset", { 0x10, 'a', 0x01 }, 3 },
+	};
+	int len, i, j;
+
+	// All zeros packs to a few bytes
+	memset(frame, 0x0, CART_FRAME_SIZE);
+	if ((len = codec_round_trip(frame, "zero")) == -1) return(-1);
+	if (len > 16) {
+		logMessage(LOG_ERROR_LEVEL, "Codec unit test: zero frame packed to %d bytes.", len);
+		return(-1);
+	}
+
+	// Runs of every length from 1 to 300, as in the workload's repeated characters
+	for (int run = 1; run <= 300; run += (run < 20) ? 1 : 17) {
+		for (i = 0; i < CART_FRAME_SIZE; i++) {
+			frame[i] = 'a' + (i / run) % 26;
+		}
+		if ((len = codec_round_trip(frame, "run")) == -1) return(-1);
+		if (run >= 8 && len >= CART_FRAME_SIZE) {
+			logMessage(LOG_ERROR_LEVEL, "Codec unit test: runs of %d did not pack.", run);
+			return(-1);
+		}
+	}
+
+	// Text
+	for (i = 0, j = 0; i < CART_FRAME_SIZE; j = getRandomValue(0, 8)) {
+		for (const char *w = words[j]; *w != '\0' && i < CART_FRAME_SIZE; w++) {
+			frame[i++] = *w;
+		}
+	}
+	if (codec_round_trip(frame, "text") == -1) return(-1);
+
+	// Random bytes, whole and with runs of zeros (holes) inside
+	for (int k = 0; k < 64; k++) {
+		getRandomData((char *)frame, CART_FRAME_SIZE);
+		if (k % 2 == 1) {
+			memset(frame + getRandomValue(0, 511), 0x0, getRandomValue(1, 512));
+		}
+		if (codec_round_trip(frame, "random") == -1) return(-1);
+	}
+
+	// Malformed sequences
+	for (i = 0; i < (int)(sizeof(bad_input) / sizeof(bad_input[0])); i++) {
+		if (unpack_frame(bad_input[i].bytes, bad_input[i].len, out) != -1) {
+			logMessage(LOG_ERROR_LEVEL, "Codec unit test: %s was accepted.", bad_input[i].what);
+			return(-1);
+		}
+	}
+
+	// A whole frame with a byte after it
+	memset(frame, 'z', CART_FRAME_SIZE);
+	len = pack_frame(frame, packed);
+	packed[len] = 0x10;
+	if (unpack_frame(packed, len + 1, out) != -1) return(-1);
+
+	// Literals past the end of the frame
+	packed[0] = 0xf0;
+	memset(packed + 1, 0xff, 4);
+	packed[5] = 0x0;
+	if (unpack_frame(packed, 6 + 1036, out) != -1) return(-1);
+
+	// The CRC32C check value, then both paths on every length and
+	// alignment up to a few words
+	crc32c_fill_table();
+	if (crc32c("123456789", 9) != 0xe3069283 ||
+		~crc32c_table_run((const unsigned char *)"123456789", 9, 0xffffffff) != 0xe3069283) {
+		logMessage(LOG_ERROR_LEVEL, "Codec unit test: wrong CRC32C of \"123456789\".");
+		return(-1);
+	}
+#ifdef CODEC_CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2")) {
+		getRandomData((char *)frame, CART_FRAME_SIZE);
+		for (i = 0; i < 8; i++) {
+			for (len = 0; len <= 40; len++) {
+				if (crc32c_sse42(frame + i, len, 0xffffffff) != crc32c_table_run(frame + i, len, 0xffffffff)) {
+					logMessage(LOG_ERROR_LEVEL, "Codec unit test: CRC32C paths differ on %d bytes at %d.", len, i);
+					return(-1);
+				}
+			}
+		}
+		if (crc32c_sse42(frame, CART_FRAME_SIZE, 0xffffffff) != crc32c_table_run(frame, CART_FRAME_SIZE, 0xffffffff)) {
+			logMessage(LOG_ERROR_LEVEL, "Codec unit test: CRC32C paths differ on a frame.");
+			return(-1);
+		}
+	}
+#endif
+
+	// Return successfully
+	logMessage(LOG_OUTPUT_LEVEL, "Codec unit test completed successfully.");
+	return(0);
+}
@@ -0,0 +1,44 @@
+#ifndef CART_CODEC_INCLUDED
+#define CART_CODEC_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_codec.h
+//  Description    : This is the header file for the frame codec used to pack
+//                   frames on the wire when the server supports it, and the
+//                   XOR kernel of the driver's parity and its frame checksum.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_PACKED_MAX (CART_FRAME_SIZE + CART_FRAME_SIZE / 255 + 16)	// Worst case packed size
+
+//
+// Interface functions
+
+int pack_frame(const void *frame, void *packed);
+	// Compress a frame, returns the packed length
+
+int unpack_frame(const void *packed, int len, void *frame);
+	// Decode a packed frame, 0 if it decoded to exactly one frame, -1 if not
+
+void xor_frame(void *dst, const void *src);
+	// XOR the frame src into the frame dst
+
+uint32_t crc32c(const void *data, size_t len);
+	// CRC32C of the bytes (SSE4.2 where the processor has it)
+
+//
+// Unit test
+
+int cartCodecUnitTest(void);
+	// Run a UNIT test checking the frame codec
+
+#endif
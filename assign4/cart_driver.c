@@ -9,14 +9,21 @@
 //
 
 // Includes
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <gcrypt.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_controller.h>
 #include <cart_cache.h>
+#include <cart_codec.h>
 #include <cart_network.h>
+#include <cart_latency.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
@@ -31,6 +38,25 @@ typedef struct{
 	int frame;
 } FileAddress;
 
+#define CART_TOTAL_FRAMES (CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE)	// Frames in the whole system
+#define FRAME_ID(address) ((address).cartridge * CART_CARTRIDGE_SIZE + (address).frame)
+#define DEDUP_FINGERPRINT_SIZE 20	// SHA1 of the frame contents
+#define DEDUP_INDEX_BITS 17		// Fingerprint index slots (twice the frames, so at most half full)
+#define DEDUP_EMPTY -1
+#define CART_HOLE -1			// Cartridge (and frame) of a file frame of zeros, with no frame behind it
+#define DEFRAG_IDLE_SECONDS 0.001	// Quiet time after a file operation before defragmenting or scrubbing
+#define DEFRAG_BURST 8			// Most frames one defragmenter step moves
+#define SCRUB_BURST 16			// Most frames one scrubber step verifies
+#define SCRUB_COLD_SECONDS 1.0		// Frames written or verified more recently are left to the scrubber's next pass
+#define AFFINITY_RUN 32			// Free frames of its home cartridge an AFFINITY file reserves at a time
+#define STRIPE_UNIT 64			// Frames in a row a SEQUENTIAL file puts on one stripe member
+#define MIRROR_PARTNER 33		// Mirrors of cartridge c start on cartridge c + 33 (on another drive, too)
+#define MIRROR_NONE -1
+#define PARITY_GROUP 8			// Cartridges in a parity group, each stripe a frame of each (one of them parity)
+#define UNIT_FILES 4			// Files the driver unit test checks against shadows
+#define UNIT_FILE_FRAMES 128		// Most frames of a unit test file
+#define UNIT_CACHE_FRAMES 64		// Cache size during the driver unit test, so most reads go to the bus
+
 typedef struct{
 	char name[128];			//Name of the file
 	int descriptor;			//File descriptor
@@ -39,13 +65,51 @@ typedef struct{
 	int num_of_address;		//number of memory frames assigned
 	FileStatus file_status;		//File open/closed flag
 	FileAddress *file_address;	//A list of the addresses of the memory frame assigned for this file
+	int home;			//Home cartridge of the AFFINITY allocator, -1 if none yet
+	int run_next;			//Next frame of the run reserved on the home cartridge
+	int run_left;			//Frames of the run not yet handed out
+	CartAdvice advice;		//How the file says it is used
+	int stripe_width;		//Cartridges a SEQUENTIAL file stripes over
+	int stripe_next;		//Stripe member the next frame goes to
+	int stripe_used;		//Frames of the current stripe unit handed out
+	int stripe[CART_MAX_CARTRIDGES];	//The stripe members
 } FileAllocationTable;
 
-typedef enum{
-	CARTALLOC_RANDOM = 0,		
-	CARTALLOC_LINEAR  = 1,
-	CARTALLOC_BALANCED = 2	
-} AllocStrategy;
+typedef struct{
+	FileAddress address;		//The frame to read (the primary, the cache key)
+	FileAddress source;		//The copy read, the primary or its mirror
+	int index;			//Its place in the request
+	int key;			//Sort key: drive, then cartridge (the loaded one first)
+} FrameRead;
+
+typedef struct{
+	int drive;			//The drive
+	FrameRead *reads;		//Its frames, grouped by cartridge
+	int num_of_reads;		//Number of frames
+	char *data;			//Where frame i of the request goes (at i * CART_FRAME_SIZE)
+	int result;			//0 if every frame was read, -1 if not
+} DriveReadJob;
+
+typedef struct{
+	FileAddress primary;		//The frame written, {-1, -1} if it was freed since
+	FileAddress mirror;		//Its mirror
+	char data[CART_FRAME_SIZE];	//The contents
+} MirrorWrite;
+
+typedef struct{
+	FileAddress frame;		//The frame written
+	FileAddress parity;		//The parity frame of its stripe
+	int delta_known;		//1 if delta holds the old contents XOR the new
+	char data[CART_FRAME_SIZE];	//The new contents
+	char delta[CART_FRAME_SIZE];	//The change to fold into the parity
+} ParityWrite;
+
+typedef struct{
+	char name[16];			//Name of the file
+	int16_t fd;			//Its descriptor, -1 if not open
+	int length;			//The length it should have
+	char *shadow;			//The contents it should have
+} UnitFile;
 
 //Global Data
 static enum{
@@ -61,7 +125,85 @@ static int num_of_file;		//Number of files in the driver
 
 static int current_cart;		//The current cartridge this driver working on
 
-static char frame_status[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];		//An 2-D array to tell if the frame is occupied
+static uint16_t frame_status[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];		//Number of file frames using each frame, 0 if free
+
+static int frames_free;			//Frames not used by any file
+
+static int alloc_cart;			//Next cartridge of the LINEAR and BALANCED allocators
+
+static int alloc_frame;			//Next frame of the LINEAR and BALANCED allocators
+
+static int frame_owner[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//Descriptor of the file a free frame is reserved for, 0 if none
+
+static int cart_homes[CART_MAX_CARTRIDGES];	//Files with each cartridge as their home
+
+static int dedup_enabled = 0;		//Share frames with identical contents
+
+static unsigned char frame_fingerprint[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE][DEDUP_FINGERPRINT_SIZE];	//Contents hash of indexed frames
+
+static char frame_indexed[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//1 if the frame is in the fingerprint index
+
+static int32_t dedup_index[1 << DEDUP_INDEX_BITS];	//Open-addressing index from fingerprint to frame id
+
+static CartDriverStats driver_stats;	//Counters reported by get_cart_driver_stats
+
+static int mirror_enabled = 0;		//Keep a mirror of every frame on another cartridge
+
+static int32_t frame_mirror[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//Frame id of each frame's mirror, MIRROR_NONE if none
+
+static int32_t frame_primary[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//Frame id of the frame each mirror copies, MIRROR_NONE if not a mirror
+
+static char mirror_stale[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//1 while the frame's mirror waits for its write
+
+static MirrorWrite *mirror_queue;	//Mirror writes waiting for flush_mirrors
+
+static int num_mirror_writes;		//Writes in the queue
+
+static int max_mirror_writes;		//Room in the queue
+
+static int parity_enabled = 0;		//Keep an XOR parity frame per stripe of each PARITY_GROUP cartridges
+
+static char cart_failed[CART_MAX_CARTRIDGES];	//1 if the cartridge failed, its frames come from their mirror or parity
+
+static char frame_written[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//1 if written since power on (else it holds zeros)
+
+static uint32_t frame_crc[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//CRC32C of the contents last written to each frame
+
+static double frame_checked[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//When each frame was last written or verified
+
+static char parity_stale[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//1 if a parity frame could not follow its stripe
+
+static char parity_queued[CART_MAX_CARTRIDGES][CART_CARTRIDGE_SIZE];	//1 while the frame waits in the parity queue
+
+static ParityWrite *parity_queue;	//Parity changes waiting for flush_parity
+
+static int num_parity_writes;		//Changes in the queue
+
+static int max_parity_writes;		//Room in the queue
+
+static FileAddress hint_address = { -1, -1 };	//The frame load_frame read last, whose old contents parity needs
+
+static char hint_data[CART_FRAME_SIZE];	//Its contents
+
+static const char zero_frame[CART_FRAME_SIZE];	//A frame of zeros, to compare against
+
+static uint32_t defrag_rate = 0;	//Frames per second the defragmenter may move, 0 if off
+
+static double defrag_tokens;		//Frames the defragmenter may move now
+
+static double defrag_refilled;		//Time the tokens were last topped up
+
+static double last_file_op;		//Time of the last file operation
+
+static uint32_t scrub_rate = 0;		//Frames per second the scrubber may verify, 0 if off
+
+static double scrub_tokens;		//Frames the scrubber may verify now
+
+static double scrub_refilled;		//Time the tokens were last topped up
+
+static int32_t scrub_next;		//Frame id the scrubber looks at next
+
+static UnitFile unit_files[UNIT_FILES];	//Files of the driver unit test
 
 //Function Prototypes
 
@@ -87,7 +229,127 @@ int calculate_position_offset(int position);
 int address_occupied(FileAddress file_address);
 
 //Generate the next available address
-FileAddress generate_memory_address();
+FileAddress generate_memory_address(FileAllocationTable *file);
+
+//Find a free frame by scanning from the given address
+FileAddress find_free_frame(int cartridge, int frame);
+
+//Take the next free frame of the LINEAR or BALANCED cursor
+FileAddress cursor_address(void);
+
+//Pick a frame on the file's home cartridge, for the AFFINITY allocator
+FileAddress affinity_address(FileAllocationTable *file);
+
+//Hand out the next frame of the file's reserved run
+FileAddress run_address(FileAllocationTable *file);
+
+//Give back the frames a file reserved and did not use
+void drop_run(FileAllocationTable *file);
+
+//Pick a frame on the next stripe member, for SEQUENTIAL files
+FileAddress stripe_address(FileAllocationTable *file);
+
+//Count the free frames of a cartridge no file has reserved
+int count_unowned(int cart);
+
+//Find a free frame of a cartridge reserved for the file, or else unreserved
+int owned_frame(int cart, FileAllocationTable *file);
+
+//Reserve free frames of the home cartridge for the file
+int reserve_run(FileAllocationTable *file, int frames);
+
+//Drop one file frame's use of a frame, freeing it when unused
+int release_frame(FileAddress address);
+
+//Give a frame a mirror on another cartridge
+int attach_mirror(FileAddress address);
+
+//Queue the write of a frame's mirror
+int queue_mirror_write(FileAddress address, void *data);
+
+//Write the queued mirrors, a cartridge at a time
+int flush_mirrors(void);
+
+//Order mirror writes by cartridge
+int compare_mirror_writes(const void *a, const void *b);
+
+//Get the mirror of a frame that can be read
+FileAddress readable_mirror(FileAddress address);
+
+//Get the parity frame of the stripe holding a frame
+FileAddress parity_address(FileAddress address);
+
+//Queue the change a frame write makes to its stripe's parity
+int queue_parity_write(FileAddress address, void *data);
+
+//Write the parity of the stripes changed, reading as little as possible
+int flush_parity(void);
+
+//Order parity changes by parity frame
+int compare_parity_writes(const void *a, const void *b);
+
+//Read a stripe member for parity work (cache, zeros or bus)
+int read_member(FileAddress address, void *data);
+
+//Read a frame of a failed cartridge from its mirror or its stripe
+int degraded_read(FileAddress address, void *data);
+
+//Rebuild a frame from the rest of its stripe
+int stripe_read(FileAddress address, void *data);
+
+//Note the contents just written to a frame, for its checksum
+void note_frame_written(FileAddress address, void *data);
+
+//Check a frame read from the bus against its checksum
+int verify_frame(FileAddress address, void *data);
+
+//Get good contents for a corrupt copy of a frame and write them over it
+int recover_frame(FileAddress address, FileAddress bad, void *data);
+
+//Repair any frame the scrubber found corrupt
+int repair_frame(FileAddress address, void *data);
+
+//Find the frame holding the given contents
+FileAddress dedup_lookup(const unsigned char *fingerprint);
+
+//Record the contents of a frame in the fingerprint index
+int dedup_insert(FileAddress address, const unsigned char *fingerprint);
+
+//Forget the contents of a frame
+int dedup_remove(FileAddress address);
+
+//Read a frame of a file from a hole, the cache or the bus
+int load_frame(FileAllocationTable *file, int index, void *data);
+
+//Read consecutive frames of a file, grouped by cartridge and spread over the drives
+int load_frames(FileAllocationTable *file, int first, int count, char *data);
+
+//Order frame reads by their sort key
+int compare_frame_reads(const void *a, const void *b);
+
+//Pick the copy (frame or mirror) each read of a request goes to
+void choose_sources(FrameRead *reads, int num_of_reads);
+
+//Read one drive's share of the frames (a thread per drive)
+void *drive_read_frames(void *arg);
+
+//Write a frame of a file, sharing or copying it as needed
+int store_frame(FileAllocationTable *file, int index, void *data);
+
+//Note the frames in use in the driver counters
+int count_frames_used(void);
+
+//Point a frame of a file at a new frame holding its contents
+int switch_frame(FileAllocationTable *file, int index, FileAddress to, void *data);
+
+//Count the runs of a file on one cartridge, and the fewest possible
+int file_fragmentation(FileAllocationTable *file, int *runs);
+
+//Gather a file onto as few cartridges as possible
+int compact_file(FileAllocationTable *file, int budget);
+
+//Seconds on the monotonic clock
+double driver_now(void);
 
 //Grow the file_address list
 int grow_file_address_list(FileAllocationTable *file);
@@ -98,6 +360,51 @@ int grow_file_alloc_table(FileAllocationTable **file_alloc_table);
 //Load cart with current cart check 
 int load_cart(int cart_num);
 
+//Log a failed expectation of the driver unit test
+int unit_expect(int ok, const char *what);
+
+//Write to a unit test file and to its shadow
+int unit_write(UnitFile *file, int offset, const char *data, int count);
+
+//Check every open unit test file against its shadow
+int unit_check(const char *step);
+
+//Unit test of frames shared by deduplication
+int unit_sharing_test(void);
+
+//Unit test of holes, frames of zeros with no frame behind them
+int unit_holes_test(void);
+
+//Cut or extend a unit test file and its shadow
+int unit_truncate(UnitFile *file, int length);
+
+//Unit test of truncating, unlinking and compacting files
+int unit_layout_test(void);
+
+//Get the frame behind a frame of a unit test file
+FileAddress unit_address(UnitFile *file, int index);
+
+//Drop every member of a stripe from the cache
+void unit_evict_stripe(FileAddress parity);
+
+//Check a stripe's parity against its data frames
+int unit_stripe_ok(FileAddress parity);
+
+//Unit test of parity written from deltas, whole stripes and stale stripes
+int unit_parity_test(void);
+
+//Unit test of a failed cartridge, read from its mirrors or parity
+int unit_failure_test(void);
+
+//Read or write a frame straight over the bus, behind the driver's back
+int unit_bus(uint64_t op, FileAddress address, void *data);
+
+//Read one frame of a unit test file through the driver, from the bus
+int unit_read_frame(UnitFile *file, int index);
+
+//Unit test of corrupt frames and stored checksums, read and scrubbed
+int unit_checksum_test(void);
+
 //
 // Implementation
 
@@ -162,6 +469,10 @@ int initialize_file_allocation_table() {
 		file_alloc_table[i].position = -1;		//initialize file position
 		file_alloc_table[i].num_of_address = 0;		//initialize number of addresses be assigned
 		file_alloc_table[i].file_status = NO_FILE;	//initialize file status
+		file_alloc_table[i].home = -1;			//initialize home cartridge
+		file_alloc_table[i].run_left = 0;		//initialize reserved run
+		file_alloc_table[i].advice = CART_ADVICE_NORMAL;	//initialize advice
+		file_alloc_table[i].stripe_width = 0;		//initialize stripe
 		
 	}
 
@@ -170,8 +481,41 @@ int initialize_file_allocation_table() {
 	for (int i = 0; i < CART_MAX_CARTRIDGES; ++i){
 		for (int j = 0; j < CART_CARTRIDGE_SIZE; ++j){
 			frame_status[i][j] = 0;
+			frame_indexed[i][j] = 0;
+			frame_mirror[i][j] = MIRROR_NONE;
+			frame_primary[i][j] = MIRROR_NONE;
+			mirror_stale[i][j] = 0;
+			frame_owner[i][j] = 0;
+			frame_written[i][j] = 0;
+			frame_checked[i][j] = 0.0;
+			parity_stale[i][j] = 0;
+			parity_queued[i][j] = 0;
+		}
+		cart_homes[i] = 0;
+		cart_failed[i] = 0;
+	}
+	frames_free = CART_TOTAL_FRAMES;
+	alloc_cart = 0;
+	alloc_frame = CART_CARTRIDGE_SIZE - 1;
+
+	//The parity frames are never handed out, frame f of a group's
+	//cartridge (f mod PARITY_GROUP) holding the parity of the frames f
+	if (parity_enabled) {
+		for (int i = 0; i < CART_MAX_CARTRIDGES; ++i) {
+			for (int j = i % PARITY_GROUP; j < CART_CARTRIDGE_SIZE; j += PARITY_GROUP) {
+				frame_status[i][j] = 1;
+				frames_free -= 1;
+			}
 		}
 	}
+	num_parity_writes = 0;
+	scrub_next = 0;
+	hint_address.cartridge = -1;
+	hint_address.frame = -1;
+
+	//initialize the fingerprint index
+	memset(dedup_index, 0xff, sizeof(dedup_index));
+	num_mirror_writes = 0;
 
 	return 0;
 
@@ -226,7 +570,7 @@ int calculate_position_offset(int position) {
 
 int address_occupied(FileAddress file_address) {
 
-	if (frame_status[file_address.cartridge][file_address.frame] == 1){
+	if (frame_status[file_address.cartridge][file_address.frame] != 0){
 		return(1);
 	} else {
 		return(0);
@@ -240,19 +584,16 @@ int address_occupied(FileAddress file_address) {
 // Function	: generate_memory_address
 // Description	: Generate the next available address
 //
-// Input	: none
+// Input	: file - the file the frame is for
 // Output	: The new memory address 
 //		  if no memory avaliable return invalid address {-1, -1}
 
-FileAddress generate_memory_address() {
+FileAddress generate_memory_address(FileAllocationTable *file) {
 
 	FileAddress file_address;
-	static int current_cart = 0;
-	static int current_frame = 1023;
-	static int frame_left = 1024 * 64;
 
 	//Check if the memory is full
-	if (frame_left == 0) {
+	if (frames_free == 0) {
 		//assign an invalid address
 		file_address.cartridge = -1;
 		file_address.frame = -1;
@@ -263,8 +604,19 @@ FileAddress generate_memory_address() {
 		return file_address;
 	}
 
-	//Check the allocation strategy
-	if (alloc_mode == CARTALLOC_RANDOM) {
+	//Check the file's advice, then the allocation strategy
+	if (file->advice == CART_ADVICE_SEQUENTIAL) {
+		//Striped for this file
+		file_address = stripe_address(file);
+
+	} else if (alloc_mode == CARTALLOC_AFFINITY || file->advice == CART_ADVICE_RANDOM) {
+		//Affinity Allocation
+		file_address = affinity_address(file);
+
+	} else if (file->run_left > 0 && (file_address = run_address(file)).frame != -1) {
+		//A frame the file preallocated
+
+	} else if (alloc_mode == CARTALLOC_RANDOM) {
 
 		//Random Allocation
 		//Generate random number for cart (0 -63)
@@ -279,48 +631,24 @@ FileAddress generate_memory_address() {
 			file_address.frame += 1;
 			if (file_address.frame == 1024) {
 				file_address.frame = 0;
-				file_address.cartridge += 0;			
+				file_address.cartridge = (file_address.cartridge + 1) % CART_MAX_CARTRIDGES;
 			}
 		}
 
-	} else if (alloc_mode == CARTALLOC_LINEAR) {
-		//Linear Allocation
-	
-		file_address.cartridge = current_cart;
-		file_address.frame = current_frame;
-		
-		//update the next address location
-		if (current_frame == 0) {
-			current_frame = 1023;
-			current_cart = current_cart + 1;
-		} else {
-			current_frame = current_frame - 1;
-		}
-
-	} else if (alloc_mode == CARTALLOC_BALANCED) {
-		//Balance Allocation
-
-		//assign the avaliable address	
-		file_address.cartridge = current_cart;
-		file_address.frame = current_frame;
-		
-		//update the next address location
-		if (current_cart == 63) {
-			current_cart = 0;
-			current_frame = current_frame -1;
-		} else {
-			current_cart = current_cart + 1;
-		}
+	} else if (alloc_mode == CARTALLOC_LINEAR || alloc_mode == CARTALLOC_BALANCED) {
+		//Linear or Balance Allocation
+		file_address = cursor_address();
 
 	} else {
 		//log message
 		logMessage(LOG_ERROR_LEVEL, "Memory allocation fail: Invalid allocation strategy\n\n");
 		file_address.cartridge = -1;
 		file_address.frame = -1;	
+		return file_address;
 	}
 
 	//update number of frame left
-	frame_left -= 1;
+	frames_free -= 1;
 
 	//update the frame status
 	frame_status[file_address.cartridge][file_address.frame] = 1;
@@ -328,670 +656,3752 @@ FileAddress generate_memory_address() {
 	return file_address;
 }
 
-//////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 //
-// Function	: grow_file_address_list
-// Description	: Grow the file_address list
+// Function	: find_free_frame
+// Description	: Find a free frame by scanning forward from the given address
+//		  (wrapping around), for allocators whose cursor has run out
 //
-// Input	: file - The pointer to the file contains the address list that need to grow
-// Output	: 0 if successful, -1 if failure
+// Input	: cartridge - the cartridge to start at
+//		  frame - the frame to start at
+// Output	: The free address (there must be one)
 
-int grow_file_address_list(FileAllocationTable *file) {
-	
-	//Check if the file has address
-	if (file->num_of_address == 0) {
-		//allocate memory for new address
-		file->file_address = malloc(sizeof(FileAddress));
-	} else {
-		//reallocate memory for new address
-		file->file_address = realloc(file->file_address, (file->num_of_address + 1) * sizeof(FileAddress));
-	}
-	
-	//assign the new address of the frame
-	file->file_address[file->num_of_address] = generate_memory_address();
-	//check if the address valid
-	if (file->file_address[file->num_of_address].frame == -1) {
-		return -1;	
+FileAddress find_free_frame(int cartridge, int frame) {
+
+	FileAddress file_address;
+	int id = cartridge * CART_CARTRIDGE_SIZE + frame;
+
+	while (frame_status[id / CART_CARTRIDGE_SIZE][id % CART_CARTRIDGE_SIZE] != 0) {
+		id = (id + 1) % CART_TOTAL_FRAMES;
 	}
-	
-	//increase the num_of_address
-	file->num_of_address += 1;
-	return 0;
+
+	file_address.cartridge = id / CART_CARTRIDGE_SIZE;
+	file_address.frame = id % CART_CARTRIDGE_SIZE;
+	return file_address;
 }
 
-/////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 //
-// Function	: grow_file_alloc_table
-// Description	: Grow the file_alloc_table
+// Function	: cursor_address
+// Description	: Take the next frame of the LINEAR (a cartridge at a time) or
+//		  BALANCED (round robin) cursor, passing over frames taken
+//		  some other way: by compaction, mirrors, parity or a failed
+//		  cartridge. A spent cursor falls back to find_free_frame.
 //
-// Input	: file_alloc_table - The table that need to grow
-// Output	: 0 if successful
+// Input	: none
+// Output	: The free address (there must be one)
 
-int grow_file_alloc_table(FileAllocationTable **file_alloc_table) {
-	
-	//check if there is file in the table
-	if (num_of_file == 0) {
-		//allocate memory for new file
-		*file_alloc_table = malloc(sizeof(FileAllocationTable));
-	} else {
-		//reallocate memory for new file
-		*file_alloc_table = realloc(*file_alloc_table, (num_of_file + 1) * sizeof(FileAllocationTable));
-	}
+FileAddress cursor_address(void) {
 
-	//increase the num_of_file
-	num_of_file += 1;
-	
-	return 0;
+	FileAddress file_address;
+
+	do {
+		//Every frame has been handed out once, reuse the freed ones
+		if (alloc_cart >= CART_MAX_CARTRIDGES || alloc_frame < 0) {
+			return find_free_frame(0, 0);
+		}
+
+		file_address.cartridge = alloc_cart;
+		file_address.frame = alloc_frame;
+
+		//update the next address location
+		if (alloc_mode == CARTALLOC_LINEAR) {
+			if (alloc_frame == 0) {
+				alloc_frame = 1023;
+				alloc_cart = alloc_cart + 1;
+			} else {
+				alloc_frame = alloc_frame - 1;
+			}
+		} else {
+			if (alloc_cart == 63) {
+				alloc_cart = 0;
+				alloc_frame = alloc_frame -1;
+			} else {
+				alloc_cart = alloc_cart + 1;
+			}
+		}
+	} while (address_occupied(file_address));
+
+	return file_address;
 }
 
-/////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
 //
-// Function	: load_cart
-// Description	: Load cart with current cart check
+// Function	: affinity_address
+// Description	: Pick a frame for a file so its frames stay on as few
+//		  cartridges as possible while many files grow at once. Each
+//		  file has a home cartridge and reserves runs of AFFINITY_RUN
+//		  free frames there, which the other files leave alone. When
+//		  the home has no unreserved frame left the file moves home to
+//		  the cartridge with the most unreserved frames per file living
+//		  there; when every free frame is reserved it takes any.
 //
-// Input	: cart_num - The cart number of the cart that need to load
-// Output	: 0 if successful, -1 if failure
+// Input	: file - the file the frame is for
+// Output	: The free address (there must be one)
 
-int load_cart(int cart_num) {
+FileAddress affinity_address(FileAllocationTable *file) {
 
-	if (current_cart != cart_num) {
-		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_LDCART, 0, cart_num, 0), NULL)) == 1){
-			logMessage(LOG_ERROR_LEVEL, "Cart %d Load op fail\n\n", cart_num);
-			return(-1);
-		}
-		current_cart = cart_num;
+	FileAddress file_address = run_address(file);
+
+	//Reserve a new run on the home cartridge (moving home if it is full)
+	if (file_address.frame == -1 && reserve_run(file, AFFINITY_RUN) > 0) {
+		file_address = run_address(file);
+	}
+	if (file_address.frame != -1) {
+		return file_address;
 	}
-	
-	return 0;
 
+	//Every free frame is reserved, take one anyway
+	return find_free_frame(0, 0);
 }
+
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweron
-// Description  : Startup up the CART interface, initialize filesystem
+// Function	: run_address
+// Description	: Hand out the next frame of the run a file reserved,
+//		  skipping any another allocator took meanwhile
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Input	: file - the file the frame is for
+// Output	: The address, {-1, -1} if the run is used up
 
-int32_t cart_poweron(void) {
-	
-	//Check if it is on
-	if (driver_status == ON) {
-		logMessage(LOG_ERROR_LEVEL, "The driver is already ON\n\n");
-		return(-1);
-	}
-	
-	//Initialize the cart interface
-	if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_INITMS, 0, 0, 0), NULL)) == 1) {
-		return(-1);
-	}
-	
-	current_cart = -1;
+FileAddress run_address(FileAllocationTable *file) {
 
-	//Zero all memory
-	for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
-		
-		//load cart
-		load_cart(i);
+	FileAddress file_address = { -1, -1 };
+	int frame;
 
-		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_BZERO, 0, 0, 0), NULL)) == 1){
-				logMessage(LOG_ERROR_LEVEL, "Cart %d Zero op fail\n\n", i);
-				return(-1);
+	while (file->run_left > 0) {
+		frame = file->run_next;
+		file->run_next += 1;
+		file->run_left -= 1;
+		if (frame_status[file->home][frame] == 0 && frame_owner[file->home][frame] == file->descriptor) {
+			frame_owner[file->home][frame] = 0;
+			file_address.cartridge = file->home;
+			file_address.frame = frame;
+			break;
 		}
 	}
-			
-	//Initialize internal data structure
-	initialize_file_allocation_table();
-	num_of_file = 0;
-	
-	// Initialize cache
-	init_cart_cache();
-	
-	//Set drvier status open
-	driver_status = ON;
-	
-	// Return successfully
-	return(0);
-			
-	
+
+	return file_address;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_poweroff
-// Description  : Shut down the CART interface, close all files
+// Function	: drop_run
+// Description	: Give back the frames of a file's run it has not used, so
+//		  other files may take them
 //
-// Inputs       : none
-// Outputs      : 0 if successful, -1 if failure
+// Input	: file - the file
+// Output	: none
 
-int32_t cart_poweroff(void) {
+void drop_run(FileAllocationTable *file) {
 
-	//Check if the driver is ON
-	if (driver_status == OFF) {
-		logMessage(LOG_ERROR_LEVEL, "The driver is not open.\n\n");
-		return(-1);
+	for (; file->run_left > 0; file->run_left--, file->run_next++) {
+		if (frame_owner[file->home][file->run_next] == file->descriptor) {
+			frame_owner[file->home][file->run_next] = 0;
+		}
 	}
 
-	//Execute shutdown opcode
-	if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_POWOFF,0,0,0), NULL)) == 1) {
-		logMessage(LOG_ERROR_LEVEL, "Cart shundown op fail\n\n");
-		return(-1);
+	//Frames reserved on the stripe members
+	for (int i = 0; i < file->stripe_width; i++) {
+		for (int frame = 0; frame < CART_CARTRIDGE_SIZE; frame++) {
+			if (frame_owner[file->stripe[i]][frame] == file->descriptor) {
+				frame_owner[file->stripe[i]][frame] = 0;
+			}
+		}
 	}
+}
 
-	//Close all file
-	for (int i = 0; i < num_of_file; i++) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: reserve_run
+// Description	: Reserve free frames of a file's home cartridge for it, as
+//		  the run the AFFINITY allocator hands out next. A file
+//		  without a home, or whose home has no unreserved frame left,
+//		  moves to the cartridge with the most unreserved frames per
+//		  file living there (one with room for all the frames if it
+//		  can). Any run not handed out yet is given back first.
+//
+// Input	: file - the file
+//		  frames - the frames wanted
+// Output	: frames reserved, 0 if every free frame is reserved already
+
+int reserve_run(FileAllocationTable *file, int frames) {
+
+	int unowned, best, best_score, score, fits, best_fits, frame, taken = 0;
+
+	drop_run(file);
+
+	//Move home if the home cannot give a frame (or all of them, if another can)
+	unowned = (file->home == -1) ? 0 : count_unowned(file->home);
+	if (unowned < frames) {
+		best = -1;
+		best_score = 0;
+		best_fits = 0;
+		for (int cart = 0; cart < CART_MAX_CARTRIDGES; cart++) {
+			int free_frames = count_unowned(cart);
+			if (free_frames == 0) continue;
+			fits = (free_frames >= frames);
+			score = free_frames / (cart_homes[cart] + 1);
+			if (best == -1 || fits > best_fits || (fits == best_fits && score > best_score)) {
+				best = cart;
+				best_score = score;
+				best_fits = fits;
+			}
+		}
+		if (best != -1 && (unowned == 0 || (best_fits && best != file->home))) {
+			if (file->home != -1) {
+				cart_homes[file->home] -= 1;
+			}
+			file->home = best;
+			cart_homes[best] += 1;
+		} else if (unowned == 0) {
+			return 0;
+		}
+	}
+
+	//Reserve the first free frames nobody has, as one run
+	for (frame = 0; frame < CART_CARTRIDGE_SIZE; frame++) {
+		if (frame_status[file->home][frame] == 0 && frame_owner[file->home][frame] == 0) break;
+	}
+	file->run_next = frame;
+	file->run_left = 0;
+	for (; frame < CART_CARTRIDGE_SIZE && taken < frames; frame++) {
+		if (frame_status[file->home][frame] == 0 && frame_owner[file->home][frame] == 0) {
+			frame_owner[file->home][frame] = file->descriptor;
+			taken += 1;
+		}
+		file->run_left = frame - file->run_next + 1;
+	}
+
+	return taken;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: count_unowned
+// Description	: Count the free frames of a cartridge no file has reserved
+//
+// Input	: cart - the cartridge
+// Output	: the number of frames
+
+int count_unowned(int cart) {
+
+	int unowned = 0;
+
+	for (int frame = 0; frame < CART_CARTRIDGE_SIZE; frame++) {
+		if (frame_status[cart][frame] == 0 && frame_owner[cart][frame] == 0) unowned += 1;
+	}
+
+	return unowned;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: owned_frame
+// Description	: Find a free frame of a cartridge for a file, one it has
+//		  reserved if there is one, else one nobody has
+//
+// Input	: cart - the cartridge
+//		  file - the file
+// Output	: the frame, -1 if there is none
+
+int owned_frame(int cart, FileAllocationTable *file) {
+
+	int found = -1;
+
+	for (int frame = 0; frame < CART_CARTRIDGE_SIZE; frame++) {
+		if (frame_status[cart][frame] != 0) continue;
+		if (frame_owner[cart][frame] == file->descriptor) return frame;
+		if (frame_owner[cart][frame] == 0 && found == -1) found = frame;
+	}
+
+	return found;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: stripe_address
+// Description	: Pick a frame for a SEQUENTIAL file, going round its stripe
+//		  members STRIPE_UNIT frames at a time so a stream of frames
+//		  spreads evenly over them. A member with no frame left for the file is replaced
+//		  by the cartridge with the most unreserved frames outside the
+//		  stripe; when there is none it takes any free frame.
+//
+// Input	: file - the file the frame is for
+// Output	: The free address (there must be one)
+
+FileAddress stripe_address(FileAllocationTable *file) {
+
+	FileAddress file_address;
+	int frame, best, best_free, free_frames, member;
+
+	for (int tries = 0; tries < 2; tries++) {
+		frame = owned_frame(file->stripe[file->stripe_next], file);
+		if (frame != -1) {
+			file_address.cartridge = file->stripe[file->stripe_next];
+			file_address.frame = frame;
+			frame_owner[file_address.cartridge][frame] = 0;
+			file->stripe_used += 1;
+			if (file->stripe_used == STRIPE_UNIT) {
+				file->stripe_used = 0;
+				file->stripe_next = (file->stripe_next + 1) % file->stripe_width;
+			}
+			return file_address;
+		}
+
+		//Replace the full member
+		best = -1;
+		best_free = 0;
+		for (int cart = 0; cart < CART_MAX_CARTRIDGES; cart++) {
+			for (member = 0; member < file->stripe_width && file->stripe[member] != cart; member++);
+			if (member < file->stripe_width) continue;
+			free_frames = count_unowned(cart);
+			if (free_frames > best_free) {
+				best = cart;
+				best_free = free_frames;
+			}
+		}
+		if (best == -1) break;
+		file->stripe[file->stripe_next] = best;
+	}
+
+	//Every free frame is reserved or in the stripe, take one anyway
+	return find_free_frame(0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: release_frame
+// Description	: Drop one file frame's use of a frame. The last user frees it,
+//		  taking it out of the fingerprint index and the cache so a
+//		  later owner never sees the old contents, and frees its mirror.
+//		  Frames of a failed cartridge are not freed but retired.
+//
+// Input	: address - the frame
+// Output	: 0 if successful, -1 if the frame was not in use
+
+int release_frame(FileAddress address) {
+
+	if (frame_status[address.cartridge][address.frame] == 0) {
+		logMessage(LOG_ERROR_LEVEL, "Release of free frame [%d/%d]\n\n", address.cartridge, address.frame);
+		return(-1);
+	}
+
+	frame_status[address.cartridge][address.frame] -= 1;
+	if (frame_status[address.cartridge][address.frame] == 0) {
+		frame_owner[address.cartridge][address.frame] = 0;
+		dedup_remove(address);
+		free(delete_cart_cache(address.cartridge, address.frame));
+		if (cart_failed[address.cartridge]) {
+			frame_status[address.cartridge][address.frame] = 1;
+		} else {
+			frames_free += 1;
+		}
+
+		//The mirror goes too, and any write of it still queued
+		int32_t mirror = frame_mirror[address.cartridge][address.frame];
+		if (mirror != MIRROR_NONE) {
+			if (mirror_stale[address.cartridge][address.frame]) {
+				for (int i = 0; i < num_mirror_writes; i++) {
+					if (mirror_queue[i].primary.cartridge == address.cartridge && mirror_queue[i].primary.frame == address.frame) {
+						mirror_queue[i].primary.cartridge = -1;
+						mirror_queue[i].primary.frame = -1;
+					}
+				}
+				mirror_stale[address.cartridge][address.frame] = 0;
+			}
+			if (!cart_failed[mirror / CART_CARTRIDGE_SIZE]) {
+				frame_status[mirror / CART_CARTRIDGE_SIZE][mirror % CART_CARTRIDGE_SIZE] = 0;
+				frames_free += 1;
+			}
+			frame_primary[mirror / CART_CARTRIDGE_SIZE][mirror % CART_CARTRIDGE_SIZE] = MIRROR_NONE;
+			frame_mirror[address.cartridge][address.frame] = MIRROR_NONE;
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: attach_mirror
+// Description	: Take a frame for the mirror of a new frame. Mirrors of a
+//		  cartridge go to its partner MIRROR_PARTNER cartridges on
+//		  (or the next with a free frame), so a file on one cartridge
+//		  is mirrored together on one other, and never onto the
+//		  cartridge of the frame itself.
+//
+// Input	: address - the frame
+// Output	: 0 if successful, -1 if no frame was free (it stays unmirrored)
+
+int attach_mirror(FileAddress address) {
+
+	int id = ((address.cartridge + MIRROR_PARTNER) % CART_MAX_CARTRIDGES) * CART_CARTRIDGE_SIZE;
+
+	for (int i = 0; i < CART_TOTAL_FRAMES; i++, id = (id + 1) % CART_TOTAL_FRAMES) {
+		if (id / CART_CARTRIDGE_SIZE != address.cartridge &&
+			frame_status[id / CART_CARTRIDGE_SIZE][id % CART_CARTRIDGE_SIZE] == 0) {
+			frame_status[id / CART_CARTRIDGE_SIZE][id % CART_CARTRIDGE_SIZE] = 1;
+			frame_mirror[address.cartridge][address.frame] = id;
+			frame_primary[id / CART_CARTRIDGE_SIZE][id % CART_CARTRIDGE_SIZE] = FRAME_ID(address);
+			frames_free -= 1;
+			return 0;
+		}
+	}
+
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: queue_mirror_write
+// Description	: Queue the write of a frame's mirror for flush_mirrors, so
+//		  the mirrors of a whole cart_write are written a cartridge
+//		  at a time instead of loading the partner after every frame.
+//		  The mirror is not read until it is written.
+//
+// Input	: address - the frame (already written)
+//		  data - its contents
+// Output	: 0 if successful, -1 if failure
+
+int queue_mirror_write(FileAddress address, void *data) {
+
+	int32_t mirror = frame_mirror[address.cartridge][address.frame];
+	MirrorWrite *queue;
+
+	//Written again before the flush, the queued write takes the new contents
+	if (mirror_stale[address.cartridge][address.frame]) {
+		for (int i = 0; i < num_mirror_writes; i++) {
+			if (mirror_queue[i].primary.cartridge == address.cartridge && mirror_queue[i].primary.frame == address.frame) {
+				memcpy(mirror_queue[i].data, data, CART_FRAME_SIZE);
+				return 0;
+			}
+		}
+	}
+
+	if (num_mirror_writes == max_mirror_writes) {
+		queue = realloc(mirror_queue, (max_mirror_writes + 64) * sizeof(MirrorWrite));
+		if (queue == NULL) {
+			logMessage(LOG_ERROR_LEVEL, "Mirror queue allocation fail\n\n");
+			return(-1);
+		}
+		mirror_queue = queue;
+		max_mirror_writes += 64;
+	}
+
+	mirror_queue[num_mirror_writes].primary = address;
+	mirror_queue[num_mirror_writes].mirror.cartridge = mirror / CART_CARTRIDGE_SIZE;
+	mirror_queue[num_mirror_writes].mirror.frame = mirror % CART_CARTRIDGE_SIZE;
+	memcpy(mirror_queue[num_mirror_writes].data, data, CART_FRAME_SIZE);
+	num_mirror_writes += 1;
+	mirror_stale[address.cartridge][address.frame] = 1;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_mirrors
+// Description	: Write the queued mirrors, the loaded cartridge first and
+//		  then each cartridge once
+//
+// Input	: none
+// Output	: 0 if successful, -1 if failure (the mirrors not written stay
+//		  unread until written again)
+
+int flush_mirrors(void) {
+
+	int ret = 0;
+
+	qsort(mirror_queue, num_mirror_writes, sizeof(MirrorWrite), compare_mirror_writes);
+
+	for (int i = 0; i < num_mirror_writes && ret == 0; i++) {
+		MirrorWrite *write = &mirror_queue[i];
+		if (write->primary.frame == -1 || cart_failed[write->mirror.cartridge]) {
+			continue;
+		}
+		if (load_cart(write->mirror.cartridge) == -1 ||
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME, 0, 0, write->mirror.frame), write->data)) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "Cart mirror write fail\n\n");
+			ret = -1;
+			break;
+		}
+		note_frame_written(write->mirror, write->data);
+		driver_stats.mirror_writes += 1;
+	}
+
+	//Only a fully written queue makes its mirrors readable (those on a
+	//failed cartridge never are)
+	if (ret == 0) {
+		for (int i = 0; i < num_mirror_writes; i++) {
+			if (mirror_queue[i].primary.frame != -1 && !cart_failed[mirror_queue[i].mirror.cartridge]) {
+				mirror_stale[mirror_queue[i].primary.cartridge][mirror_queue[i].primary.frame] = 0;
+			}
+		}
+	}
+	num_mirror_writes = 0;
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: compare_mirror_writes
+// Description	: Order mirror writes by cartridge (the loaded one first),
+//		  then by frame
+//
+// Input	: a, b - the writes
+// Output	: <0, 0 or >0 as a goes before, with or after b
+
+int compare_mirror_writes(const void *a, const void *b) {
+
+	const MirrorWrite *x = a, *y = b;
+	int kx = (x->mirror.cartridge == current_cart) ? -1 : x->mirror.cartridge;
+	int ky = (y->mirror.cartridge == current_cart) ? -1 : y->mirror.cartridge;
+
+	if (kx != ky) {
+		return kx - ky;
+	}
+	return x->mirror.frame - y->mirror.frame;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: readable_mirror
+// Description	: Get the mirror of a frame, if it has one that is written
+//		  (on a cartridge that has not failed)
+//
+// Input	: address - the frame
+// Output	: The mirror, {-1, -1} if there is none to read
+
+FileAddress readable_mirror(FileAddress address) {
+
+	FileAddress mirror = { -1, -1 };
+	int32_t id = frame_mirror[address.cartridge][address.frame];
+
+	if (id != MIRROR_NONE && !mirror_stale[address.cartridge][address.frame] && !cart_failed[id / CART_CARTRIDGE_SIZE]) {
+		mirror.cartridge = id / CART_CARTRIDGE_SIZE;
+		mirror.frame = id % CART_CARTRIDGE_SIZE;
+	}
+
+	return mirror;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: parity_address
+// Description	: Get the parity frame of the stripe holding a frame. A stripe
+//		  is frame f of each cartridge of a PARITY_GROUP, and its
+//		  parity is on the group's cartridge (f mod PARITY_GROUP), so
+//		  the parity writes rotate over the group.
+//
+// Input	: address - the frame
+// Output	: The parity frame
+
+FileAddress parity_address(FileAddress address) {
+
+	FileAddress parity;
+
+	parity.cartridge = address.cartridge - address.cartridge % PARITY_GROUP + address.frame % PARITY_GROUP;
+	parity.frame = address.frame;
+
+	return parity;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: queue_parity_write
+// Description	: Queue the change a frame write makes to its stripe's parity,
+//		  for flush_parity at the end of the operation. The old
+//		  contents are taken from what is known without the bus (never
+//		  written, last read by load_frame, or cached), so call it
+//		  after the write but before the cache has the new contents
+//		  and before note_frame_written.
+//
+// Input	: address - the frame (already written)
+//		  data - its new contents
+// Output	: 0 if successful, -1 if failure
+
+int queue_parity_write(FileAddress address, void *data) {
+
+	ParityWrite *queue, *write;
+	void *cached;
+
+	//Written again before the flush, the change adds to the queued one
+	if (parity_queued[address.cartridge][address.frame]) {
+		for (int i = 0; i < num_parity_writes; i++) {
+			write = &parity_queue[i];
+			if (write->frame.cartridge == address.cartridge && write->frame.frame == address.frame) {
+				xor_frame(write->delta, write->data);
+				xor_frame(write->delta, data);
+				memcpy(write->data, data, CART_FRAME_SIZE);
+				break;
+			}
+		}
+	} else {
+		if (num_parity_writes == max_parity_writes) {
+			queue = realloc(parity_queue, (max_parity_writes + 64) * sizeof(ParityWrite));
+			if (queue == NULL) {
+				logMessage(LOG_ERROR_LEVEL, "Parity queue allocation fail\n\n");
+				return(-1);
+			}
+			parity_queue = queue;
+			max_parity_writes += 64;
+		}
+
+		write = &parity_queue[num_parity_writes];
+		write->frame = address;
+		write->parity = parity_address(address);
+		memcpy(write->data, data, CART_FRAME_SIZE);
+
+		//The old contents, if they are known
+		write->delta_known = 1;
+		if (!frame_written[address.cartridge][address.frame]) {
+			memset(write->delta, 0x0, CART_FRAME_SIZE);
+		} else if (hint_address.cartridge == address.cartridge && hint_address.frame == address.frame) {
+			memcpy(write->delta, hint_data, CART_FRAME_SIZE);
+		} else if ((cached = peek_cart_cache(address.cartridge, address.frame)) != NULL) {
+			memcpy(write->delta, cached, CART_FRAME_SIZE);
+		} else {
+			write->delta_known = 0;
+		}
+		if (write->delta_known) {
+			xor_frame(write->delta, data);
+		}
+
+		num_parity_writes += 1;
+		parity_queued[address.cartridge][address.frame] = 1;
+	}
+
+	if (hint_address.cartridge == address.cartridge && hint_address.frame == address.frame) {
+		memcpy(hint_data, data, CART_FRAME_SIZE);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: flush_parity
+// Description	: Write the parity of every stripe the queued writes changed,
+//		  the loaded cartridge first. Each stripe takes whichever needs
+//		  fewer reads: the new parity from all its data frames (none
+//		  to read when the operation wrote the whole stripe, or the
+//		  rest were never written), or the old parity with the changes
+//		  XORed in. Parity frames stay out of the cache, where they
+//		  would crowd out the data. A stripe whose parity is on a
+//		  failed cartridge is left unprotected.
+//
+// Input	: none
+// Output	: 0 if successful, -1 if failure
+
+int flush_parity(void) {
+
+	char parity[CART_FRAME_SIZE], member_data[CART_FRAME_SIZE];
+	FileAddress parity_frame, member;
+	int first, last, i, j, ret = 0, deltas_known, whole_ok, whole_reads, written;
+
+	qsort(parity_queue, num_parity_writes, sizeof(ParityWrite), compare_parity_writes);
+
+	for (first = 0; first < num_parity_writes && ret == 0; first = last) {
+		parity_frame = parity_queue[first].parity;
+		deltas_known = 1;
+		for (last = first; last < num_parity_writes &&
+			parity_queue[last].parity.cartridge == parity_frame.cartridge &&
+			parity_queue[last].parity.frame == parity_frame.frame; last++) {
+			deltas_known &= parity_queue[last].delta_known;
+			parity_queued[parity_queue[last].frame.cartridge][parity_queue[last].frame.frame] = 0;
+		}
+		if (cart_failed[parity_frame.cartridge]) {
+			continue;
+		}
+
+		//Reads the whole stripe would need: the data frames not written now
+		whole_ok = 1;
+		whole_reads = 0;
+		member.frame = parity_frame.frame;
+		for (j = 0; j < PARITY_GROUP; j++) {
+			member.cartridge = parity_frame.cartridge - parity_frame.cartridge % PARITY_GROUP + j;
+			if (member.cartridge == parity_frame.cartridge) continue;
+			for (i = first; i < last && parity_queue[i].frame.cartridge != member.cartridge; i++);
+			if (i < last || !frame_written[member.cartridge][member.frame] ||
+				peek_cart_cache(member.cartridge, member.frame) != NULL) continue;
+			if (cart_failed[member.cartridge]) {
+				whole_ok = 0;
+			}
+			whole_reads += 1;
+		}
+		if (!deltas_known || parity_stale[parity_frame.cartridge][parity_frame.frame]) {
+			deltas_known = 0;
+			if (!whole_ok) {
+				logMessage(LOG_WARNING_LEVEL, "Parity [%d/%d] cannot be brought up to date\n\n", parity_frame.cartridge, parity_frame.frame);
+				parity_stale[parity_frame.cartridge][parity_frame.frame] = 1;
+				continue;
+			}
+		}
+
+		if (!whole_ok || (deltas_known && whole_reads > 1)) {
+			//The old parity and the changes
+			ret = read_member(parity_frame, parity);
+			for (i = first; i < last && ret == 0; i++) {
+				xor_frame(parity, parity_queue[i].delta);
+			}
+
+			//An old parity that cannot be read is worked out again
+			if (ret == -1 && whole_ok) {
+				deltas_known = 0;
+				ret = 0;
+			}
+		}
+
+		if (whole_ok && (!deltas_known || whole_reads <= 1)) {
+			//The parity of the whole stripe
+			memset(parity, 0x0, CART_FRAME_SIZE);
+			for (j = 0; j < PARITY_GROUP && ret == 0; j++) {
+				member.cartridge = parity_frame.cartridge - parity_frame.cartridge % PARITY_GROUP + j;
+				if (member.cartridge == parity_frame.cartridge) continue;
+				for (i = first; i < last && parity_queue[i].frame.cartridge != member.cartridge; i++);
+				if (i < last) {
+					xor_frame(parity, parity_queue[i].data);
+				} else if ((ret = read_member(member, member_data)) == 0) {
+					xor_frame(parity, member_data);
+				}
+			}
+			if (whole_reads == 0) {
+				driver_stats.full_stripes += 1;
+			}
+		}
+
+		written = (ret == 0 && load_cart(parity_frame.cartridge) == 0 &&
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME, 0, 0, parity_frame.frame), parity)) == 0);
+		if (!written) {
+			logMessage(LOG_ERROR_LEVEL, "Cart parity write fail\n\n");
+			parity_stale[parity_frame.cartridge][parity_frame.frame] = 1;
+			ret = -1;
+			break;
+		}
+		note_frame_written(parity_frame, parity);
+		parity_stale[parity_frame.cartridge][parity_frame.frame] = 0;
+		driver_stats.parity_writes += 1;
+	}
+
+	//Stripes not reached after a failure cannot be trusted
+	for (i = first; i < num_parity_writes; i++) {
+		parity_stale[parity_queue[i].parity.cartridge][parity_queue[i].parity.frame] = 1;
+		parity_queued[parity_queue[i].frame.cartridge][parity_queue[i].frame.frame] = 0;
+	}
+	num_parity_writes = 0;
+
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: compare_parity_writes
+// Description	: Order parity changes by the cartridge of their parity (the
+//		  loaded one first), then by stripe
+//
+// Input	: a, b - the changes
+// Output	: <0, 0 or >0 as a goes before, with or after b
+
+int compare_parity_writes(const void *a, const void *b) {
+
+	const ParityWrite *x = a, *y = b;
+	int kx = (x->parity.cartridge == current_cart) ? -1 : x->parity.cartridge;
+	int ky = (y->parity.cartridge == current_cart) ? -1 : y->parity.cartridge;
+
+	if (kx != ky) {
+		return kx - ky;
+	}
+	if (x->parity.frame != y->parity.frame) {
+		return x->parity.frame - y->parity.frame;
+	}
+	return x->frame.cartridge - y->frame.cartridge;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: read_member
+// Description	: Read a frame of a stripe (data or parity) for parity work:
+//		  from the cache, as zeros if it was never written, else from
+//		  its cartridge
+//
+// Input	: address - the frame
+//		  data - where to read it
+// Output	: 0 if successful, -1 if it had to be read from a failed
+//		  cartridge, the read failed or it failed its checksum
+
+int read_member(FileAddress address, void *data) {
+
+	void *cached;
+
+	if ((cached = peek_cart_cache(address.cartridge, address.frame)) != NULL) {
+		memcpy(data, cached, CART_FRAME_SIZE);
+		return 0;
+	}
+	if (!frame_written[address.cartridge][address.frame]) {
+		memset(data, 0x0, CART_FRAME_SIZE);
+		return 0;
+	}
+	if (cart_failed[address.cartridge]) {
+		logMessage(LOG_ERROR_LEVEL, "Frame [%d/%d] is on a failed cartridge\n\n", address.cartridge, address.frame);
+		return(-1);
+	}
+
+	if (load_cart(address.cartridge) == -1 ||
+		extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME, 0, 0, address.frame), data)) == 1) {
+		logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
+		return(-1);
+	}
+	driver_stats.parity_reads += 1;
+
+	return verify_frame(address, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: degraded_read
+// Description	: Read a frame of a failed cartridge: from its mirror if that
+//		  passes its checksum, else from the rest of its stripe
+//
+// Input	: address - the frame
+//		  data - where to read it
+// Output	: 0 if successful, -1 if there is no good copy to read
+
+int degraded_read(FileAddress address, void *data) {
+
+	FileAddress mirror = readable_mirror(address);
+
+	driver_stats.degraded_reads += 1;
+
+	if (mirror.frame != -1) {
+		if (load_cart(mirror.cartridge) == -1 ||
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME, 0, 0, mirror.frame), data)) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
+			return(-1);
+		}
+		if (verify_frame(mirror, data) == 0) {
+			driver_stats.mirror_reads += 1;
+			return 0;
+		}
+	}
+
+	return stripe_read(address, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: stripe_read
+// Description	: Rebuild a frame as the XOR of its stripe's parity and other
+//		  data frames (the queued parity is written first so it
+//		  covers every write), checked against the frame's checksum
+//
+// Input	: address - the frame
+//		  data - where to put it
+// Output	: 0 if successful, -1 if the stripe cannot give it back
+
+int stripe_read(FileAddress address, void *data) {
+
+	char member_data[CART_FRAME_SIZE];
+	FileAddress parity = parity_address(address), member;
+
+	if (!parity_enabled || (num_parity_writes > 0 && flush_parity() == -1) ||
+		cart_failed[parity.cartridge] || parity_stale[parity.cartridge][parity.frame]) {
+		logMessage(LOG_ERROR_LEVEL, "Frame [%d/%d] has no other copy\n\n", address.cartridge, address.frame);
+		return(-1);
+	}
+
+	if (read_member(parity, data) == -1) {
+		return(-1);
+	}
+	member.frame = address.frame;
+	for (int j = 0; j < PARITY_GROUP; j++) {
+		member.cartridge = address.cartridge - address.cartridge % PARITY_GROUP + j;
+		if (member.cartridge == address.cartridge || member.cartridge == parity.cartridge) continue;
+		if (read_member(member, member_data) == -1) {
+			return(-1);
+		}
+		xor_frame(data, member_data);
+	}
+
+	return verify_frame(address, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: note_frame_written
+// Description	: Note the contents just written to a frame: its CRC32C, which
+//		  every later read from the bus is checked against
+//
+// Input	: address - the frame
+//		  data - its contents
+// Output	: none
+
+void note_frame_written(FileAddress address, void *data) {
+
+	frame_crc[address.cartridge][address.frame] = crc32c(data, CART_FRAME_SIZE);
+	frame_written[address.cartridge][address.frame] = 1;
+	frame_checked[address.cartridge][address.frame] = last_file_op;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: verify_frame
+// Description	: Check a frame read from the bus against its checksum. A
+//		  frame never written holds the zeros of power on, and has
+//		  none.
+//
+// Input	: address - the frame read (a primary, mirror or parity frame)
+//		  data - what the bus returned
+// Output	: 0 if it matches, -1 if the frame is corrupt
+
+int verify_frame(FileAddress address, void *data) {
+
+	if (frame_written[address.cartridge][address.frame] &&
+		crc32c(data, CART_FRAME_SIZE) != frame_crc[address.cartridge][address.frame]) {
+		logMessage(LOG_ERROR_LEVEL, "Frame [%d/%d] failed its checksum\n\n", address.cartridge, address.frame);
+		driver_stats.checksum_errors += 1;
+		return(-1);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: recover_frame
+// Description	: Get good contents for a frame whose copy failed its
+//		  checksum, from its other copy (the mirror, or the primary of
+//		  a bad mirror) or else from its stripe, and write them over
+//		  the bad copy
+//
+// Input	: address - the frame (the primary)
+//		  bad - the copy that failed, the primary or its mirror
+//		  data - where to put the good contents
+// Output	: 0 if successful, -1 if there is no good copy
+
+int recover_frame(FileAddress address, FileAddress bad, void *data) {
+
+	FileAddress other = readable_mirror(address);
+	int good = -1;
+
+	//The other copy
+	if (bad.cartridge != address.cartridge || bad.frame != address.frame) {
+		other = address;
+	}
+	if (other.frame != -1 && !cart_failed[other.cartridge] && (other.cartridge != bad.cartridge || other.frame != bad.frame)) {
+		good = (load_cart(other.cartridge) == 0 &&
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME, 0, 0, other.frame), data)) == 0) ?
+			verify_frame(other, data) : -1;
+	}
+
+	//Else the rest of its stripe
+	if (good == -1 && parity_enabled) {
+		good = stripe_read(address, data);
+	}
+	if (good == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Frame [%d/%d] is corrupt and has no good copy\n\n", address.cartridge, address.frame);
+		return(-1);
+	}
+
+	//Mend the bad copy
+	if (load_cart(bad.cartridge) == 0 &&
+		extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME, 0, 0, bad.frame), data)) == 0) {
+		note_frame_written(bad, data);
+		driver_stats.frames_repaired += 1;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: repair_frame
+// Description	: Repair a frame the scrubber found corrupt. A parity frame is
+//		  worked out again from its stripe, a mirror is copied from its
+//		  primary, and any other frame goes through recover_frame.
+//
+// Input	: address - the frame
+//		  data - a frame sized buffer to work in
+// Output	: 0 if successful, -1 if there is no good copy
+
+int repair_frame(FileAddress address, void *data) {
+
+	char member_data[CART_FRAME_SIZE];
+	FileAddress member;
+	int32_t id = frame_primary[address.cartridge][address.frame];
+
+	//A parity frame, once the queued changes are in
+	if (parity_enabled && address.frame % PARITY_GROUP == address.cartridge % PARITY_GROUP) {
+		if (num_parity_writes > 0 && flush_parity() == -1) {
+			return(-1);
+		}
+		memset(data, 0x0, CART_FRAME_SIZE);
+		member.frame = address.frame;
+		for (int j = 0; j < PARITY_GROUP; j++) {
+			member.cartridge = address.cartridge - address.cartridge % PARITY_GROUP + j;
+			if (member.cartridge == address.cartridge) continue;
+			if (read_member(member, member_data) == -1) {
+				parity_stale[address.cartridge][address.frame] = 1;
+				return(-1);
+			}
+			xor_frame(data, member_data);
+		}
+		if (load_cart(address.cartridge) == -1 ||
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME, 0, 0, address.frame), data)) == 1) {
+			parity_stale[address.cartridge][address.frame] = 1;
+			return(-1);
+		}
+		note_frame_written(address, data);
+		parity_stale[address.cartridge][address.frame] = 0;
+		driver_stats.frames_repaired += 1;
+		return 0;
+	}
+
+	//A mirror, known by its primary
+	if (id != MIRROR_NONE) {
+		member.cartridge = id / CART_CARTRIDGE_SIZE;
+		member.frame = id % CART_CARTRIDGE_SIZE;
+		return recover_frame(member, address, data);
+	}
+
+	return recover_frame(address, address, data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: dedup_lookup
+// Description	: Find the frame holding the given contents
+//
+// Input	: fingerprint - the SHA1 of the contents
+// Output	: The frame, {-1, -1} if no frame holds them
+
+FileAddress dedup_lookup(const unsigned char *fingerprint) {
+
+	FileAddress address = { -1, -1 };
+	uint32_t mask = (1u << DEDUP_INDEX_BITS) - 1;
+	uint32_t slot;
+	int32_t id;
+
+	// the fingerprint is already uniform, so its first bytes pick the slot
+	memcpy(&slot, fingerprint, sizeof(slot));
+	slot &= mask;
+
+	// walk the probe sequence until the fingerprint or an empty slot
+	while ((id = dedup_index[slot]) != DEDUP_EMPTY) {
+		if (memcmp(frame_fingerprint[id / CART_CARTRIDGE_SIZE][id % CART_CARTRIDGE_SIZE], fingerprint, DEDUP_FINGERPRINT_SIZE) == 0) {
+			address.cartridge = id / CART_CARTRIDGE_SIZE;
+			address.frame = id % CART_CARTRIDGE_SIZE;
+			break;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	return address;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: dedup_insert
+// Description	: Record the contents of a frame in the fingerprint index
+//
+// Input	: address - the frame
+//		  fingerprint - the SHA1 of its contents
+// Output	: 0 if successful
+
+int dedup_insert(FileAddress address, const unsigned char *fingerprint) {
+
+	uint32_t mask = (1u << DEDUP_INDEX_BITS) - 1;
+	uint32_t slot;
+
+	memcpy(frame_fingerprint[address.cartridge][address.frame], fingerprint, DEDUP_FINGERPRINT_SIZE);
+	memcpy(&slot, fingerprint, sizeof(slot));
+	slot &= mask;
+
+	// the index has twice as many slots as frames, so a free slot always exists
+	while (dedup_index[slot] != DEDUP_EMPTY) {
+		slot = (slot + 1) & mask;
+	}
+	dedup_index[slot] = FRAME_ID(address);
+	frame_indexed[address.cartridge][address.frame] = 1;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: dedup_remove
+// Description	: Forget the contents of a frame, shifting later entries of the
+//		  probe run back so no tombstones are needed
+//
+// Input	: address - the frame
+// Output	: 0 if successful (or the frame was not indexed)
+
+int dedup_remove(FileAddress address) {
+
+	uint32_t mask = (1u << DEDUP_INDEX_BITS) - 1;
+	uint32_t slot, hole, next, home;
+	int32_t id = FRAME_ID(address);
+
+	if (!frame_indexed[address.cartridge][address.frame]) return 0;
+	frame_indexed[address.cartridge][address.frame] = 0;
+
+	// find the slot of the frame
+	memcpy(&slot, frame_fingerprint[address.cartridge][address.frame], sizeof(slot));
+	slot &= mask;
+	while (dedup_index[slot] != id) {
+		slot = (slot + 1) & mask;
+	}
+
+	// backward shift the rest of the run into the hole
+	hole = slot;
+	next = (slot + 1) & mask;
+	while (dedup_index[next] != DEDUP_EMPTY) {
+		memcpy(&home, frame_fingerprint[dedup_index[next] / CART_CARTRIDGE_SIZE][dedup_index[next] % CART_CARTRIDGE_SIZE], sizeof(home));
+		home &= mask;
+
+		// move the entry if its home is not between the hole and its slot
+		if (((next - home) & mask) >= ((next - hole) & mask)) {
+			dedup_index[hole] = dedup_index[next];
+			hole = next;
+		}
+		next = (next + 1) & mask;
+	}
+	dedup_index[hole] = DEDUP_EMPTY;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: load_frame
+// Description	: Read a frame of a file. A hole reads as zeros without
+//		  touching the bus or the cache. A mirrored frame is read
+//		  from its mirror when that saves loading a cartridge, and a
+//		  frame of a failed cartridge through degraded_read. A frame
+//		  read from the bus is checked against its checksum.
+//
+// Input	: file - the file
+//		  index - the frame of the file (index into its address list)
+//		  data - where to read the frame
+// Output	: 0 if successful, -1 if failure
+
+int load_frame(FileAllocationTable *file, int index, void *data) {
+
+	FileAddress address = file->file_address[index];
+	FileAddress source;
+	void *cached;
+
+	if (address.cartridge == CART_HOLE) {
+		memset(data, 0x0, CART_FRAME_SIZE);
+		driver_stats.zero_reads += 1;
+		return 0;
+	}
+
+	// Check if in the cache
+	if ((cached = get_cart_cache(address.cartridge, address.frame)) != NULL) {
+		memcpy(data, cached, CART_FRAME_SIZE);
+
+	} else if (cart_failed[address.cartridge]) {
+		// Rebuild it from the other copies
+		if (degraded_read(address, data) == -1) {
+			return(-1);
+		}
+		put_cart_cache(address.cartridge, address.frame, data);
+
+	} else {
+		// Read the mirror if its cartridge is the one loaded
+		source = readable_mirror(address);
+		if (source.cartridge != current_cart || address.cartridge == current_cart) {
+			source = address;
+		} else {
+			driver_stats.mirror_reads += 1;
+		}
+
+		//load cart
+		if (load_cart(source.cartridge) == -1) {
+			return(-1);
+		}
+
+		//read frame
+		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME,0,0, source.frame), data)) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
+			return(-1);
+		}
+
+		//check it, taking another copy if it is corrupt
+		if (verify_frame(source, data) == -1 && recover_frame(address, source, data) == -1) {
+			return(-1);
+		}
+
+		// Put into the cache, under the frame (not the mirror)
+		put_cart_cache(address.cartridge, address.frame, data);
+	}
+
+	// A write of the frame folds its old contents into the parity
+	if (parity_enabled) {
+		hint_address = address;
+		memcpy(hint_data, data, CART_FRAME_SIZE);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: load_frames
+// Description	: Read consecutive frames of a file into one buffer. Holes and
+//		  cached frames are copied at once; the rest are read a
+//		  cartridge at a time (the loaded cartridge first), so each
+//		  cartridge is loaded once however the frames are laid out.
+//		  With several drives each drive reads its own cartridges in
+//		  a thread of its own, all of them at the same time. Mirrored
+//		  frames are read from whichever copy choose_sources picks;
+//		  frames of a failed cartridge go through degraded_read. Every
+//		  frame read is checked against its checksum.
+//
+// Input	: file - the file
+//		  first - the first frame (index into its address list)
+//		  count - the number of frames
+//		  data - the buffer, count * CART_FRAME_SIZE bytes
+// Output	: 0 if successful, -1 if failure
+
+int load_frames(FileAllocationTable *file, int first, int count, char *data) {
+
+	FrameRead *reads = malloc(count * sizeof(FrameRead));
+	DriveReadJob jobs[CART_MAX_DRIVES];
+	pthread_t threads[CART_MAX_DRIVES];
+	int started[CART_MAX_DRIVES];
+	int num_of_reads = 0, drives = 0, ret = 0, i;
+	void *cached;
+
+	//Holes and cached frames need no bus
+	for (i = 0; i < count; i++) {
+		FileAddress address = file->file_address[first + i];
+		if (address.cartridge == CART_HOLE) {
+			memset(data + (size_t)i * CART_FRAME_SIZE, 0x0, CART_FRAME_SIZE);
+			driver_stats.zero_reads += 1;
+		} else if ((cached = get_cart_cache(address.cartridge, address.frame)) != NULL) {
+			memcpy(data + (size_t)i * CART_FRAME_SIZE, cached, CART_FRAME_SIZE);
+		} else if (cart_failed[address.cartridge]) {
+			if (degraded_read(address, data + (size_t)i * CART_FRAME_SIZE) == -1) {
+				free(reads);
+				return(-1);
+			}
+			put_cart_cache(address.cartridge, address.frame, data + (size_t)i * CART_FRAME_SIZE);
+		} else {
+			reads[num_of_reads].address = address;
+			reads[num_of_reads].source = address;
+			reads[num_of_reads].index = i;
+			num_of_reads += 1;
+		}
+	}
+
+	//Pick the copy of each mirrored frame to read
+	if (mirror_enabled) {
+		choose_sources(reads, num_of_reads);
+	}
+	for (i = 0; i < num_of_reads; i++) {
+		FileAddress source = reads[i].source;
+		reads[i].key = (source.cartridge % cart_network_drives) * (CART_MAX_CARTRIDGES + 1) +
+			((source.cartridge == current_cart) ? 0 : source.cartridge + 1);
+	}
+
+	//Group them by drive and cartridge
+	qsort(reads, num_of_reads, sizeof(FrameRead), compare_frame_reads);
+	for (i = 0; i < num_of_reads; i++) {
+		if (i == 0 || reads[i].source.cartridge % cart_network_drives != jobs[drives - 1].drive) {
+			jobs[drives].drive = reads[i].source.cartridge % cart_network_drives;
+			jobs[drives].reads = &reads[i];
+			jobs[drives].num_of_reads = 0;
+			jobs[drives].data = data;
+			jobs[drives].result = 0;
+			drives += 1;
+		}
+		jobs[drives - 1].num_of_reads += 1;
+	}
+
+	if (drives == 1) {
+		//One drive, through the loaded cartridge
+		for (i = 0; i < num_of_reads && ret == 0; i++) {
+			if (load_cart(reads[i].source.cartridge) == -1 ||
+				extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME, 0, 0, reads[i].source.frame),
+					data + (size_t)reads[i].index * CART_FRAME_SIZE)) == 1) {
+				logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
+				ret = -1;
+			}
+		}
+	} else if (drives > 1) {
+		//All the drives at once
+		for (i = 0; i < drives; i++) {
+			started[i] = (pthread_create(&threads[i], NULL, drive_read_frames, &jobs[i]) == 0);
+			if (!started[i]) {
+				drive_read_frames(&jobs[i]);
+			}
+		}
+		for (i = 0; i < drives; i++) {
+			if (started[i]) {
+				pthread_join(threads[i], NULL);
+			}
+			if (jobs[i].result == -1) {
+				ret = -1;
+			}
+		}
+
+		//The drives loaded other cartridges meanwhile
+		current_cart = -1;
+	}
+
+	// Check them, taking another copy of any that is corrupt
+	for (i = 0; i < num_of_reads && ret == 0; i++) {
+		char *frame = data + (size_t)reads[i].index * CART_FRAME_SIZE;
+		if (verify_frame(reads[i].source, frame) == -1) {
+			ret = recover_frame(reads[i].address, reads[i].source, frame);
+		}
+	}
+
+	// Put into the cache
+	if (ret == 0) {
+		for (i = 0; i < num_of_reads; i++) {
+			put_cart_cache(reads[i].address.cartridge, reads[i].address.frame, data + (size_t)reads[i].index * CART_FRAME_SIZE);
+		}
+	}
+
+	free(reads);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: choose_sources
+// Description	: Pick the copy each frame of a request is read from: the
+//		  one on the loaded cartridge, else the one whose cartridge
+//		  more frames of the request could come from (fewer loads),
+//		  else the one on the drive with less to do so far.
+//
+// Input	: reads - the reads, sources set to the frames
+//		  num_of_reads - the number of reads
+// Output	: none
+
+void choose_sources(FrameRead *reads, int num_of_reads) {
+
+	int wanted[CART_MAX_CARTRIDGES] = { 0 }, busy[CART_MAX_DRIVES] = { 0 };
+	FileAddress mirror;
+	int i, p, m;
+
+	for (i = 0; i < num_of_reads; i++) {
+		wanted[reads[i].address.cartridge] += 1;
+		if ((mirror = readable_mirror(reads[i].address)).frame != -1) {
+			wanted[mirror.cartridge] += 1;
+		}
+	}
+
+	for (i = 0; i < num_of_reads; i++) {
+		p = reads[i].address.cartridge;
+		mirror = readable_mirror(reads[i].address);
+		m = mirror.cartridge;
+		if (mirror.frame != -1 && p != current_cart &&
+			(m == current_cart || wanted[m] > wanted[p] ||
+			(wanted[m] == wanted[p] && busy[m % cart_network_drives] < busy[p % cart_network_drives]))) {
+			reads[i].source = mirror;
+			driver_stats.mirror_reads += 1;
+		}
+		busy[reads[i].source.cartridge % cart_network_drives] += 1;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: compare_frame_reads
+// Description	: Order frame reads by drive, then cartridge, then their place
+//		  in the request
+//
+// Input	: a, b - the reads
+// Output	: <0, 0 or >0 as a goes before, with or after b
+
+int compare_frame_reads(const void *a, const void *b) {
+
+	const FrameRead *x = a, *y = b;
+
+	if (x->key != y->key) {
+		return x->key - y->key;
+	}
+	return x->index - y->index;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: drive_read_frames
+// Description	: Read one drive's share of a request, loading each of its
+//		  cartridges once. Only the drive's own connection is used,
+//		  so the drives run in parallel.
+//
+// Input	: arg - the DriveReadJob
+// Output	: NULL (the job's result is 0 if successful, -1 if failure)
+
+void *drive_read_frames(void *arg) {
+
+	DriveReadJob *job = arg;
+	int loaded = -1;
+
+	for (int i = 0; i < job->num_of_reads; i++) {
+		FrameRead *read = &job->reads[i];
+		if (read->source.cartridge != loaded) {
+			if (extract_cart_opcode(client_drive_request(job->drive, creat_cart_opcode(CART_OP_LDCART, 0, read->source.cartridge, 0), NULL)) == 1) {
+				logMessage(LOG_ERROR_LEVEL, "Cart %d Load op fail\n\n", read->source.cartridge);
+				job->result = -1;
+				return NULL;
+			}
+			loaded = read->source.cartridge;
+		}
+		if (extract_cart_opcode(client_drive_request(job->drive, creat_cart_opcode(CART_OP_RDFRME, 0, 0, read->source.frame),
+			job->data + (size_t)read->index * CART_FRAME_SIZE)) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
+			job->result = -1;
+			return NULL;
+		}
+	}
+
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: store_frame
+// Description	: Write a frame of a file. A frame of zeros becomes a hole and
+//		  gives up its frame; a hole gets a frame when something else
+//		  is written to it. With deduplication on, contents another
+//		  frame already holds are shared instead of written, and a
+//		  shared frame is copied before it is changed. A frame of a
+//		  failed cartridge moves to a new frame.
+//
+// Input	: file - the file
+//		  index - the frame of the file (index into its address list)
+//		  data - the new contents of the frame
+// Output	: 0 if successful, -1 if failure
+
+int store_frame(FileAllocationTable *file, int index, void *data) {
+
+	FileAddress *address = &file->file_address[index];
+	FileAddress shared;
+	unsigned char fingerprint[DEDUP_FINGERPRINT_SIZE];
+
+	// Zeros need no frame
+	if (memcmp(data, zero_frame, CART_FRAME_SIZE) == 0) {
+		if (address->cartridge != CART_HOLE) {
+			release_frame(*address);
+			address->cartridge = CART_HOLE;
+			address->frame = CART_HOLE;
+		}
+		driver_stats.zero_writes += 1;
+		return 0;
+	}
+
+	if (dedup_enabled) {
+		gcry_md_hash_buffer(GCRY_MD_SHA1, fingerprint, data, CART_FRAME_SIZE);
+
+		// Share a frame with these contents (maybe this one, unchanged)
+		shared = dedup_lookup(fingerprint);
+		if (shared.frame != -1 && frame_status[shared.cartridge][shared.frame] < UINT16_MAX) {
+			if (shared.cartridge != address->cartridge || shared.frame != address->frame) {
+				frame_status[shared.cartridge][shared.frame] += 1;
+				if (address->cartridge != CART_HOLE) {
+					release_frame(*address);
+				}
+				*address = shared;
+			}
+			driver_stats.dedup_writes += 1;
+			return 0;
+		}
+
+		if (address->cartridge != CART_HOLE && frame_status[address->cartridge][address->frame] > 1) {
+			// Copy on write, the other users keep the old contents
+			shared = generate_memory_address(file);
+			if (shared.frame == -1) {
+				return(-1);
+			}
+			if (mirror_enabled) {
+				attach_mirror(shared);
+			}
+			release_frame(*address);
+			*address = shared;
+			driver_stats.dedup_copies += 1;
+		} else if (address->cartridge != CART_HOLE) {
+			// The old contents are about to go
+			dedup_remove(*address);
+		}
+	}
+
+	// Nothing is written to a failed cartridge
+	if (address->cartridge != CART_HOLE && cart_failed[address->cartridge]) {
+		release_frame(*address);
+		address->cartridge = CART_HOLE;
+		address->frame = CART_HOLE;
+	}
+
+	// A hole gets its frame now
+	if (address->cartridge == CART_HOLE) {
+		shared = generate_memory_address(file);
+		if (shared.frame == -1) {
+			return(-1);
+		}
+		if (mirror_enabled) {
+			attach_mirror(shared);
+		}
+		*address = shared;
+	}
+
+	//load cart
+	if (load_cart(address->cartridge) == -1) {
+		return(-1);
+	}
+
+	//write to frame
+	if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME,0, 0, address->frame), data)) == 1) {
+		logMessage(LOG_ERROR_LEVEL, "Cart write fail\n\n");
+		return(-1);
+	}
+
+	// The parity follows at the end of the operation (the cache still
+	// has the old contents it needs)
+	if (parity_enabled && queue_parity_write(*address, data) == -1) {
+		return(-1);
+	}
+	note_frame_written(*address, data);
+
+	//put to the cache
+	put_cart_cache(address->cartridge, address->frame, data);
+
+	if (dedup_enabled) {
+		dedup_insert(*address, fingerprint);
+	}
+
+	// The mirror follows at the end of the operation
+	if (frame_mirror[address->cartridge][address->frame] != MIRROR_NONE) {
+		return queue_mirror_write(*address, data);
+	}
+
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: grow_file_address_list
+// Description	: Grow the file_address list by a hole, which gets a frame on
+//		  its first write of anything but zeros
+//
+// Input	: file - The pointer to the file contains the address list that need to grow
+// Output	: 0 if successful
+
+int grow_file_address_list(FileAllocationTable *file) {
+	
+	//reallocate memory for new address (the list may be empty after a truncate)
+	file->file_address = realloc(file->file_address, (file->num_of_address + 1) * sizeof(FileAddress));
+	
+	//the new frame is a hole until written
+	file->file_address[file->num_of_address].cartridge = CART_HOLE;
+	file->file_address[file->num_of_address].frame = CART_HOLE;
+	
+	//increase the num_of_address
+	file->num_of_address += 1;
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: grow_file_alloc_table
+// Description	: Grow the file_alloc_table
+//
+// Input	: file_alloc_table - The table that need to grow
+// Output	: 0 if successful
+
+int grow_file_alloc_table(FileAllocationTable **file_alloc_table) {
+	
+	//reallocate memory for new file (the table may be empty after unlinks)
+	*file_alloc_table = realloc(*file_alloc_table, (num_of_file + 1) * sizeof(FileAllocationTable));
+
+	//increase the num_of_file
+	num_of_file += 1;
+	
+	return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: load_cart
+// Description	: Load cart with current cart check
+//
+// Input	: cart_num - The cart number of the cart that need to load
+// Output	: 0 if successful, -1 if failure
+
+int load_cart(int cart_num) {
+
+	if (current_cart != cart_num) {
+		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_LDCART, 0, cart_num, 0), NULL)) == 1){
+			logMessage(LOG_ERROR_LEVEL, "Cart %d Load op fail\n\n", cart_num);
+			return(-1);
+		}
+		current_cart = cart_num;
+	}
+	
+	return 0;
+
+}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: count_frames_used
+// Description	: Note the frames in use, the file frames they back and the
+//		  holes, in the driver counters
+//
+// Input	: none
+// Output	: 0 if successful
+
+int count_frames_used(void) {
+
+	driver_stats.frames_used = CART_TOTAL_FRAMES - frames_free;
+	driver_stats.file_frames = 0;
+	driver_stats.hole_frames = 0;
+	for (int i = 0; i < num_of_file; i++) {
+		for (int j = 0; j < file_alloc_table[i].num_of_address; j++) {
+			if (file_alloc_table[i].file_address[j].cartridge == CART_HOLE) {
+				driver_stats.hole_frames += 1;
+			} else {
+				driver_stats.file_frames += 1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweron
+// Description  : Startup up the CART interface, initialize filesystem
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweron(void) {
+	
+	//Check if it is on
+	if (driver_status == ON) {
+		logMessage(LOG_ERROR_LEVEL, "The driver is already ON\n\n");
+		return(-1);
+	}
+	
+	//Initialize the cart interface
+	if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_INITMS, 0, 0, 0), NULL)) == 1) {
+		return(-1);
+	}
+	
+	current_cart = -1;
+
+	//Zero all memory
+	for (int i = 0; i < CART_MAX_CARTRIDGES; i++) {
+		
+		//load cart
+		load_cart(i);
+
+		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_BZERO, 0, 0, 0), NULL)) == 1){
+				logMessage(LOG_ERROR_LEVEL, "Cart %d Zero op fail\n\n", i);
+				return(-1);
+		}
+	}
+			
+	//Initialize internal data structure
+	initialize_file_allocation_table();
+	num_of_file = 0;
+	memset(&driver_stats, 0x0, sizeof(driver_stats));
+	
+	// Initialize cache
+	init_cart_cache();
+	
+	//Set drvier status open
+	driver_status = ON;
+	
+	// Return successfully
+	return(0);
+			
+	
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_poweroff
+// Description  : Shut down the CART interface, close all files
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_poweroff(void) {
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "The driver is not open.\n\n");
+		return(-1);
+	}
+
+	//Execute shutdown opcode
+	if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_POWOFF,0,0,0), NULL)) == 1) {
+		logMessage(LOG_ERROR_LEVEL, "Cart shundown op fail\n\n");
+		return(-1);
+	}
+
+	//Close all file
+	for (int i = 0; i < num_of_file; i++) {
 		file_alloc_table[i].file_status = CLOSE;
 	}
 
-	//Clean up internal data structure
-	for (int i = 0; i < num_of_file; i++)
-		free(file_alloc_table[i].file_address);
-	free(file_alloc_table);
-	num_of_file = 0;
-	
-	// close cache
-	close_cart_cache();
+	//Keep the frame usage of the session for the counters
+	count_frames_used();
+
+	//Mirror and parity writes still queued (after a failure) go with the data
+	free(mirror_queue);
+	mirror_queue = NULL;
+	num_mirror_writes = 0;
+	max_mirror_writes = 0;
+	free(parity_queue);
+	parity_queue = NULL;
+	num_parity_writes = 0;
+	max_parity_writes = 0;
+
+	//Clean up internal data structure
+	for (int i = 0; i < num_of_file; i++)
+		free(file_alloc_table[i].file_address);
+	free(file_alloc_table);
+	file_alloc_table = NULL;
+	num_of_file = 0;
+	
+	// close cache
+	close_cart_cache();
+
+	//Set the driver status OFF
+	driver_status = OFF;
+	
+	// Return successfully
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_open
+// Description  : This function opens the file and returns a file handle
+//
+// Inputs       : path - filename of the file to open
+// Outputs      : file handle if successful, -1 if failure
+
+int16_t cart_open(char *path) {
+
+	CART_LATENCY_START(op_start);
+	last_file_op = driver_now();		//Keeps the defragmenter off
+	
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		//Log error message
+		logMessage(LOG_ERROR_LEVEL, "File open fail: The driver is OFF.\n\n");
+		//Return failure
+		return(-1);
+	}
+	
+	//Check if the file exist
+	for (int i = 0; i < num_of_file; i++) {
+		if (strcmp(path, file_alloc_table[i].name) == 0) {
+			//Check if the file already open
+			if (file_alloc_table[i].file_status == OPEN) {
+				//Log error message
+				logMessage(LOG_ERROR_LEVEL, "File is already opened");
+				//Return failure
+				return(-1);
+			} else {
+				//Set the file status to open
+				file_alloc_table[i].file_status = OPEN;
+				//Set position to 0
+				file_alloc_table[i].position = 0;
+				//Return descriptor
+				CART_LATENCY_RECORD(CART_LAT_OPEN, op_start);
+				return (file_alloc_table[i].descriptor);
+			}
+		}
+	}
+	
+	//Creat a file
+	grow_file_alloc_table(&file_alloc_table);
+	int descriptor = generate_descriptor();
+	strcpy(file_alloc_table[num_of_file - 1].name, path);			//Set file name
+	file_alloc_table[num_of_file - 1].descriptor = descriptor;		//Assign descriptor
+	file_alloc_table[num_of_file - 1].length = 0;				//Set length to zero
+	file_alloc_table[num_of_file - 1].position = 0;				//Set position to zero
+	file_alloc_table[num_of_file - 1].file_status = OPEN;			//Set file_status to open
+	file_alloc_table[num_of_file - 1].num_of_address = 0;			//Set num_of_address to zero
+	file_alloc_table[num_of_file - 1].file_address = NULL;			//No address list yet
+	file_alloc_table[num_of_file - 1].home = -1;				//No home cartridge yet
+	file_alloc_table[num_of_file - 1].run_left = 0;				//No frames reserved
+	file_alloc_table[num_of_file - 1].advice = CART_ADVICE_NORMAL;		//No advice yet
+	file_alloc_table[num_of_file - 1].stripe_width = 0;			//Not striped
+	
+	grow_file_address_list(&file_alloc_table[num_of_file -1]);
+	//Return the file descriptor
+	CART_LATENCY_RECORD(CART_LAT_OPEN, op_start);
+	return (descriptor);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_close
+// Description  : This function closes the file
+//
+// Inputs       : fd - the file descriptor
+// Outputs      : 0 if successful, -1 if failure
+
+int16_t cart_close(int16_t fd) {
+
+	CART_LATENCY_START(op_start);
+	last_file_op = driver_now();		//Keeps the defragmenter off
+	
+	int file_index = - 1;
+	
+	//Find the file index by the file descriptor
+	for (int i = 0; i < num_of_file; i++) {
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}
+	
+	//Check if the descriptor matching or if the file_index is found
+	if (file_index == -1) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart_close fail: The descriptor is invalid\n\n");
+		//Return failure
+		return(-1);
+	}
+	
+	//Check if the file is open
+	if (file_alloc_table[file_index].file_status == CLOSE) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart_close fail: The file is not open\n\n");
+		//Return failure
+		return(-1);
+	}
+
+	//Set the file status to CLOSE
+	file_alloc_table[file_index].file_status = CLOSE;
+	
+	// Return successfully
+	CART_LATENCY_RECORD(CART_LAT_CLOSE, op_start);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_read
+// Description  : Reads "count" bytes from the file handle "fh" into the 
+//                buffer "buf"
+//
+// Inputs       : fd - filename of the file to read from
+//                buf - pointer to buffer to read into
+//                count - number of bytes to read
+// Outputs      : bytes read if successful, -1 if failure
+
+int32_t cart_read(int16_t fd, void *buf, int32_t count) {
+
+	CART_LATENCY_START(op_start);
+	last_file_op = driver_now();		//Keeps the defragmenter off
+
+	int file_index = -1;
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}	
+	
+	//Check if the desciptor valid or is the file_index is found
+	if (file_index == -1) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
+		//Return failure
+		return(-1);
+	}
+
+	//Check if the file open
+	if (file_alloc_table[file_index].file_status == CLOSE) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
+		//Return failure
+		return (-1);
+	}
+
+	
+	//Check if the count greater than the number of bytes left in the file
+	if (count > (file_alloc_table[file_index].length - file_alloc_table[file_index].position)) {
+		//Set the count to the num fo bytes left in the file
+		count = file_alloc_table[file_index].length - file_alloc_table[file_index].position;
+	}
+
+	//Nothing to read at (or seeked past) the end of the file
+	if (count <= 0) {
+		CART_LATENCY_RECORD(CART_LAT_READ, op_start);
+		return (0);
+	}
+	
+	//Copy from memory to the buffer
+	int offset = calculate_position_offset(file_alloc_table[file_index].position);
+	int address_index = calculate_address_index(file_alloc_table[file_index].position);
+	void *temp;		//temp buffer to store the whole frame bytes
+	temp = calloc(1024, sizeof(char));		//allocate memory for temp buffer
+
+	//Check if read in only one frame
+	if (count <= CART_FRAME_SIZE - offset) {
+
+		//read frame
+		if (load_frame(&file_alloc_table[file_index], address_index, temp) == -1) {
+			free(temp);
+			return(-1);
+		}
+
+		//copy count number of bytes to buffer
+		memcpy(buf, (char *)temp + offset, count);
+		
+
+	} else {	//read cross frames
+		int num_of_frame = (offset + count + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;	//number of frame that read from
+		char *frames = malloc((size_t)num_of_frame * CART_FRAME_SIZE);		//the frames, read together
+
+		//read the frames, a cartridge (and drive) at a time
+		if (load_frames(&file_alloc_table[file_index], address_index, num_of_frame, frames) == -1) {
+			free(frames);
+			free(temp);
+			return(-1);
+		}
+
+		//copy the bytes asked for
+		memcpy(buf, frames + offset, count);
+		free(frames);
+
+	}
+
+	//increase the position
+	file_alloc_table[file_index].position += count;
+
+	//deallocate
+	free(temp);
+
+	// Return successfully
+	CART_LATENCY_RECORD(CART_LAT_READ, op_start);
+	return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_write
+// Description  : Writes "count" bytes to the file handle "fh" from the 
+//                buffer  "buf"
+//
+// Inputs       : fd - filename of the file to write to
+//                buf - pointer to buffer to write from
+//                count - number of bytes to write
+// Outputs      : bytes written if successful, -1 if failure
+
+int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+
+	CART_LATENCY_START(op_start);
+	last_file_op = driver_now();		//Keeps the defragmenter off
+
+	int file_index = -1;		//Default file index to invalid number -1
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}	
+	
+	//Check if the desciptor valid
+	if (file_index == -1) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
+		//Return failure
+		return(-1);
+	}
+
+	//Check if the file open
+	if (file_alloc_table[file_index].file_status == CLOSE) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
+		//Return failure
+		return (-1);
+	}
+
+	int offset = calculate_position_offset(file_alloc_table[file_index].position);
+	int address_index = calculate_address_index(file_alloc_table[file_index].position);
+	void *temp;		//temp buffer to process the whole frame bytes
+	int length_increament;		//the increament of length of size
+	temp = calloc(1024, sizeof(char));		//allocate memory to temp pointer
+
+	//check if write beyond the file length
+	if (file_alloc_table[file_index].position + count > file_alloc_table[file_index].length) {
+		
+		length_increament = file_alloc_table[file_index].position + count - file_alloc_table[file_index].length;
+
+	} else {
+	
+		length_increament = 0;
+	}
+
+	//Extend the address list (with holes) to the position, which may be
+	//past the end of the file after a seek
+	while (address_index >= file_alloc_table[file_index].num_of_address) {
+		grow_file_address_list(&file_alloc_table[file_index]);
+	}
+
+	//Check if it write in only one frame
+	if (count <= CART_FRAME_SIZE - offset) {
+		
+		//read frame
+		if (load_frame(&file_alloc_table[file_index], address_index, temp) == -1) {
+			free(temp);
+			return(-1);
+		}
+
+		//copy memory from the buffer
+		memcpy((char *)temp + offset, (char *)buf, count);
+
+		//write the frame back
+		if (store_frame(&file_alloc_table[file_index], address_index, temp) == -1) {
+			free(temp);
+			return(-1);
+		}
+
+
+	} else {	//if write cross the frame
+		
+		int count_first_frame = CART_FRAME_SIZE - offset;			//number of bytes write to the first frame
+		int num_of_frame = (count - count_first_frame + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE + 1;	//number of frame that write to
+		int count_last_frame = count - count_first_frame - (num_of_frame - 2) * CART_FRAME_SIZE;	//number of bytes write to the last frame
+		int num_of_byte_written = 0;
+
+		for (int i = 0; i < num_of_frame; i++) {
+
+			//check if new memory needed
+			if (address_index + i == file_alloc_table[file_index].num_of_address - 1) {
+				//allocate new address
+				grow_file_address_list(&file_alloc_table[file_index]);
+			}
+
+			//read frame
+			if (load_frame(&file_alloc_table[file_index], address_index + i, temp) == -1) {
+				free(temp);
+				return(-1);
+			}
+			//Check if it is first frame
+			if (i == 0) {
+		
+				//copy memory from the buffer
+				memcpy((char *)temp + offset, (char *)buf + num_of_byte_written, count_first_frame);
+				num_of_byte_written += count_first_frame;
+
+			} else if (i == num_of_frame - 1) {		//if it is last frame
+				
+				//copy memory from the buffer
+				memcpy((char *)temp, (char *)buf + num_of_byte_written, count_last_frame);
+				num_of_byte_written += count_last_frame;
+
+			} else {		//if it is middle frame
+	
+				//copy memory from the buffer
+				memcpy((char *)temp, (char *)buf + num_of_byte_written, CART_FRAME_SIZE);
+				num_of_byte_written += CART_FRAME_SIZE;
+			}
+
+			//write the frame back
+			if (store_frame(&file_alloc_table[file_index], address_index + i, temp) == -1) {
+				free(temp);
+				return(-1);
+			}
+			
+		
+		}
+
+	}
+
+	//increase the position
+	file_alloc_table[file_index].position += count;
+
+	//increase the length of file
+	file_alloc_table[file_index].length += length_increament;
+
+	//deallocate
+	free(temp);
+
+	//write the mirrors and parity, a cartridge at a time
+	if (flush_mirrors() == -1 || flush_parity() == -1) {
+		return(-1);
+	}
+
+	// Return successfully
+	CART_LATENCY_RECORD(CART_LAT_WRITE, op_start);
+	return (count);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_seek
+// Description  : Seek to specific point in the file
+//
+// Inputs       : fd - filename of the file to write to
+//                loc - offfset of file in relation to beginning of file
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_seek(int16_t fd, uint32_t loc) {
+
+	CART_LATENCY_START(op_start);
+	last_file_op = driver_now();		//Keeps the defragmenter off
+
+	int file_index = -1;
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}	
+	
+	//Check if the desciptor valid or is the file_index is found
+	if (file_index == -1) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
+		//Return failure
+		return(-1);
+	}
+
+	//Check if the file open
+	if (file_alloc_table[file_index].file_status == CLOSE) {
+		//Log message
+		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
+		//Return failure
+		return (-1);
+	}
+
+	//Seeking past the end is allowed, a write there leaves a hole
+	file_alloc_table[file_index].position = loc;
+
+	// Return successfully
+	CART_LATENCY_RECORD(CART_LAT_SEEK, op_start);
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_unlink
+// Description  : Delete a (closed) file, returning its frames to the
+//                allocator
+//
+// Inputs       : path - filename of the file to delete
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_unlink(char *path) {
+
+	int file_index = -1;
+
+	last_file_op = driver_now();		//Keeps the defragmenter off
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_unlink fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+
+	//Find the file by name
+	for (int i = 0; i < num_of_file; i++) {
+		if (strcmp(path, file_alloc_table[i].name) == 0) {
+			file_index = i;
+			break;
+		}
+	}
+
+	if (file_index == -1) {
+		logMessage(LOG_ERROR_LEVEL, "cart_unlink fail: no file [%s].\n\n", path);
+		return(-1);
+	}
+
+	if (file_alloc_table[file_index].file_status == OPEN) {
+		logMessage(LOG_ERROR_LEVEL, "cart_unlink fail: [%s] is open.\n\n", path);
+		return(-1);
+	}
+
+	//Free the frames (and their cached copies)
+	for (int i = 0; i < file_alloc_table[file_index].num_of_address; i++) {
+		if (file_alloc_table[file_index].file_address[i].cartridge != CART_HOLE) {
+			release_frame(file_alloc_table[file_index].file_address[i]);
+		}
+	}
+	free(file_alloc_table[file_index].file_address);
+
+	//Give back its reserved frames and its home
+	drop_run(&file_alloc_table[file_index]);
+	if (file_alloc_table[file_index].home != -1) {
+		cart_homes[file_alloc_table[file_index].home] -= 1;
+	}
+
+	//Fill the slot with the last file, descriptors are looked up by value
+	file_alloc_table[file_index] = file_alloc_table[num_of_file - 1];
+	num_of_file -= 1;
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_truncate
+// Description  : Cut a file to (or extend it with zeros to) a length. The
+//                frames past the new end go back to the allocator and the
+//                rest of the last frame is zeroed, so growing the file again
+//                reads zeros. The position is left alone.
+//
+// Inputs       : fd - the file descriptor
+//                length - the new length
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_truncate(int16_t fd, uint32_t length) {
+
+	int file_index = -1;
+	FileAllocationTable *file;
+	int frames = (length + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;	//frames the new length needs
+	int tail = calculate_position_offset(length);		//bytes of the last frame kept
+	char temp[CART_FRAME_SIZE];
+
+	last_file_op = driver_now();		//Keeps the defragmenter off
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_truncate fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+
+	//Check if the desciptor valid
+	if (file_index == -1) {
+		logMessage(LOG_ERROR_LEVEL, "cart_truncate fail: The descriptor is invalid.\n\n ");
+		return(-1);
+	}
+
+	//Check if the file open
+	if (file_alloc_table[file_index].file_status == CLOSE) {
+		logMessage(LOG_ERROR_LEVEL, "cart_truncate fail: The file is not open.\n\n");
+		return (-1);
+	}
+
+	file = &file_alloc_table[file_index];
+
+	if (length < file->length) {
+
+		//Zero the rest of the last frame kept
+		if (tail != 0 && frames <= file->num_of_address) {
+			if (load_frame(file, frames - 1, temp) == -1) {
+				return(-1);
+			}
+			memset(temp + tail, 0x0, CART_FRAME_SIZE - tail);
+			if (store_frame(file, frames - 1, temp) == -1) {
+				return(-1);
+			}
+		}
+
+		//Free the frames past the end
+		while (file->num_of_address > frames) {
+			if (file->file_address[file->num_of_address - 1].cartridge != CART_HOLE) {
+				release_frame(file->file_address[file->num_of_address - 1]);
+			}
+			file->num_of_address -= 1;
+		}
+	} else {
+
+		//Extend with holes
+		while (file->num_of_address < frames) {
+			grow_file_address_list(file);
+		}
+	}
+
+	file->length = length;
+
+	//write the mirror and parity of the last frame
+	if (flush_mirrors() == -1 || flush_parity() == -1) {
+		return(-1);
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_fadvise
+// Description  : Say how a file is used, so its new frames are placed to
+//                suit. SEQUENTIAL files are striped over "width" cartridges
+//                (the ones with the most free frames) in pieces of
+//                STRIPE_UNIT frames, so a stream spreads evenly over them.
+//                RANDOM files keep to a home cartridge like
+//                CARTALLOC_AFFINITY. NORMAL files follow the driver's
+//                allocation strategy. Frames already written stay
+//                where they are, and any reservation is given back.
+//
+// Inputs       : fd - the file descriptor
+//                advice - how the file is used
+//                width - cartridges to stripe over (SEQUENTIAL only)
+// Outputs      : 0 if successful, -1 if failure
+
+int32_t cart_fadvise(int16_t fd, CartAdvice advice, uint32_t width) {
+
+	int file_index = -1;
+	FileAllocationTable *file;
+	int best, best_free, free_frames, member;
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fadvise fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}
+
+	//Check if the desciptor valid
+	if (file_index == -1 || file_alloc_table[file_index].file_status != OPEN) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fadvise fail: The descriptor is invalid.\n\n ");
+		return(-1);
+	}
+
+	if (advice == CART_ADVICE_SEQUENTIAL && (width == 0 || width > CART_MAX_CARTRIDGES)) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fadvise fail: Bad stripe width %u.\n\n", width);
+		return(-1);
+	}
+
+	file = &file_alloc_table[file_index];
+	drop_run(file);
+	file->advice = advice;
+	file->stripe_width = 0;
+	file->stripe_next = 0;
+	file->stripe_used = 0;
+
+	//Choose the stripe members, the emptiest cartridges
+	if (advice == CART_ADVICE_SEQUENTIAL) {
+		while (file->stripe_width < (int)width) {
+			best = -1;
+			best_free = -1;
+			for (int cart = 0; cart < CART_MAX_CARTRIDGES; cart++) {
+				for (member = 0; member < file->stripe_width && file->stripe[member] != cart; member++);
+				if (member < file->stripe_width) continue;
+				free_frames = count_unowned(cart);
+				if (free_frames > best_free) {
+					best = cart;
+					best_free = free_frames;
+				}
+			}
+			file->stripe[file->stripe_width] = best;
+			file->stripe_width += 1;
+		}
+	}
+
+	return (0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_fallocate
+// Description  : Reserve frames for a file to grow to a length, so they are
+//                not handed to other files meanwhile. The frames stay free
+//                (and the length unchanged) until the file writes them: on
+//                its stripe members for a SEQUENTIAL file, else as a run on
+//                a home cartridge with room for them all if there is one.
+//                Reservations are a hint, a full disk hands them out.
+//
+// Inputs       : fd - the file descriptor
+//                length - the length to reserve frames for
+// Outputs      : frames reserved if successful, -1 if failure
+
+int32_t cart_fallocate(int16_t fd, uint32_t length) {
+
+	int file_index = -1;
+	FileAllocationTable *file;
+	int frames = (length + CART_FRAME_SIZE - 1) / CART_FRAME_SIZE;	//frames the length needs
+	int needed = 0, reserved = 0, each, frame;
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fallocate fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+
+	//Find the index by the descriptor
+	for (int i = 0; i < num_of_file; i++){
+		if (fd == file_alloc_table[i].descriptor) {
+			file_index = i;
+			break;
+		}
+	}
+
+	//Check if the desciptor valid
+	if (file_index == -1 || file_alloc_table[file_index].file_status != OPEN) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fallocate fail: The descriptor is invalid.\n\n ");
+		return(-1);
+	}
+
+	file = &file_alloc_table[file_index];
+
+	//Frames of the length with no frame behind them yet
+	for (int i = 0; i < frames; i++) {
+		if (i >= file->num_of_address || file->file_address[i].cartridge == CART_HOLE) needed += 1;
+	}
+
+	if (file->advice == CART_ADVICE_SEQUENTIAL) {
+		//An even share on each stripe member
+		drop_run(file);
+		each = (needed + file->stripe_width - 1) / file->stripe_width;
+		for (int i = 0; i < file->stripe_width; i++) {
+			int taken = 0;
+			for (frame = 0; frame < CART_CARTRIDGE_SIZE && taken < each && reserved < needed; frame++) {
+				if (frame_status[file->stripe[i]][frame] == 0 && frame_owner[file->stripe[i]][frame] == 0) {
+					frame_owner[file->stripe[i]][frame] = file->descriptor;
+					taken += 1;
+					reserved += 1;
+				}
+			}
+		}
+	} else if (needed > 0) {
+		reserved = reserve_run(file, needed);
+	}
+
+	return (reserved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: switch_frame
+// Description	: Point a file frame at a new frame already holding its
+//		  contents, freeing the old frame. The contents keep their
+//		  place in the fingerprint index, and their mirror (or get a
+//		  new one, queued for flush_mirrors).
+//
+// Input	: file - the file
+//		  index - the frame of the file (index into its address list)
+//		  to - the new frame (taken already)
+//		  data - the contents of the frame
+// Output	: 0 if successful
+
+int switch_frame(FileAllocationTable *file, int index, FileAddress to, void *data) {
+
+	FileAddress from = file->file_address[index];
+	unsigned char fingerprint[DEDUP_FINGERPRINT_SIZE];
+	int indexed = frame_indexed[from.cartridge][from.frame];
+	int32_t mirror = frame_mirror[from.cartridge][from.frame];
+
+	memcpy(fingerprint, frame_fingerprint[from.cartridge][from.frame], DEDUP_FINGERPRINT_SIZE);
+
+	//The mirror stays where it is, unless the frame moves onto its cartridge
+	if (mirror != MIRROR_NONE && !mirror_stale[from.cartridge][from.frame] &&
+		mirror / CART_CARTRIDGE_SIZE != to.cartridge) {
+		frame_mirror[to.cartridge][to.frame] = mirror;
+		frame_mirror[from.cartridge][from.frame] = MIRROR_NONE;
+		frame_primary[mirror / CART_CARTRIDGE_SIZE][mirror % CART_CARTRIDGE_SIZE] = FRAME_ID(to);
+	}
+	release_frame(from);
+	if (mirror_enabled && frame_mirror[to.cartridge][to.frame] == MIRROR_NONE && attach_mirror(to) == 0) {
+		queue_mirror_write(to, data);
+	}
+	if (indexed) {
+		dedup_insert(to, fingerprint);
+	}
+	put_cart_cache(to.cartridge, to.frame, data);
+
+	file->file_address[index] = to;
+	driver_stats.frames_moved += 1;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: file_fragmentation
+// Description	: Count the runs of a file's frames on one cartridge, and the
+//		  fewest runs its frames could take. Holes need no frame and
+//		  shared frames stay where their other users expect, so
+//		  neither counts.
+//
+// Input	: file - the file
+//		  runs - set to the runs now
+// Output	: the fewest runs possible
+
+int file_fragmentation(FileAllocationTable *file, int *runs) {
+
+	int frames = 0, last = -1;
+
+	*runs = 0;
+	for (int i = 0; i < file->num_of_address; i++) {
+		FileAddress a = file->file_address[i];
+		if (a.cartridge == CART_HOLE || frame_status[a.cartridge][a.frame] > 1) continue;
+		if (a.cartridge != last) *runs += 1;
+		last = a.cartridge;
+		frames += 1;
+	}
+
+	return (frames + CART_CARTRIDGE_SIZE - 1) / CART_CARTRIDGE_SIZE;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: compact_file
+// Description	: Gather a file onto as few cartridges as possible, in file
+//		  order, so reading it through loads each cartridge once.
+//		  Each step picks the cartridge with the most room (free
+//		  frames plus the file's own), keeps the file's frames already
+//		  there and moves the following frames into its free frames,
+//		  reading them one source cartridge at a time. The file only
+//		  switches to the new frames once they are all written, so a
+//		  failed step leaves it as it was.
+//
+// Input	: file - the file
+//		  budget - the most frames to move
+// Output	: frames moved, -1 if failure
+
+int compact_file(FileAllocationTable *file, int budget) {
+
+	int moved = 0, next = 0, runs, fewest, cart, room, best, best_room, start, slot, rest;
+	int free_count[CART_MAX_CARTRIDGES], mine[CART_MAX_CARTRIDGES];
+	int *moves;		//file frames to move to the chosen cartridge
+	FileAddress *targets;	//the frames they move to
+	int num_moves;
+	char *data;		//their contents
+
+	//Nothing to gain if it already takes the fewest runs
+	fewest = file_fragmentation(file, &runs);
+	if (fewest >= runs) {
+		return 0;
+	}
+
+	moves = malloc(file->num_of_address * sizeof(int));
+	targets = malloc(file->num_of_address * sizeof(FileAddress));
+	data = malloc((size_t)file->num_of_address * CART_FRAME_SIZE);
+
+	while (next < file->num_of_address && moved < budget) {
+
+		//Room on each cartridge for the rest of the file
+		memset(mine, 0x0, sizeof(mine));
+		rest = 0;
+		for (int i = next; i < file->num_of_address; i++) {
+			FileAddress a = file->file_address[i];
+			if (a.cartridge != CART_HOLE && frame_status[a.cartridge][a.frame] == 1) {
+				mine[a.cartridge] += 1;
+				rest += 1;
+			}
+		}
+
+		//Of the cartridges the rest fits on, the one holding most of it
+		//already (so steps keep filling the same one), else the roomiest
+		best = 0;
+		best_room = -1;
+		for (cart = 0; cart < CART_MAX_CARTRIDGES; cart++) {
+			if (cart_failed[cart]) continue;
+			free_count[cart] = 0;
+			for (int f = 0; f < CART_CARTRIDGE_SIZE; f++) {
+				if (frame_status[cart][f] == 0) free_count[cart] += 1;
+			}
+			room = free_count[cart] + mine[cart];
+			if (best_room == -1 ||
+				(room >= rest && (best_room < rest || mine[cart] > mine[best])) ||
+				(room < rest && best_room < rest && room > best_room)) {
+				best = cart;
+				best_room = room;
+			}
+		}
+
+		//Take the following frames while the cartridge has room
+		room = free_count[best];
+		num_moves = 0;
+		start = next;
+		while (next < file->num_of_address) {
+			FileAddress a = file->file_address[next];
+			if (a.cartridge != CART_HOLE && a.cartridge != best && frame_status[a.cartridge][a.frame] == 1) {
+				if (room == 0 || moved + num_moves == budget) break;
+				moves[num_moves++] = next;
+				room -= 1;
+			}
+			next += 1;
+		}
+
+		//No room anywhere, leave the rest
+		if (next == start) break;
+
+		//Read them, one source cartridge at a time
+		for (cart = 0; cart < CART_MAX_CARTRIDGES; cart++) {
+			for (int i = 0; i < num_moves; i++) {
+				if (file->file_address[moves[i]].cartridge == cart &&
+					load_frame(file, moves[i], data + (size_t)i * CART_FRAME_SIZE) == -1) {
+					moved = -1;
+					goto done;
+				}
+			}
+		}
+
+		//Take free frames in order and write them
+		slot = 0;
+		for (int i = 0; i < num_moves; i++) {
+			while (frame_status[best][slot] != 0) slot++;
+			targets[i].cartridge = best;
+			targets[i].frame = slot;
+			frame_status[best][slot] = 1;
+			frames_free -= 1;
+		}
+		for (int i = 0; i < num_moves; i++) {
+			if ((i == 0 && load_cart(best) == -1) ||
+				extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME,0, 0, targets[i].frame), data + (size_t)i * CART_FRAME_SIZE)) == 1) {
+				logMessage(LOG_ERROR_LEVEL, "Cart compaction write fail\n\n");
+				for (int j = 0; j < num_moves; j++) {
+					frame_status[best][targets[j].frame] = 0;
+					frames_free += 1;
+				}
+				moved = -1;
+				goto done;
+			}
+			if (parity_enabled && queue_parity_write(targets[i], data + (size_t)i * CART_FRAME_SIZE) == -1) {
+				moved = -1;
+				goto done;
+			}
+			note_frame_written(targets[i], data + (size_t)i * CART_FRAME_SIZE);
+		}
+
+		//Switch the file over
+		for (int i = 0; i < num_moves; i++) {
+			switch_frame(file, moves[i], targets[i], data + (size_t)i * CART_FRAME_SIZE);
+		}
+		moved += num_moves;
+	}
+
+done:
+	//Mirrors of frames that moved onto their mirror's cartridge, and the
+	//parity of the stripes written
+	if (flush_mirrors() == -1 || flush_parity() == -1) {
+		moved = -1;
+	}
+	free(moves);
+	free(targets);
+	free(data);
+	return moved;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_compact
+// Description  : Compact every file onto as few cartridges as possible, to
+//                bring back sequential read performance after scattered
+//                allocation or frees. Contents do not change, so files may
+//                be open.
+//
+// Inputs       : none
+// Outputs      : frames moved if successful, -1 if failure
+
+int32_t cart_compact(void) {
+
+	int moved = 0, ret;
+
+	//Check if the driver is ON
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_compact fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+
+	for (int i = 0; i < num_of_file; i++) {
+		if ((ret = compact_file(&file_alloc_table[i], INT32_MAX)) == -1) {
+			return(-1);
+		}
+		moved += ret;
+	}
+
+	return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: driver_now
+// Description	: Seconds on the monotonic clock
+//
+// Input	: none
+// Output	: the time
+
+double driver_now(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_defrag_step
+// Description  : Move a few frames of the most fragmented file onto fewer
+//                cartridges, for callers with idle time. Nothing happens
+//                until the driver has been quiet for DEFRAG_IDLE_SECONDS, and
+//                a token bucket holds moves to the rate set with
+//                cart_setDefragRate, at most DEFRAG_BURST per step, so a file
+//                operation arriving mid-step waits for little.
+//
+// Inputs       : none
+// Outputs      : frames moved (0 if there was nothing to do or no budget),
+//                -1 if failure
+
+int32_t cart_defrag_step(void) {
+
+	double now = driver_now();
+	FileAllocationTable *worst = NULL;
+	int runs, fewest, worst_excess = 0, moved;
+
+	if (driver_status == OFF || defrag_rate == 0) {
+		return 0;
+	}
+
+	//Stay out of the way of file operations
+	if (now - last_file_op < DEFRAG_IDLE_SECONDS) {
+		return 0;
+	}
+
+	//Top up the budget
+	defrag_tokens += (now - defrag_refilled) * defrag_rate;
+	if (defrag_tokens > DEFRAG_BURST) defrag_tokens = DEFRAG_BURST;
+	defrag_refilled = now;
+	if (defrag_tokens < 1.0) {
+		return 0;
+	}
+
+	//The file with the most runs more than it needs
+	for (int i = 0; i < num_of_file; i++) {
+		fewest = file_fragmentation(&file_alloc_table[i], &runs);
+		if (runs - fewest > worst_excess) {
+			worst = &file_alloc_table[i];
+			worst_excess = runs - fewest;
+		}
+	}
+	if (worst == NULL) {
+		return 0;
+	}
+
+	moved = compact_file(worst, (int)defrag_tokens);
+	if (moved > 0) {
+		defrag_tokens -= moved;
+	}
+
+	return (moved);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_scrub_step
+// Description  : Verify a few cold frames against their checksums, for
+//                callers with idle time, repairing any that are corrupt
+//                from their mirror or stripe. The scrubber walks every frame
+//                written (free ones only under parity, which still counts
+//                them) a cartridge at a time, passing over frames written or
+//                verified in the last SCRUB_COLD_SECONDS. Like the
+//                defragmenter it waits for DEFRAG_IDLE_SECONDS of quiet and
+//                holds to the rate set with cart_setScrubRate, at most
+//                SCRUB_BURST frames per step.
+//
+// Inputs       : none
+// Outputs      : frames verified (0 if there was nothing to do or no budget),
+//                -1 if failure
+
+int32_t cart_scrub_step(void) {
+
+	double now = driver_now();
+	char data[CART_FRAME_SIZE];
+	FileAddress address;
+	int checked = 0;
+
+	if (driver_status == OFF || scrub_rate == 0) {
+		return 0;
+	}
+
+	//Stay out of the way of file operations
+	if (now - last_file_op < DEFRAG_IDLE_SECONDS) {
+		return 0;
+	}
+
+	//Top up the budget
+	scrub_tokens += (now - scrub_refilled) * scrub_rate;
+	if (scrub_tokens > SCRUB_BURST) scrub_tokens = SCRUB_BURST;
+	scrub_refilled = now;
+
+	for (int scanned = 0; scanned < CART_TOTAL_FRAMES && checked + 1 <= scrub_tokens; scanned++) {
+		address.cartridge = scrub_next / CART_CARTRIDGE_SIZE;
+		address.frame = scrub_next % CART_CARTRIDGE_SIZE;
+		scrub_next = (scrub_next + 1) % CART_TOTAL_FRAMES;
+
+		if (!frame_written[address.cartridge][address.frame] || cart_failed[address.cartridge] ||
+			(frame_status[address.cartridge][address.frame] == 0 && !parity_enabled) ||
+			now - frame_checked[address.cartridge][address.frame] < SCRUB_COLD_SECONDS) {
+			continue;
+		}
+
+		if (load_cart(address.cartridge) == -1 ||
+			extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME, 0, 0, address.frame), data)) == 1) {
+			logMessage(LOG_ERROR_LEVEL, "Cart scrub read fail\n\n");
+			return(-1);
+		}
+		checked += 1;
+		driver_stats.frames_scrubbed += 1;
+
+		//A frame with no good copy left is reported, and the walk goes on
+		if (verify_frame(address, data) == -1) {
+			repair_frame(address, data);
+		}
+		frame_checked[address.cartridge][address.frame] = now;
+	}
+	scrub_tokens -= checked;
+
+	return (checked);
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setScrubRate
+// Description	: Set how fast the scrubber may verify frames
+//
+// Input	: frames_per_second - the rate, 0 turns it off
+// Output	: 0 if successful
+
+int32_t cart_setScrubRate(uint32_t frames_per_second) {
+
+	scrub_rate = frames_per_second;
+	scrub_tokens = 0.0;
+	scrub_refilled = driver_now();
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setDefragRate
+// Description	: Set how fast the defragmenter may move frames
+//
+// Input	: frames_per_second - the rate, 0 turns it off
+// Output	: 0 if successful
+
+int32_t cart_setDefragRate(uint32_t frames_per_second) {
+
+	defrag_rate = frames_per_second;
+	defrag_tokens = 0.0;
+	defrag_refilled = driver_now();
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setMode
+// Description	: Set the driver's memory allocation mode
+//
+// Input	: alloc_strategy - The strategy to set
+// Output	: 0 if successful
+
+int32_t cart_setMode(AllocStrategy alloc_strategy) {
+	
+	alloc_mode = alloc_strategy;
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setMirror
+// Description	: Turn frame mirroring on or off. Every frame written gets a
+//		  second copy on another cartridge, and reads go to the copy
+//		  on the cartridge already loaded, at the cost of half the
+//		  capacity and a second write.
+//
+// Input	: enabled - 1 to mirror frames
+// Output	: 0 if successful, -1 if the driver is on or parity is on
+
+int32_t cart_setMirror(int enabled) {
+
+	if (driver_status == ON) {
+		logMessage(LOG_ERROR_LEVEL, "cart_setMirror fail: the driver is on.\n\n");
+		return(-1);
+	}
+	if (enabled && parity_enabled) {
+		logMessage(LOG_ERROR_LEVEL, "cart_setMirror fail: the frames are protected by parity.\n\n");
+		return(-1);
+	}
+
+	mirror_enabled = enabled;
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setParity
+// Description	: Turn parity on or off. The cartridges form groups of
+//		  PARITY_GROUP, and frame f of each cartridge of a group makes
+//		  a stripe whose XOR is kept on one of them, so a failed
+//		  cartridge can be read back from the rest of its group at
+//		  the cost of one frame in PARITY_GROUP (mirrors cost half).
+//		  The BALANCED allocator lays files out a stripe at a time,
+//		  so their writes need no reads to update the parity.
+//
+// Input	: enabled - 1 to keep parity
+// Output	: 0 if successful, -1 if the driver is on or mirrors are on
+
+int32_t cart_setParity(int enabled) {
+
+	if (driver_status == ON) {
+		logMessage(LOG_ERROR_LEVEL, "cart_setParity fail: the driver is on.\n\n");
+		return(-1);
+	}
+	if (enabled && mirror_enabled) {
+		logMessage(LOG_ERROR_LEVEL, "cart_setParity fail: the frames are mirrored.\n\n");
+		return(-1);
+	}
+
+	parity_enabled = enabled;
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_fail_cartridge
+// Description	: Mark a cartridge failed. It is not read or written again:
+//		  its frames are read from their mirror or rebuilt from their
+//		  stripe, move elsewhere when written, and its free frames are
+//		  retired.
+//
+// Input	: cart - the cartridge
+// Output	: 0 if successful, -1 if the driver is off or the cartridge
+//		  does not exist
+
+int32_t cart_fail_cartridge(int cart) {
+
+	FileAddress address;
+
+	if (driver_status == OFF) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fail_cartridge fail: The driver is OFF.\n\n");
+		return(-1);
+	}
+	if (cart < 0 || cart >= CART_MAX_CARTRIDGES) {
+		logMessage(LOG_ERROR_LEVEL, "cart_fail_cartridge fail: no cartridge %d.\n\n", cart);
+		return(-1);
+	}
+
+	cart_failed[cart] = 1;
+	address.cartridge = cart;
+	for (address.frame = 0; address.frame < CART_CARTRIDGE_SIZE; address.frame++) {
+		if (frame_status[cart][address.frame] == 0) {
+			frame_status[cart][address.frame] = 1;
+			frame_owner[cart][address.frame] = 0;
+			frames_free -= 1;
+		} else {
+			//New writes of these contents go elsewhere
+			dedup_remove(address);
+		}
+	}
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_setDedup
+// Description	: Turn frame deduplication on or off
+//
+// Input	: enabled - 1 to share frames with identical contents
+// Output	: 0 if successful, -1 if the driver is on
+
+int32_t cart_setDedup(int enabled) {
+
+	if (driver_status == ON) {
+		logMessage(LOG_ERROR_LEVEL, "cart_setDedup fail: the driver is on.\n\n");
+		return(-1);
+	}
+
+	dedup_enabled = enabled;
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: get_cart_driver_stats
+// Description	: Copy out the driver counters, with the frame usage of the
+//		  running (or last) session
+//
+// Input	: stats - where to copy them
+// Output	: 0 if successful
+
+int32_t get_cart_driver_stats(CartDriverStats *stats) {
+
+	if (driver_status == ON) {
+		count_frames_used();
+	}
+
+	*stats = driver_stats;
+
+	return 0;
+
+}
+
+///////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: log_cart_driver_stats
+// Description	: Write the driver counters to the log
+//
+// Input	: lvl - the log level to write at
+// Output	: 0 if successful
+
+int32_t log_cart_driver_stats(unsigned long lvl) {
+
+	CartDriverStats stats;
+
+	get_cart_driver_stats(&stats);
+	logMessage(lvl, "** Driver ** frames used %u for %u file frames and %u holes, writes deduplicated %" PRIu64 ", copied on write %" PRIu64,
+		stats.frames_used, stats.file_frames, stats.hole_frames, stats.dedup_writes, stats.dedup_copies);
+	logMessage(lvl, "** Driver ** hole reads %" PRIu64 ", zero frames written as holes %" PRIu64 ", frames moved by compaction %" PRIu64,
+		stats.zero_reads, stats.zero_writes, stats.frames_moved);
+	logMessage(lvl, "** Driver ** reads from mirrors %" PRIu64 ", mirror frames written %" PRIu64,
+		stats.mirror_reads, stats.mirror_writes);
+	logMessage(lvl, "** Driver ** parity frames written %" PRIu64 " (%" PRIu64 " from full stripes), frames read for parity %" PRIu64 ", degraded reads %" PRIu64,
+		stats.parity_writes, stats.full_stripes, stats.parity_reads, stats.degraded_reads);
+	logMessage(lvl, "** Driver ** checksum failures %" PRIu64 ", frames repaired %" PRIu64 ", frames scrubbed %" PRIu64,
+		stats.checksum_errors, stats.frames_repaired, stats.frames_scrubbed);
+
+	return 0;
+
+}
+
+//
+// Unit test
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_expect
+// Description  : Log a failed expectation of the driver unit test
+//
+// Inputs       : ok - nonzero if the expectation holds
+//                what - what was expected
+// Outputs      : 0 if it holds, -1 if not
+
+int unit_expect(int ok, const char *what) {
+
+	if (!ok) {
+		logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: expected %s.\n\n", what);
+		return(-1);
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_write
+// Description  : Write to a unit test file and to its shadow
+//
+// Inputs       : file - the unit test file
+//                offset - where to write (past the end leaves a hole)
+//                data - the bytes to write
+//                count - number of bytes
+// Outputs      : 0 if successful, -1 if failure
+
+int unit_write(UnitFile *file, int offset, const char *data, int count) {
+
+	if (cart_seek(file->fd, offset) == -1 || cart_write(file->fd, (void *)data, count) != count) {
+		logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: write of %d bytes at %d to [%s].\n\n", count, offset, file->name);
+		return(-1);
+	}
+
+	memcpy(file->shadow + offset, data, count);
+	if (offset + count > file->length) {
+		file->length = offset + count;
+	}
 
-	//Set the driver status OFF
-	driver_status = OFF;
-	
-	// Return successfully
 	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_open
-// Description  : This function opens the file and returns a file handle
+// Function     : unit_truncate
+// Description  : Cut or extend a unit test file and its shadow
 //
-// Inputs       : path - filename of the file to open
-// Outputs      : file handle if successful, -1 if failure
+// Inputs       : file - the unit test file
+//                length - its new length
+// Outputs      : 0 if successful, -1 if failure
 
-int16_t cart_open(char *path) {
-	
-	//Check if the driver is ON
-	if (driver_status == OFF) {
-		//Log error message
-		logMessage(LOG_ERROR_LEVEL, "File open fail: The driver is OFF.\n\n");
-		//Return failure
+int unit_truncate(UnitFile *file, int length) {
+
+	if (cart_truncate(file->fd, length) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: truncate of [%s] to %d bytes.\n\n", file->name, length);
 		return(-1);
 	}
-	
-	//Check if the file exist
-	for (int i = 0; i < num_of_file; i++) {
-		if (strcmp(path, file_alloc_table[i].name) == 0) {
-			//Check if the file already open
-			if (file_alloc_table[i].file_status == OPEN) {
-				//Log error message
-				logMessage(LOG_ERROR_LEVEL, "File is already opened");
-				//Return failure
-				return(-1);
-			} else {
-				//Set the file status to open
-				file_alloc_table[i].file_status = OPEN;
-				//Set position to 0
-				file_alloc_table[i].position = 0;
-				//Return descriptor
-				return (file_alloc_table[i].descriptor);
-			}
+
+	if (length < file->length) {
+		memset(file->shadow + length, 0x0, file->length - length);
+	}
+	file->length = length;
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_check
+// Description  : Read back every open unit test file and compare it with
+//                its shadow, byte for byte
+//
+// Inputs       : step - the step of the test just done, for the log
+// Outputs      : 0 if every file matches, -1 if not
+
+int unit_check(const char *step) {
+
+	char *data = malloc(UNIT_FILE_FRAMES * CART_FRAME_SIZE + 1);
+	int got;
+
+	for (int i = 0; i < UNIT_FILES; i++) {
+		if (unit_files[i].fd == -1) {
+			continue;
+		}
+
+		// Ask for a byte more than the file holds, the read stops at the end
+		if (cart_seek(unit_files[i].fd, 0) == -1) {
+			free(data);
+			return(-1);
+		}
+		got = cart_read(unit_files[i].fd, data, UNIT_FILE_FRAMES * CART_FRAME_SIZE + 1);
+		if (got != unit_files[i].length || memcmp(data, unit_files[i].shadow, got) != 0) {
+			logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: [%s] reads back wrong after %s (%d bytes of %d).\n\n",
+				unit_files[i].name, step, got, unit_files[i].length);
+			free(data);
+			return(-1);
 		}
 	}
-	
-	//Creat a file
-	grow_file_alloc_table(&file_alloc_table);
-	int descriptor = generate_descriptor();
-	strcpy(file_alloc_table[num_of_file - 1].name, path);			//Set file name
-	file_alloc_table[num_of_file - 1].descriptor = descriptor;		//Assign descriptor
-	file_alloc_table[num_of_file - 1].length = 0;				//Set length to zero
-	file_alloc_table[num_of_file - 1].position = 0;				//Set position to zero
-	file_alloc_table[num_of_file - 1].file_status = OPEN;			//Set file_status to open
-	file_alloc_table[num_of_file - 1].num_of_address = 0;			//Set num_of_address to zero
-	
-	grow_file_address_list(&file_alloc_table[num_of_file -1]);
-	//Return the file descriptor
-	return (descriptor);
+
+	free(data);
+	logMessage(LOG_INFO_LEVEL, "Driver unit test: %s, files read back.", step);
+	return(0);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_close
-// Description  : This function closes the file
+// Function     : unit_sharing_test
+// Description  : Write the same frames to two files and to one file over and
+//                over, then change them, each file keeping its own contents
 //
-// Inputs       : fd - the file descriptor
+// Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int16_t cart_close(int16_t fd) {
-	
-	int file_index = - 1;
-	
-	//Find the file index by the file descriptor
-	for (int i = 0; i < num_of_file; i++) {
-		if (fd == file_alloc_table[i].descriptor) {
-			file_index = i;
-			break;
+int unit_sharing_test(void) {
+
+	char data[8 * CART_FRAME_SIZE];
+	char patch[100];
+	CartDriverStats before, after;
+
+	// The same frames in two files, then one frame over and over
+	getRandomData(data, sizeof(data));
+	get_cart_driver_stats(&before);
+	if (unit_write(&unit_files[0], 0, data, sizeof(data)) == -1 ||
+		unit_write(&unit_files[1], 0, data, sizeof(data)) == -1) {
+		return(-1);
+	}
+	for (int i = 8; i < 12; i++) {
+		if (unit_write(&unit_files[0], i * CART_FRAME_SIZE, data, CART_FRAME_SIZE) == -1) {
+			return(-1);
 		}
 	}
-	
-	//Check if the descriptor matching or if the file_index is found
-	if (file_index == -1) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart_close fail: The descriptor is invalid\n\n");
-		//Return failure
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.dedup_writes - before.dedup_writes >= 12, "twelve writes of frames already held to share them") == -1 ||
+		unit_check("writing shared frames") == -1) {
 		return(-1);
 	}
-	
-	//Check if the file is open
-	if (file_alloc_table[file_index].file_status == CLOSE) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart_close fail: The file is not open\n\n");
-		//Return failure
+
+	// Writes into shared frames copy them, the other users keep theirs
+	getRandomData(patch, sizeof(patch));
+	before = after;
+	if (unit_write(&unit_files[1], 2 * CART_FRAME_SIZE + 500, patch, sizeof(patch)) == -1 ||
+		unit_write(&unit_files[0], 9 * CART_FRAME_SIZE + 1000, patch, 24) == -1 ||
+		unit_write(&unit_files[0], 7 * CART_FRAME_SIZE + 1000, patch, sizeof(patch)) == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.dedup_copies - before.dedup_copies == 4, "four copies on write (the last spans two shared frames)") == -1 ||
+		unit_check("writing into shared frames") == -1) {
 		return(-1);
 	}
 
-	//Set the file status to CLOSE
-	file_alloc_table[file_index].file_status = CLOSE;
-	
-	// Return successfully
-	return (0);
+	// Writing the old contents back shares the frame again
+	before = after;
+	if (unit_write(&unit_files[1], 2 * CART_FRAME_SIZE, data + 2 * CART_FRAME_SIZE, CART_FRAME_SIZE) == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.dedup_writes > before.dedup_writes, "old contents written back to share the frame again") == -1) {
+		return(-1);
+	}
+
+	return unit_check("sharing a frame again");
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_read
-// Description  : Reads "count" bytes from the file handle "fh" into the 
-//                buffer "buf"
+// Function     : unit_holes_test
+// Description  : Leave holes by writing past the end and by writing zeros,
+//                then fill part of a hole
 //
-// Inputs       : fd - filename of the file to read from
-//                buf - pointer to buffer to read into
-//                count - number of bytes to read
-// Outputs      : bytes read if successful, -1 if failure
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_read(int16_t fd, void *buf, int32_t count) {
+int unit_holes_test(void) {
 
-	int file_index = -1;
+	char data[CART_FRAME_SIZE];
+	CartDriverStats before, after;
 
-	//Find the index by the descriptor
-	for (int i = 0; i < num_of_file; i++){
-		if (fd == file_alloc_table[i].descriptor) {
-			file_index = i;
-			break;
-		}
-	}	
-	
-	//Check if the desciptor valid or is the file_index is found
-	if (file_index == -1) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
-		//Return failure
+	// Writing past the end leaves frames 1 to 19 as holes (a new file's
+	// first frame was one already)
+	getRandomData(data, sizeof(data));
+	get_cart_driver_stats(&before);
+	if (unit_write(&unit_files[2], 0, data, 100) == -1 ||
+		unit_write(&unit_files[2], 20 * CART_FRAME_SIZE + 10, data, 500) == -1 ||
+		unit_check("writing past the end") == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.hole_frames - before.hole_frames == 18, "eighteen more holes") == -1 ||
+		unit_expect(after.zero_reads > before.zero_reads, "holes read as zeros") == -1) {
 		return(-1);
 	}
 
-	//Check if the file open
-	if (file_alloc_table[file_index].file_status == CLOSE) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
-		//Return failure
-		return (-1);
+	// A frame of zeros frees its frame, here one shared with another file
+	memset(data, 0x0, sizeof(data));
+	before = after;
+	if (unit_write(&unit_files[2], 20 * CART_FRAME_SIZE, data, CART_FRAME_SIZE) == -1 ||
+		unit_write(&unit_files[1], 3 * CART_FRAME_SIZE, data, CART_FRAME_SIZE) == -1 ||
+		unit_check("writing frames of zeros") == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.zero_writes - before.zero_writes == 2, "two frames of zeros written as holes") == -1 ||
+		unit_expect(after.hole_frames - before.hole_frames == 2, "two more holes") == -1) {
+		return(-1);
 	}
 
-	
-	//Check if the count greater than the number of bytes left in the file
-	if (count > (file_alloc_table[file_index].length - file_alloc_table[file_index].position)) {
-		//Set the count to the num fo bytes left in the file
-		count = file_alloc_table[file_index].length - file_alloc_table[file_index].position;
+	// Part of a hole gets a frame, the rest of it still zeros
+	getRandomData(data, 50);
+	before = after;
+	if (unit_write(&unit_files[2], 5 * CART_FRAME_SIZE + 300, data, 50) == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(before.hole_frames - after.hole_frames == 1, "a hole written to get a frame") == -1) {
+		return(-1);
 	}
-	
-	//Copy from memory to the buffer
-	int offset = calculate_position_offset(file_alloc_table[file_index].position);
-	int address_index = calculate_address_index(file_alloc_table[file_index].position);
-	int cart;
-	int frame;
-	void *temp;		//temp buffer to store the whole frame bytes
-	temp = calloc(1024, sizeof(char));		//allocate memory for temp buffer
 
-	//Check if read in only one frame
-	if (count <= CART_FRAME_SIZE - offset) {
-		cart = file_alloc_table[file_index].file_address[address_index].cartridge;
-		frame = file_alloc_table[file_index].file_address[address_index].frame;
-		
-		// Check if in the cache
-		if (get_cart_cache(cart, frame) != NULL){
-			// Get from cache
-			memcpy(temp, get_cart_cache(cart, frame), CART_FRAME_SIZE);
-		} else {
-			//load cart
-			load_cart(cart);
-		
-			//read frame
-			if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME,0,0, frame), temp)) == 1) {
-				logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
-				return(-1);
-			} 
+	return unit_check("writing into a hole");
+}
 
-			// Put into the cache
-			put_cart_cache(cart, frame, temp);
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_layout_test
+// Description  : Shrink and extend files (one through a shared frame),
+//                unlink and reopen one, then compact them all
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-		//copy count number of bytes to buffer
-		memcpy(buf, (char *)temp + offset, count);
-		
+int unit_layout_test(void) {
 
-	} else {	//read cross frames
-		int count_first_frame = CART_FRAME_SIZE - offset;			//number of bytes read from the first frame
-		int count_last_frame = (count - count_first_frame) % CART_FRAME_SIZE;	//number of bytes read from the last frame
-		int num_of_frame = (count - count_first_frame) / CART_FRAME_SIZE + 2;	//number of frame that read from
-		int buff_length = 0;							//the length of the buff
-		
-		for (int i = 0; i < num_of_frame; i++) {
+	char data[10 * CART_FRAME_SIZE];
+	CartDriverStats before, after;
+	int moved;
+
+	// Cutting into frame 5, which unit1 shares, copies it; the tail
+	// extended back reads as zeros
+	get_cart_driver_stats(&before);
+	if (unit_truncate(&unit_files[0], 5 * CART_FRAME_SIZE + 7) == -1 ||
+		unit_truncate(&unit_files[0], 30 * CART_FRAME_SIZE + 1) == -1 ||
+		unit_truncate(&unit_files[2], 3000) == -1 ||
+		unit_check("truncating to shrink and extend") == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.dedup_copies - before.dedup_copies == 1, "a copy of the shared frame cut into") == -1) {
+		return(-1);
+	}
 
-			cart = file_alloc_table[file_index].file_address[address_index + i].cartridge;				
-			frame = file_alloc_table[file_index].file_address[address_index + i].frame;
+	// An open file stays, a closed one goes and comes back empty
+	if (unit_expect(cart_unlink(unit_files[1].name) == -1, "no unlink of an open file") == -1 ||
+		unit_expect(cart_close(unit_files[1].fd) == 0 && cart_unlink(unit_files[1].name) == 0, "an unlink after a close") == -1 ||
+		unit_expect(cart_unlink(unit_files[1].name) == -1, "no unlink of a missing file") == -1) {
+		return(-1);
+	}
+	unit_files[1].fd = cart_open(unit_files[1].name);
+	memset(unit_files[1].shadow, 0x0, UNIT_FILE_FRAMES * CART_FRAME_SIZE);
+	unit_files[1].length = 0;
+	if (unit_expect(unit_files[1].fd != -1, "to reopen an unlinked file") == -1 ||
+		unit_check("unlinking and reopening") == -1) {
+		return(-1);
+	}
 
-			//Check if in the cache
-			if (get_cart_cache(cart, frame) != NULL){
-				// Get from cache
-				memcpy(temp, get_cart_cache(cart, frame), CART_FRAME_SIZE);
-			} else {
-				//load cart	
-				load_cart(cart);
-	
-				//read frame
-				if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME,0,0, frame), temp)) == 1) {
-					logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
-					return(-1);
-				}
-				
-				// Put into the cache
-				put_cart_cache(cart, frame, temp);
-			}
+	// Fill the files out with new frames, holes and frames shared with
+	// unit0, then gather each one onto as few cartridges as it can
+	getRandomData(data, sizeof(data));
+	if (unit_write(&unit_files[1], 0, data, sizeof(data)) == -1 ||
+		unit_write(&unit_files[1], 14 * CART_FRAME_SIZE, unit_files[0].shadow, 5 * CART_FRAME_SIZE) == -1 ||
+		unit_write(&unit_files[3], CART_FRAME_SIZE, data + 100, 6 * CART_FRAME_SIZE) == -1 ||
+		unit_write(&unit_files[3], 12 * CART_FRAME_SIZE + 9, data, sizeof(data) - 9) == -1 ||
+		unit_write(&unit_files[0], 26 * CART_FRAME_SIZE, data, 4 * CART_FRAME_SIZE) == -1) {
+		return(-1);
+	}
+	before = after;
+	moved = cart_compact();
+	get_cart_driver_stats(&after);
+	if (unit_expect(moved > 0 && after.frames_moved - before.frames_moved == (uint64_t)moved, "frames moved by compaction") == -1) {
+		return(-1);
+	}
+
+	return unit_check("compacting");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_address
+// Description  : Get the frame behind a frame of a unit test file
+//
+// Inputs       : file - the unit test file
+//                index - the frame of the file
+// Outputs      : the frame, {CART_HOLE, CART_HOLE} for a hole or no file
+
+FileAddress unit_address(UnitFile *file, int index) {
+
+	FileAddress hole = { CART_HOLE, CART_HOLE };
+
+	for (int i = 0; i < num_of_file; i++) {
+		if (file_alloc_table[i].descriptor == file->fd && index < file_alloc_table[i].num_of_address) {
+			return file_alloc_table[i].file_address[index];
+		}
+	}
+
+	return hole;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_evict_stripe
+// Description  : Drop every member of a stripe from the cache, so parity
+//                work has to read them
+//
+// Inputs       : parity - the parity frame of the stripe
+// Outputs      : none
 
-			//Check if it is first frame
-			if (i == 0) {
-				//read the bytes left in that frame
-				
-				//copy memory
-				memcpy((char *)buf, (char *)temp + offset, count_first_frame);
-				buff_length += count_first_frame;
+void unit_evict_stripe(FileAddress parity) {
 
-			} else if (i == num_of_frame - 1) {		//if it is last frame
-				
-				//read the bytes to the boundary
-				//copy memory
-				memcpy((char *)buf + buff_length, (char *)temp , count_last_frame);
-				buff_length += count_last_frame;
+	for (int j = 0; j < PARITY_GROUP; j++) {
+		free(delete_cart_cache(parity.cartridge - parity.cartridge % PARITY_GROUP + j, parity.frame));
+	}
+}
 
-			} else {		//if it is middle frame
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_stripe_ok
+// Description  : Check a stripe's parity against its data frames, the XOR
+//                of all its members being zeros
+//
+// Inputs       : parity - the parity frame of the stripe
+// Outputs      : 0 if the parity is right, -1 if not
 
-				//read the whole frame
-				
-				//copy memory
-				memcpy((char *)buf + buff_length, (char *)temp, CART_FRAME_SIZE);
-				buff_length += CART_FRAME_SIZE;
-			}
+int unit_stripe_ok(FileAddress parity) {
 
+	char sum[CART_FRAME_SIZE], member_data[CART_FRAME_SIZE];
+	FileAddress member;
 
-					
+	memset(sum, 0x0, CART_FRAME_SIZE);
+	member.frame = parity.frame;
+	for (int j = 0; j < PARITY_GROUP; j++) {
+		member.cartridge = parity.cartridge - parity.cartridge % PARITY_GROUP + j;
+		if (read_member(member, member_data) == -1) {
+			return(-1);
 		}
-
+		xor_frame(sum, member_data);
 	}
 
-	//increase the position
-	file_alloc_table[file_index].position += count;
-
-	//deallocate
-	free(temp);
-
-	// Return successfully
-	return (count);
+	return unit_expect(memcmp(sum, zero_frame, CART_FRAME_SIZE) == 0, "the parity to match its stripe");
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_write
-// Description  : Writes "count" bytes to the file handle "fh" from the 
-//                buffer  "buf"
+// Function     : unit_parity_test
+// Description  : Fill whole stripes in one write, change a frame of a stripe
+//                (the parity follows its delta), then change a frame of a
+//                stale stripe (the parity is worked out from the whole stripe)
 //
-// Inputs       : fd - filename of the file to write to
-//                buf - pointer to buffer to write from
-//                count - number of bytes to write
-// Outputs      : bytes written if successful, -1 if failure
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_write(int16_t fd, void *buf, int32_t count) {
+int unit_parity_test(void) {
 
-	int file_index = -1;		//Default file index to invalid number -1
+	char data[112 * CART_FRAME_SIZE];
+	CartDriverStats before, after;
+	AllocStrategy saved_mode = alloc_mode;
+	FileAddress parity;
 
-	//Find the index by the descriptor
-	for (int i = 0; i < num_of_file; i++){
-		if (fd == file_alloc_table[i].descriptor) {
-			file_index = i;
-			break;
-		}
-	}	
-	
-	//Check if the desciptor valid
-	if (file_index == -1) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
-		//Return failure
+	// Two rounds of the cartridges, 56 data frames a round
+	getRandomData(data, sizeof(data));
+	cart_setMode(CARTALLOC_BALANCED);
+	get_cart_driver_stats(&before);
+	if (unit_write(&unit_files[2], 8 * CART_FRAME_SIZE, data, sizeof(data)) == -1) {
+		cart_setMode(saved_mode);
+		return(-1);
+	}
+	cart_setMode(saved_mode);
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.full_stripes - before.full_stripes >= 8, "whole stripes written without reads") == -1 ||
+		unit_check("writing whole stripes") == -1) {
 		return(-1);
 	}
 
-	//Check if the file open
-	if (file_alloc_table[file_index].file_status == CLOSE) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
-		//Return failure
-		return (-1);
+	// A change to one frame reads just the old parity
+	parity = parity_address(unit_address(&unit_files[2], 20));
+	unit_evict_stripe(parity);
+	before = after;
+	if (unit_write(&unit_files[2], 20 * CART_FRAME_SIZE + 300, data, 100) == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.parity_reads - before.parity_reads == 1, "the old parity read to fold in a delta") == -1 ||
+		unit_expect(after.full_stripes == before.full_stripes, "no whole stripe for a delta") == -1 ||
+		unit_stripe_ok(parity) == -1) {
+		return(-1);
 	}
 
-	int offset = calculate_position_offset(file_alloc_table[file_index].position);
-	int address_index = calculate_address_index(file_alloc_table[file_index].position);
-	int cart;
-	int frame;
-	void *temp;		//temp buffer to process the whole frame bytes
-	int length_increament;		//the increament of length of size
-	temp = calloc(1024, sizeof(char));		//allocate memory to temp pointer
+	// A stale parity (as a failed parity write leaves it) is worked out
+	// from the whole stripe on the next change
+	parity = parity_address(unit_address(&unit_files[2], 30));
+	unit_evict_stripe(parity);
+	parity_stale[parity.cartridge][parity.frame] = 1;
+	get_cart_driver_stats(&before);
+	if (unit_write(&unit_files[2], 30 * CART_FRAME_SIZE + 5, data + 5000, 20) == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.parity_reads - before.parity_reads == PARITY_GROUP - 2, "the rest of a stale stripe read") == -1 ||
+		unit_expect(!parity_stale[parity.cartridge][parity.frame], "the stale parity brought up to date") == -1 ||
+		unit_stripe_ok(parity) == -1) {
+		return(-1);
+	}
 
-	//check if write beyond the file length
-	if (file_alloc_table[file_index].position + count > file_alloc_table[file_index].length) {
-		
-		length_increament = file_alloc_table[file_index].position + count - file_alloc_table[file_index].length;
+	return unit_check("changing frames of stripes");
+}
 
-	} else {
-	
-		length_increament = 0;
-	}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_failure_test
+// Description  : Fail a cartridge, read everything back from the mirrors or
+//                parity, make sure a stale stripe is not trusted, then
+//                rewrite parts of the files and compact them
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-	cart = file_alloc_table[file_index].file_address[address_index].cartridge;
-	frame = file_alloc_table[file_index].file_address[address_index].frame;
-	
-	//Check if it write in only one frame
-	if (count <= CART_FRAME_SIZE - offset) {
-		
-		// Check if in the cache
-		if (get_cart_cache(cart, frame) != NULL){
-			// Get from the cache
-			memcpy(temp, get_cart_cache(cart, frame), CART_FRAME_SIZE);
-			
-			// load cart
-			load_cart(cart);
-		} else {
-			//load cart
-			load_cart(cart);
-		
-			//read frame
-			if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME,0,0, frame), temp)) == 1) {
-				logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
-				return(-1);
-			} 
+int unit_failure_test(void) {
 
-			// Put into the cache
-			put_cart_cache(cart, frame, temp);
-		}
+	char data[CART_FRAME_SIZE];
+	CartDriverStats before, after;
+	FileAddress lost = unit_address(&unit_files[0], 1), stale;
+	UnitFile *file;
+	int offset, count, i;
 
-		//copy memory from the buffer
-		memcpy((char *)temp + offset, (char *)buf, count);
+	if (!mirror_enabled && !parity_enabled) {
+		logMessage(LOG_INFO_LEVEL, "Driver unit test: no mirrors or parity (-m or -x), no cartridge failed.");
+		return(0);
+	}
 
-		// Put into the cache
-		put_cart_cache(cart, frame, temp);
+	// Everything on the cartridge is read from the other copies
+	get_cart_driver_stats(&before);
+	if (cart_fail_cartridge(lost.cartridge) == -1) {
+		return(-1);
+	}
+	for (int f = 0; f < CART_CARTRIDGE_SIZE; f++) {
+		free(delete_cart_cache(lost.cartridge, f));
+	}
+	if (unit_check("failing a cartridge") == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.degraded_reads > before.degraded_reads, "reads of the failed cartridge") == -1) {
+		return(-1);
+	}
 
-		//write to frame
-		if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME,0, 0, frame), temp)) == 1) {
-			logMessage(LOG_ERROR_LEVEL, "Cart write fail\n\n", cart);
+	// A frame of the failed cartridge in a stale stripe cannot be rebuilt,
+	// the read fails instead of making up contents
+	// (unit2 has a frame on every cartridge from the whole stripes)
+	if (parity_enabled) {
+		for (i = 8; i < 120 && unit_address(&unit_files[2], i).cartridge != lost.cartridge; i++);
+		if (unit_expect(i < 120, "a frame of unit2 on the failed cartridge") == -1) {
+			return(-1);
+		}
+		stale = parity_address(unit_address(&unit_files[2], i));
+		free(delete_cart_cache(lost.cartridge, stale.frame));
+		parity_stale[stale.cartridge][stale.frame] = 1;
+		if (unit_expect(cart_seek(unit_files[2].fd, i * CART_FRAME_SIZE) == 0 &&
+				cart_read(unit_files[2].fd, data, CART_FRAME_SIZE) == -1, "no read of a frame of a stale stripe") == -1 ||
+			unit_truncate(&unit_files[2], i * CART_FRAME_SIZE) == -1) {
 			return(-1);
 		}
+	}
 
+	// Change the files here and there, frames of the failed cartridge
+	// move elsewhere
+	for (i = 0; i < 64; i++) {
+		file = &unit_files[getRandomValue(0, UNIT_FILES - 1)];
+		offset = getRandomValue(0, file->length);
+		count = getRandomValue(1, CART_FRAME_SIZE);
+		if (offset + count > UNIT_FILE_FRAMES * CART_FRAME_SIZE) {
+			count = UNIT_FILE_FRAMES * CART_FRAME_SIZE - offset;
+		}
+		getRandomData(data, count);
+		if (unit_write(file, offset, data, count) == -1) {
+			return(-1);
+		}
+	}
+	if (unit_check("rewriting after the failure") == -1 || cart_compact() == -1) {
+		return(-1);
+	}
 
-	} else {	//if write cross the frame
-		
-		int count_first_frame = CART_FRAME_SIZE - offset;			//number of bytes write to the first frame
-		int count_last_frame = (count - count_first_frame) % CART_FRAME_SIZE;	//number of bytes write to the last frame
-		int num_of_frame = (count - count_first_frame) / CART_FRAME_SIZE + 2;	//number of frame that write to
-		int num_of_byte_written = 0;
+	return unit_check("compacting after the failure");
+}
 
-		for (int i = 0; i < num_of_frame; i++) {
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_bus
+// Description  : Read or write a frame straight over the bus, behind the
+//                driver's back (its checksum and cached copy stay as they are)
+//
+// Inputs       : op - CART_OP_RDFRME or CART_OP_WRFRME
+//                address - the frame
+//                data - the CART_FRAME_SIZE bytes
+// Outputs      : 0 if successful, -1 if failure
 
-			//check if new memory needed
-			if (address_index + i == file_alloc_table[file_index].num_of_address - 1) {
-				//allocate new address
-				grow_file_address_list(&file_alloc_table[file_index]);
-			}
+int unit_bus(uint64_t op, FileAddress address, void *data) {
 
-			cart = file_alloc_table[file_index].file_address[address_index + i].cartridge;				
-			frame = file_alloc_table[file_index].file_address[address_index + i].frame;
+	if (load_cart(address.cartridge) == -1 ||
+		extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(op, 0, 0, address.frame), data)) == 1) {
+		logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: bus access to [%d/%d].\n\n", address.cartridge, address.frame);
+		return(-1);
+	}
 
-			// Check if in the cache
-			if (get_cart_cache(cart, frame) != NULL){
-				// Get from the cache
-				memcpy(temp, get_cart_cache(cart, frame), CART_FRAME_SIZE);
+	return(0);
+}
 
-				// load cart
-				load_cart(cart);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_read_frame
+// Description  : Read one frame of a unit test file through the driver,
+//                from the frame itself (not the cache or its mirror), and
+//                compare it with the shadow
+//
+// Inputs       : file - the unit test file
+//                index - the frame of the file
+// Outputs      : 0 if it reads back right, -1 if the read fails or differs
 
-			} else {
-	
-				//load cart
-				load_cart(cart);
-	
-				//read frame
-				if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_RDFRME,0,0, frame), temp)) == 1) {
-					logMessage(LOG_ERROR_LEVEL, "Cart read op fail\n\n");
-					return(-1);
-				}
+int unit_read_frame(UnitFile *file, int index) {
 
-				// Put into the cache
-				put_cart_cache(cart, frame, temp);
-			}
-			//Check if it is first frame
-			if (i == 0) {
-		
-				//copy memory from the buffer
-				memcpy((char *)temp + offset, (char *)buf + num_of_byte_written, count_first_frame);
-				num_of_byte_written += count_first_frame;
+	char data[CART_FRAME_SIZE];
+	FileAddress address = unit_address(file, index);
 
-			} else if (i == num_of_frame - 1) {		//if it is last frame
-				
-				//copy memory from the buffer
-				memcpy((char *)temp, (char *)buf + num_of_byte_written, count_last_frame);
-				num_of_byte_written += count_last_frame;
+	free(delete_cart_cache(address.cartridge, address.frame));
+	if (load_cart(address.cartridge) == -1 || cart_seek(file->fd, index * CART_FRAME_SIZE) == -1 ||
+		cart_read(file->fd, data, CART_FRAME_SIZE) != CART_FRAME_SIZE) {
+		return(-1);
+	}
 
-			} else {		//if it is middle frame
-	
-				//copy memory from the buffer
-				memcpy((char *)temp, (char *)buf + num_of_byte_written, CART_FRAME_SIZE);
-				num_of_byte_written += CART_FRAME_SIZE;
-			}
+	return unit_expect(memcmp(data, file->shadow + index * CART_FRAME_SIZE, CART_FRAME_SIZE) == 0, "a frame to read back as written");
+}
 
-			//put to the cache
-			put_cart_cache(cart, frame, temp);
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : unit_checksum_test
+// Description  : Corrupt a frame behind the driver's back, then its other
+//                copy too, then its stored checksum, and read it; then
+//                corrupt the other copy alone and let the scrubber find it.
+//                With mirrors or parity the frames are mended, without them
+//                (or with both copies bad) the read fails.
+//
+// Inputs       : none
+// Outputs      : 0 if successful, -1 if failure
 
-			//write to frame
-			if (extract_cart_opcode(client_cart_bus_request(creat_cart_opcode(CART_OP_WRFRME,0, 0, frame), temp)) == 1) {
-				logMessage(LOG_ERROR_LEVEL, "Cart write fail\n\n", cart);
-				return(-1);
-			}
-			
-		
-		}
+int unit_checksum_test(void) {
+
+	char junk[CART_FRAME_SIZE], saved[CART_FRAME_SIZE];
+	CartDriverStats before, after;
+	FileAddress frame = unit_address(&unit_files[1], 0), other = frame;
+	uint32_t saved_rate = scrub_rate;
+	struct timespec idle = { 0, 2000000 };
+	int redundant = mirror_enabled || parity_enabled;
+
+	// The other copy: the mirror, or the parity of the stripe
+	if (mirror_enabled) {
+		other.cartridge = frame_mirror[frame.cartridge][frame.frame] / CART_CARTRIDGE_SIZE;
+		other.frame = frame_mirror[frame.cartridge][frame.frame] % CART_CARTRIDGE_SIZE;
+	} else if (parity_enabled) {
+		other = parity_address(frame);
+	}
+	if (unit_bus(CART_OP_RDFRME, other, saved) == -1) {
+		return(-1);
+	}
 
+	// Corrupt contents are mended from the other copy, or not read at all
+	getRandomData(junk, CART_FRAME_SIZE);
+	get_cart_driver_stats(&before);
+	if (unit_bus(CART_OP_WRFRME, frame, junk) == -1 ||
+		unit_expect((unit_read_frame(&unit_files[1], 0) == 0) == redundant, "corrupt contents mended only from another copy") == -1) {
+		return(-1);
+	}
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.checksum_errors - before.checksum_errors == 1, "a checksum failure") == -1 ||
+		unit_expect(after.frames_repaired - before.frames_repaired == (uint64_t)redundant, "the frame mended") == -1) {
+		return(-1);
 	}
 
-	//increase the position
-	file_alloc_table[file_index].position += count;
+	// With both copies corrupt the read fails, until the other is put back
+	if (redundant) {
+		if (unit_bus(CART_OP_WRFRME, frame, junk) == -1 || unit_bus(CART_OP_WRFRME, other, junk) == -1 ||
+			unit_expect(unit_read_frame(&unit_files[1], 0) == -1, "no read with both copies corrupt") == -1 ||
+			unit_bus(CART_OP_WRFRME, other, saved) == -1) {
+			return(-1);
+		}
+	} else if (unit_bus(CART_OP_WRFRME, frame, unit_files[1].shadow) == -1) {
+		return(-1);
+	}
+	if (unit_expect(unit_read_frame(&unit_files[1], 0) == 0, "the frame read back after the repair") == -1) {
+		return(-1);
+	}
 
-	//increase the length of file
-	file_alloc_table[file_index].length += length_increament;
+	// A wrong stored checksum matches no copy but a mirror
+	frame_crc[frame.cartridge][frame.frame] ^= 0x1;
+	if (unit_read_frame(&unit_files[1], 0) == -1) {
+		if (unit_expect(!mirror_enabled, "a wrong checksum mended from the mirror") == -1) {
+			return(-1);
+		}
+		frame_crc[frame.cartridge][frame.frame] ^= 0x1;
+	}
+	if (unit_expect(unit_read_frame(&unit_files[1], 0) == 0, "the frame read back with its checksum right") == -1) {
+		return(-1);
+	}
 
-	//deallocate
-	free(temp);
+	// The scrubber finds a corrupt copy no read goes to (a mirror through
+	// the primary it copies)
+	if (unit_bus(CART_OP_WRFRME, other, junk) == -1) {
+		return(-1);
+	}
+	frame_checked[other.cartridge][other.frame] = 0.0;
+	scrub_next = FRAME_ID(other);
+	cart_setScrubRate(1000000);
+	nanosleep(&idle, NULL);
+	get_cart_driver_stats(&before);
+	if (unit_expect(cart_scrub_step() >= 1, "the scrubber to verify a frame") == -1) {
+		cart_setScrubRate(saved_rate);
+		return(-1);
+	}
+	cart_setScrubRate(saved_rate);
+	get_cart_driver_stats(&after);
+	if (unit_expect(after.checksum_errors - before.checksum_errors == 1, "the scrubber to find the corrupt frame") == -1 ||
+		unit_expect(after.frames_repaired - before.frames_repaired == (uint64_t)redundant, "the scrubber to mend the frame") == -1 ||
+		unit_bus(CART_OP_RDFRME, other, junk) == -1 ||
+		unit_expect(crc32c(junk, CART_FRAME_SIZE) == frame_crc[other.cartridge][other.frame] || !redundant, "the mended frame on the bus") == -1) {
+		return(-1);
+	}
+	if (!redundant && unit_bus(CART_OP_WRFRME, frame, unit_files[1].shadow) == -1) {
+		return(-1);
+	}
 
-	// Return successfully
-	return (count);
+	return unit_check("corrupting frames");
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// Function     : cart_seek
-// Description  : Seek to specific point in the file
+// Function     : cartDriverUnitTest
+// Description  : Run a UNIT test of the driver against a cart_server, checking
+//                every file against a shadow copy after each step
 //
-// Inputs       : fd - filename of the file to write to
-//                loc - offfset of file in relation to beginning of file
+// Inputs       : none
 // Outputs      : 0 if successful, -1 if failure
 
-int32_t cart_seek(int16_t fd, uint32_t loc) {
+int cartDriverUnitTest(void) {
 
-	int file_index = -1;
+	CartCacheStats cache;
+	int saved_dedup = dedup_enabled;
+	int result = 0;
 
-	//Find the index by the descriptor
-	for (int i = 0; i < num_of_file; i++){
-		if (fd == file_alloc_table[i].descriptor) {
-			file_index = i;
-			break;
-		}
-	}	
-	
-	//Check if the desciptor valid or is the file_index is found
-	if (file_index == -1) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The descriptor is invalid.\n\n ");
-		//Return failure
+	if (unit_expect(driver_status == OFF, "the driver to start OFF") == -1) {
 		return(-1);
 	}
 
-	//Check if the file open
-	if (file_alloc_table[file_index].file_status == CLOSE) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart read fail: The file is not open.\n\n");
-		//Return failure
-		return (-1);
-	}
+	// A small cache so the checks read the frames back from the bus
+	get_cart_cache_stats(&cache);
+	set_cart_cache_size(UNIT_CACHE_FRAMES);
+	cart_setDedup(1);
 
-	//Check if the loc beyond the length of the file
-	if (loc > file_alloc_table[file_index].length) {
-		//Log message
-		logMessage(LOG_ERROR_LEVEL, "cart_seek fail: beyond the length of the file.\n\n");
-		//Return failure
-		return (-1);	
+	if (cart_poweron() == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Driver unit test fail: cannot power on (is cart_server running?).\n\n");
+		cart_setDedup(saved_dedup);
+		set_cart_cache_size(cache.capacity);
+		return(-1);
 	}
 
-	file_alloc_table[file_index].position = loc;
-
-	// Return successfully
-	return (0);
-}
-
-///////////////////////////////////////////////////////////////////////////////////
-//
-// Function	: cart_setMode
-// Description	: Set the driver's memory allocation mode
-//
-// Input	: alloc_strategy - The strategy to set
-// Output	: 0 if successful
+	for (int i = 0; i < UNIT_FILES; i++) {
+		snprintf(unit_files[i].name, sizeof(unit_files[i].name), "unit%d", i);
+		unit_files[i].fd = cart_open(unit_files[i].name);
+		unit_files[i].length = 0;
+		unit_files[i].shadow = calloc(UNIT_FILE_FRAMES, CART_FRAME_SIZE);
+	}
 
-int32_t cart_setMode(AllocStrategy alloc_strategy) {
-	
-	alloc_mode = alloc_strategy;
+	if (unit_sharing_test() == -1 || unit_holes_test() == -1 || unit_layout_test() == -1 ||
+		(parity_enabled && unit_parity_test() == -1) || unit_checksum_test() == -1 || unit_failure_test() == -1) {
+		result = -1;
+	}
 
-	return 0;
+	if (cart_poweroff() == -1 ||
+		unit_expect(cart_truncate(unit_files[0].fd, 0) == -1, "no truncate with the driver OFF") == -1 ||
+		unit_expect(cart_fadvise(unit_files[0].fd, CART_ADVICE_SEQUENTIAL, 4) == -1, "no advice with the driver OFF") == -1) {
+		result = -1;
+	}
+	for (int i = 0; i < UNIT_FILES; i++) {
+		free(unit_files[i].shadow);
+		unit_files[i].shadow = NULL;
+		unit_files[i].fd = -1;
+	}
+	cart_setDedup(saved_dedup);
+	set_cart_cache_size(cache.capacity);
 
+	if (result == 0) {
+		logMessage(LOG_INFO_LEVEL, "Driver unit test completed successfully.");
+	}
+	return(result);
 }
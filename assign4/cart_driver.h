@@ -18,6 +18,39 @@
 #define CART_MAX_TOTAL_FILES 1024 // Maximum number of files ever
 #define CART_MAX_PATH_LENGTH 128 // Maximum length of filename length
 
+typedef enum{
+	CARTALLOC_RANDOM = 0,		// Random cartridge and frame
+	CARTALLOC_LINEAR  = 1,		// Fill one cartridge before the next
+	CARTALLOC_BALANCED = 2,		// Round robin across the cartridges
+	CARTALLOC_AFFINITY = 3		// Runs of frames on a home cartridge per file
+} AllocStrategy;
+
+typedef enum{
+	CART_ADVICE_NORMAL = 0,		// Placed by the driver's allocation strategy
+	CART_ADVICE_SEQUENTIAL = 1,	// Streamed in order, striped across cartridges
+	CART_ADVICE_RANDOM = 2		// Small and hot, kept on its home cartridge
+} CartAdvice;
+
+typedef struct {
+	uint64_t dedup_writes;	// frame writes that found the contents already stored
+	uint64_t dedup_copies;	// shared frames copied before a write
+	uint64_t zero_reads;	// frame reads of holes, answered without the bus
+	uint64_t zero_writes;	// frames of zeros written, kept as holes
+	uint64_t frames_moved;	// frames moved by compaction
+	uint64_t mirror_reads;	// frame reads served by a mirror (its cartridge was the better one)
+	uint64_t mirror_writes;	// mirror frames written
+	uint64_t parity_writes;	// parity frames written
+	uint64_t parity_reads;	// frames read to work out parity
+	uint64_t full_stripes;	// parity written from the stripe's new contents alone, without a read
+	uint64_t degraded_reads;	// frames of a failed cartridge read from their mirror or parity
+	uint64_t checksum_errors;	// frames read from the bus that failed their CRC32C
+	uint64_t frames_repaired;	// corrupt frames rewritten from a good copy
+	uint64_t frames_scrubbed;	// frames the scrubber verified
+	uint32_t frames_used;	// frames in use (at power off, for a finished session)
+	uint32_t file_frames;	// frames of all files backed by a frame, more than frames_used when shared
+	uint32_t hole_frames;	// frames of all files that are holes
+} CartDriverStats;
+
 //
 // Interface functions
 
@@ -40,8 +73,61 @@ int32_t cart_write(int16_t fd, void *buf, int32_t count);
 	// Writes "count" bytes to the file handle "fh" from the buffer  "buf"
 
 int32_t cart_seek(int16_t fd, uint32_t loc);
-	// Seek to specific point in the file
+	// Seek to specific point in the file (past the end leaves a hole when written)
+
+int32_t cart_unlink(char *path);
+	// Delete a closed file, freeing its frames
+
+int32_t cart_truncate(int16_t fd, uint32_t length);
+	// Cut (or extend with zeros) an open file to "length" bytes
+
+int32_t cart_fadvise(int16_t fd, CartAdvice advice, uint32_t width);
+	// Say how the file is used, placing its new frames to suit (width: cartridges a SEQUENTIAL file stripes over)
+
+int32_t cart_fallocate(int16_t fd, uint32_t length);
+	// Reserve frames for the file to grow to "length" bytes (its length does not change)
+
+int32_t cart_compact(void);
+	// Move files onto as few cartridges as possible, returns frames moved
+
+int32_t cart_defrag_step(void);
+	// From idle time: move a few frames of the most fragmented file, within the rate
+
+int32_t cart_setDefragRate(uint32_t frames_per_second);
+	// Set the most frames per second cart_defrag_step moves (0 turns it off)
+
+int32_t cart_scrub_step(void);
+	// From idle time: verify a few cold frames against their checksums, within the rate
+
+int32_t cart_setScrubRate(uint32_t frames_per_second);
+	// Set the most frames per second cart_scrub_step verifies (0 turns it off)
+
+int32_t cart_setMode(AllocStrategy alloc_strategy);
+	// Set the driver's memory allocation strategy (before cart_poweron)
+
+int32_t cart_setDedup(int enabled);
+	// Share frames with identical contents, copying on write (before cart_poweron)
+
+int32_t cart_setMirror(int enabled);
+	// Keep a second copy of every frame on another cartridge, for reads (before cart_poweron)
+
+int32_t cart_setParity(int enabled);
+	// Keep an XOR parity frame per stripe of each cartridge group, instead of mirrors (before cart_poweron)
+
+int32_t cart_fail_cartridge(int cart);
+	// Stop using a cartridge, reading its frames from their mirror or parity from now on
+
+int32_t get_cart_driver_stats(CartDriverStats *stats);
+	// Copy out the driver counters (kept across power off, reset by power on)
+
+int32_t log_cart_driver_stats(unsigned long lvl);
+	// Write the driver counters to the log at the given level
+
+//
+// Unit test
 
+int cartDriverUnitTest(void);
+	// Run the driver unit test, against a running cart_server
 
 #endif
 
@@ -0,0 +1,222 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_latency.c
+//  Description    : This is the implementation of the latency histograms for
+//                   the CART driver. Samples go into log-linear (HDR style)
+//                   buckets: exact below 64 ticks, then 32 buckets for every
+//                   power of two, so recording is a shift and an increment.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+// Project includes
+#include <cart_latency.h>
+#include <cmpsc311_log.h>
+
+#ifdef CART_LATENCY
+
+// Defines
+#define LAT_SUB_COUNT (1 << CART_LATENCY_SUB_BITS)
+#define LAT_BUCKETS ((2 + 64 - CART_LATENCY_SUB_BITS) * LAT_SUB_COUNT)
+
+typedef struct {
+	uint64_t buckets[LAT_BUCKETS];	// sample count per bucket
+	uint64_t count;			// samples recorded
+	uint64_t total;			// sum of all samples, in ticks
+	uint64_t max;			// largest sample, in ticks
+} LatencyHistogram;
+
+// Global data
+LatencyHistogram latency_histograms[CART_LAT_MAXVAL];	// One histogram per operation
+
+uint64_t latency_start_ticks;		// Clock ticks at the first sample
+
+struct timespec latency_start_time;	// Wall time at the first sample
+
+const char *latency_names[CART_LAT_MAXVAL] = {
+	"cart_open", "cart_read", "cart_write", "cart_seek", "cart_close",
+	"INITMS", "BZERO", "LDCART", "RDFRME", "WRFRME", "POWOFF"
+};
+
+//
+// Functions
+
+// Map a sample to its bucket
+int latency_bucket(uint64_t ticks);
+
+// Lowest sample that falls in a bucket
+uint64_t latency_bucket_value(int bucket);
+
+// Nanoseconds per clock tick, measured since the first sample
+double latency_ns_per_tick(void);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: latency_bucket
+// Description	: Map a sample to its bucket
+//
+// Input	: ticks - the sample
+// Output	: the bucket index
+
+int latency_bucket(uint64_t ticks) {
+
+	// small samples are exact
+	if (ticks < 2 * LAT_SUB_COUNT) {
+		return (int)ticks;
+	}
+
+	// keep the top CART_LATENCY_SUB_BITS+1 bits of larger ones
+	int msb = 63 - __builtin_clzll(ticks);
+	int shift = msb - CART_LATENCY_SUB_BITS;
+	return 2 * LAT_SUB_COUNT + (msb - CART_LATENCY_SUB_BITS - 1) * LAT_SUB_COUNT
+		+ (int)((ticks >> shift) - LAT_SUB_COUNT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: latency_bucket_value
+// Description	: Lowest sample that falls in a bucket
+//
+// Input	: bucket - the bucket index
+// Output	: the sample value
+
+uint64_t latency_bucket_value(int bucket) {
+
+	if (bucket < 2 * LAT_SUB_COUNT) {
+		return bucket;
+	}
+
+	int octave = (bucket - 2 * LAT_SUB_COUNT) / LAT_SUB_COUNT;
+	uint64_t mantissa = (bucket - 2 * LAT_SUB_COUNT) % LAT_SUB_COUNT + LAT_SUB_COUNT;
+	return mantissa << (octave + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: latency_ns_per_tick
+// Description	: Nanoseconds per clock tick, measured over the run so the TSC
+//		  needs no calibration delay
+//
+// Input	: none
+// Output	: the conversion factor
+
+double latency_ns_per_tick(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec now;
+	uint64_t ticks = cart_latency_now() - latency_start_ticks;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double ns = (now.tv_sec - latency_start_time.tv_sec) * 1e9 + (now.tv_nsec - latency_start_time.tv_nsec);
+	return (ticks == 0) ? 1.0 : ns / ticks;
+#else
+	return 1.0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_latency_record
+// Description	: Add one sample to the histogram of an operation
+//
+// Input	: op - the operation
+//		  ticks - the latency in clock ticks
+// Output	: 0 if successful
+
+int cart_latency_record(CartLatencyOp op, uint64_t ticks) {
+
+	LatencyHistogram *hist = &latency_histograms[op];
+
+	// Note the clock at the first sample for the tick conversion
+	if (latency_start_ticks == 0) {
+		latency_start_ticks = cart_latency_now();
+		clock_gettime(CLOCK_MONOTONIC, &latency_start_time);
+	}
+
+	hist->buckets[latency_bucket(ticks)] += 1;
+	hist->count += 1;
+	hist->total += ticks;
+	if (ticks > hist->max) hist->max = ticks;
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_latency_count
+// Description	: Number of samples recorded for an operation
+//
+// Input	: op - the operation
+// Output	: the sample count
+
+uint64_t cart_latency_count(CartLatencyOp op) {
+	return latency_histograms[op].count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_latency_percentile
+// Description	: Latency at a percentile of an operation, taken at the middle
+//		  of the bucket holding it (never above the largest sample)
+//
+// Input	: op - the operation
+//		  pct - the percentile (0-100)
+// Output	: the latency in microseconds, 0 if nothing recorded
+
+double cart_latency_percentile(CartLatencyOp op, double pct) {
+
+	LatencyHistogram *hist = &latency_histograms[op];
+	uint64_t rank, seen = 0;
+
+	if (hist->count == 0) return 0.0;
+
+	// the sample rank the percentile falls on
+	rank = (uint64_t)(pct / 100.0 * hist->count + 0.5);
+	if (rank < 1) rank = 1;
+
+	for (int i = 0; i < LAT_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= rank) {
+			double mid = (latency_bucket_value(i) + latency_bucket_value(i + 1)) / 2.0;
+			if (mid > hist->max) mid = hist->max;
+			return mid * latency_ns_per_tick() / 1000.0;
+		}
+	}
+
+	return hist->max * latency_ns_per_tick() / 1000.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: cart_latency_report
+// Description	: Log count, mean, p50/p99/p999 and max of every operation
+//		  that has samples
+//
+// Input	: lvl - the log level to write at
+// Output	: 0 if successful
+
+int cart_latency_report(unsigned long lvl) {
+
+	double scale = latency_ns_per_tick() / 1000.0;
+
+	logMessage(lvl, "** Latency (usec) **        count       mean        p50        p99       p999        max");
+	for (int op = 0; op < CART_LAT_MAXVAL; op++) {
+		LatencyHistogram *hist = &latency_histograms[op];
+		if (hist->count == 0) continue;
+
+		logMessage(lvl, "%-20s %12" PRIu64 " %10.2f %10.2f %10.2f %10.2f %10.2f", latency_names[op], hist->count,
+			(double)hist->total / hist->count * scale,
+			cart_latency_percentile(op, 50.0), cart_latency_percentile(op, 99.0),
+			cart_latency_percentile(op, 99.9), hist->max * scale);
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef CART_LATENCY_INCLUDED
+#define CART_LATENCY_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_latency.h
+//  Description    : This is the header file for the latency histograms of the
+//                   CART driver operations and bus opcodes. Recording is only
+//                   compiled in with CART_LATENCY defined ("make LATENCY=1"),
+//                   otherwise every macro below compiles to nothing.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdint.h>
+#include <cart_controller.h>
+
+// Defines
+#define CART_LATENCY_SUB_BITS 5		// 32 sub-buckets per power of two (~3% precision)
+
+typedef enum {
+	CART_LAT_OPEN  = 0,	// cart_open
+	CART_LAT_READ  = 1,	// cart_read
+	CART_LAT_WRITE = 2,	// cart_write
+	CART_LAT_SEEK  = 3,	// cart_seek
+	CART_LAT_CLOSE = 4,	// cart_close
+	CART_LAT_BUS   = 5,	// bus opcodes follow, CART_LAT_BUS + CartOpCodes
+	CART_LAT_MAXVAL = CART_LAT_BUS + CART_OP_MAXVAL
+} CartLatencyOp;
+
+#ifdef CART_LATENCY
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cart_latency_now() __rdtsc()	// TSC ticks, converted at report time
+#else
+#include <time.h>
+static inline uint64_t cart_latency_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+#define CART_LATENCY_START(t) uint64_t t = cart_latency_now()
+#define CART_LATENCY_RECORD(op, t) cart_latency_record(op, cart_latency_now() - (t))
+#define CART_LATENCY_REPORT(lvl) cart_latency_report(lvl)
+
+//
+// Interface functions
+
+int cart_latency_record(CartLatencyOp op, uint64_t ticks);
+	// Add one sample, in clock ticks, to the histogram of an operation
+
+uint64_t cart_latency_count(CartLatencyOp op);
+	// Number of samples recorded for an operation
+
+double cart_latency_percentile(CartLatencyOp op, double pct);
+	// Latency (in microseconds) at the given percentile of an operation
+
+int cart_latency_report(unsigned long lvl);
+	// Log count, mean, p50/p99/p999 and max of every recorded operation
+
+#else
+
+#define CART_LATENCY_START(t)
+#define CART_LATENCY_RECORD(op, t)
+#define CART_LATENCY_REPORT(lvl)
+
+#endif
+
+#endif
@@ -0,0 +1,365 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_mrc.c
+//  Description    : This is the miss-ratio curve tool for sizing the CART
+//                   frame cache. It reads a lookup trace recorded with
+//                   "cart_sim -t <trace>" and reports the miss ratio of every
+//                   replacement policy across cache sizes.
+//
+//                   LRU comes from one Mattson stack-distance pass, exact for
+//                   every size at once. The other policies are replayed
+//                   through the real cache on the in-memory trace. With
+//                   -r the trace is spatially sampled (SHARDS) first, and
+//                   replays use caches scaled down by the same rate.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Include Files
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Project Includes
+#include <cart_controller.h>
+#include <cart_cache.h>
+#include <cmpsc311_log.h>
+#include <cmpsc311_util.h>
+
+// Defines
+#define CART_MRC_ARGUMENTS "hr:m:k:"
+#define CART_MRC_FRAMES (CART_MAX_CARTRIDGES * CART_CARTRIDGE_SIZE)
+#define CART_MRC_HASH_SPACE (1 << 24)	// Sampling hash range (SHARDS threshold space)
+#define CART_MRC_MIN_SIZE 4		// Smallest cache size reported
+#define CART_MRC_MAX_POINTS 64		// Most sizes reported (each 25% larger than the last)
+#define USAGE \
+	"USAGE: cart_mrc [-h] [-r <rate>] [-m <sz>] [-k <pct>] <trace-file>\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"    -r - sample frames at <rate> (0 < rate <= 1, default 1, no sampling)\n" \
+	"    -m - largest cache size to report (default: distinct frames in trace)\n" \
+	"    -k - a size is good enough within <pct> points of the largest size (default 1)\n" \
+	"\n" \
+	"    <trace-file> - lookup trace recorded with cart_sim -t\n" \
+	"\n" \
+
+// One row of the curve
+typedef struct {
+	uint32_t size;					// cache size in frames
+	double miss_ratio[CART_CACHE_POLICIES];		// miss ratio under each policy
+} MissRatioPoint;
+
+//
+// Global Data
+
+const char *policy_names[CART_CACHE_POLICIES] = { "LRU", "LFU", "RANDOM", "2Q" };
+
+//
+// Functional Prototypes
+
+// Read a lookup trace into memory
+uint32_t *load_trace(char *path, uint32_t *length);
+
+// Keep the references whose frame hashes under the sampling threshold
+uint32_t sample_trace(uint32_t *trace, uint32_t length, double rate);
+
+// Build the LRU stack-distance histogram of a trace
+uint32_t lru_stack_distances(uint32_t *trace, uint32_t length, double rate, uint64_t *hist);
+
+// Miss ratio of one policy and size, replayed through the frame cache
+double simulate_policy(ReplacementPolicy policy, uint32_t size, uint32_t *trace, uint32_t length);
+
+//
+// Functions
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the miss-ratio curve tool
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch, points = 0;
+	double rate = 1.0, knee = 1.0;
+	uint32_t max_size = 0, length, sampled, distinct = 0, size;
+	uint32_t *trace;
+	uint64_t *hist, hits;
+	MissRatioPoint curve[CART_MRC_MAX_POINTS];
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_MRC_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		case 'r': // Sampling rate
+			if ( (sscanf(optarg, "%lf", &rate) != 1) || (rate <= 0.0) || (rate > 1.0) ) {
+				fprintf( stderr, "Bad sampling rate [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'm': // Largest size
+			if ( sscanf(optarg, "%u", &max_size) != 1 ) {
+				fprintf( stderr, "Bad cache size [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		case 'k': // Knee tolerance
+			if ( sscanf(optarg, "%lf", &knee) != 1 ) {
+				fprintf( stderr, "Bad tolerance [%s]\n", optarg );
+				return( -1 );
+			}
+			break;
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+
+	// The trace should be the next option
+	if ( optind >= argc ) {
+		fprintf( stderr, "Missing command line parameters, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+	if ( (trace = load_trace(argv[optind], &length)) == NULL ) {
+		return( -1 );
+	}
+
+	// Sample, then take the LRU stack distances in one pass
+	sampled = sample_trace(trace, length, rate);
+	if ( sampled == 0 ) {
+		logMessage( LOG_ERROR_LEVEL, "No references left after sampling trace [%s].", argv[optind] );
+		return( -1 );
+	}
+	hist = calloc(CART_MRC_FRAMES + 1, sizeof(uint64_t));
+	distinct = lru_stack_distances(trace, sampled, rate, hist);
+
+	// Default the largest size to the (scaled) number of distinct frames
+	if ( max_size == 0 ) {
+		max_size = (distinct < CART_MRC_MIN_SIZE) ? CART_MRC_MIN_SIZE : distinct;
+	}
+
+	// Evaluate the sizes, growing 25% a step up to the largest
+	hits = 0;
+	size = CART_MRC_MIN_SIZE;
+	uint32_t d = 0;
+	while ( points < CART_MRC_MAX_POINTS ) {
+
+		// LRU comes straight from the histogram
+		while ( (d < size) && (d < CART_MRC_FRAMES) ) {
+			hits += hist[d++];
+		}
+		curve[points].size = size;
+		curve[points].miss_ratio[LRU] = 1.0 - (double)hits / sampled;
+
+		// The rest are replayed on the sampled trace
+		curve[points].miss_ratio[LFU] = simulate_policy(LFU, size * rate + 0.5, trace, sampled);
+		curve[points].miss_ratio[RANDOM] = simulate_policy(RANDOM, size * rate + 0.5, trace, sampled);
+		curve[points].miss_ratio[TWOQ] = simulate_policy(TWOQ, size * rate + 0.5, trace, sampled);
+		points++;
+
+		if ( size >= max_size ) break;
+		size = (size + size / 4 > max_size) ? max_size : size + size / 4;
+	}
+
+	// Print the curve
+	printf("CART cache miss-ratio curve: %u references (%u sampled at rate %.4f)\n\n",
+		length, sampled, rate);
+	printf("%10s", "size");
+	for (int p = 0; p < CART_CACHE_POLICIES; p++) printf("%10s", policy_names[p]);
+	printf("\n");
+	for (int i = 0; i < points; i++) {
+		printf("%10u", curve[i].size);
+		for (int p = 0; p < CART_CACHE_POLICIES; p++) printf("%9.2f%%", 100.0 * curve[i].miss_ratio[p]);
+		printf("\n");
+	}
+
+	// Best size: the smallest within the tolerance of the largest size
+	printf("\n");
+	for (int p = 0; p < CART_CACHE_POLICIES; p++) {
+		double floor_ratio = curve[points - 1].miss_ratio[p];
+		for (int i = 0; i < points; i++) {
+			if ( 100.0 * (curve[i].miss_ratio[p] - floor_ratio) <= knee ) {
+				printf("%-7s best size %u frames (miss ratio %.2f%%, floor %.2f%%)\n", policy_names[p],
+					curve[i].size, 100.0 * curve[i].miss_ratio[p], 100.0 * floor_ratio);
+				break;
+			}
+		}
+	}
+
+	// Cleanup, return successfully
+	free(hist);
+	free(trace);
+	return( 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : load_trace
+// Description  : Read a lookup trace into memory
+//
+// Inputs       : path - the trace file
+//                length - output, the number of references
+// Outputs      : the references, NULL if failure
+
+uint32_t *load_trace(char *path, uint32_t *length) {
+
+	struct stat stats;
+	uint32_t *trace;
+	FILE *fhandle;
+
+	// Size the buffer from the file
+	if ( (stat(path, &stats) != 0) || (stats.st_size < sizeof(uint32_t)) ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure reading trace [%s], missing or empty.", path );
+		return( NULL );
+	}
+	*length = stats.st_size / sizeof(uint32_t);
+	if ( (trace = malloc(*length * sizeof(uint32_t))) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure allocating trace buffer of %u references.", *length );
+		return( NULL );
+	}
+
+	// Read the references
+	if ( (fhandle = fopen(path, "r")) == NULL ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure opening trace [%s], error: %s.", path, strerror(errno) );
+		free(trace);
+		return( NULL );
+	}
+	if ( fread(trace, sizeof(uint32_t), *length, fhandle) != *length ) {
+		logMessage( LOG_ERROR_LEVEL, "Failure reading trace [%s].", path );
+		fclose(fhandle);
+		free(trace);
+		return( NULL );
+	}
+	fclose(fhandle);
+
+	return( trace );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sample_trace
+// Description  : Keep, in place, the references whose frame hashes under
+//                rate * CART_MRC_HASH_SPACE (SHARDS spatial sampling)
+//
+// Inputs       : trace - the references
+//                length - the number of references
+//                rate - the sampling rate
+// Outputs      : the number of references kept
+
+uint32_t sample_trace(uint32_t *trace, uint32_t length, double rate) {
+
+	uint32_t threshold = rate * CART_MRC_HASH_SPACE;
+	uint32_t kept = 0;
+
+	// Check if sampling is off
+	if ( rate >= 1.0 ) {
+		return( length );
+	}
+
+	for (uint32_t i = 0; i < length; i++) {
+		if ( ((trace[i] * 2654435761u) >> 8) < threshold ) {
+			trace[kept++] = trace[i];
+		}
+	}
+
+	return( kept );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : lru_stack_distances
+// Description  : Build the LRU stack-distance histogram of a trace. A Fenwick
+//                tree over time marks the last use of every frame, so the
+//                distinct frames since the previous use are a prefix sum.
+//
+// Inputs       : trace - the references
+//                length - the number of references
+//                rate - the sampling rate, distances are scaled by 1/rate
+//                hist - output, hit count per (scaled) stack distance
+// Outputs      : the (scaled) number of distinct frames in the trace
+
+uint32_t lru_stack_distances(uint32_t *trace, uint32_t length, double rate, uint64_t *hist) {
+
+	uint32_t distinct = 0;
+	uint32_t *last = calloc(CART_MRC_FRAMES, sizeof(uint32_t));	// last use (1-based time) per frame
+	int32_t *tree = calloc(length + 1, sizeof(int32_t));		// Fenwick tree of last-use markers
+
+	for (uint32_t t = 1; t <= length; t++) {
+		uint32_t frame = (trace[t - 1] >> 16) * CART_CARTRIDGE_SIZE + (trace[t - 1] & 0xffff);
+		uint32_t prev = last[frame];
+
+		if ( prev != 0 ) {
+
+			// distinct frames used in (prev, t)
+			int32_t distance = 0;
+			for (uint32_t i = t - 1; i > 0; i -= i & -i) distance += tree[i];
+			for (uint32_t i = prev; i > 0; i -= i & -i) distance -= tree[i];
+
+			// scale to the full trace and record the reuse
+			uint32_t scaled = distance / rate;
+			hist[(scaled < CART_MRC_FRAMES) ? scaled : CART_MRC_FRAMES] += 1;
+
+			// the frame's marker moves to now
+			for (uint32_t i = prev; i <= length; i += i & -i) tree[i] -= 1;
+		} else {
+			distinct++;
+		}
+		for (uint32_t i = t; i <= length; i += i & -i) tree[i] += 1;
+		last[frame] = t;
+	}
+
+	free(tree);
+	free(last);
+	return( distinct / rate );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_policy
+// Description  : Replay a trace through the frame cache and measure misses
+//
+// Inputs       : policy - the replacement policy
+//                size - the cache size in frames
+//                trace - the references
+//                length - the number of references
+// Outputs      : the miss ratio
+
+double simulate_policy(ReplacementPolicy policy, uint32_t size, uint32_t *trace, uint32_t length) {
+
+	static char frame[CART_FRAME_SIZE];
+	CartCacheStats stats;
+
+	set_replacement_policy(policy);
+	set_cart_cache_size((size == 0) ? 1 : size);
+	init_cart_cache();
+
+	// a miss brings the frame in, as the driver does
+	for (uint32_t i = 0; i < length; i++) {
+		if ( get_cart_cache(trace[i] >> 16, trace[i] & 0xffff) == NULL ) {
+			put_cart_cache(trace[i] >> 16, trace[i] & 0xffff, frame);
+		}
+	}
+
+	get_cart_cache_stats(&stats);
+	close_cart_cache();
+
+	return( (double)stats.misses / length );
+}
@@ -20,11 +20,25 @@
 #define CART_NET_HEADER_SIZE sizeof(CartXferRegister)
 #define CART_DEFAULT_IP "127.0.0.1"
 #define CART_DEFAULT_PORT 21785
+#define CART_MAX_DRIVES 8	// Most drives (servers) the client talks to
+
+// Packed frames (ky2 of the register). The client asks with CART_CAP_PACKED
+// in INITMS and packs only if the reply carries CART_CAP_PACKED_ACK, which a
+// server that just echoes ky2 never sets. A frame sent or returned with
+// CART_XFER_PACKED is a two byte (network order) length and that many bytes.
+#define CART_CAP_PACKED      0x01
+#define CART_CAP_PACKED_ACK  0x02
+#define CART_XFER_PACKED     0x80
 
 // Global data
 extern int            cart_network_shutdown; // Flag indicating shutdown
 extern unsigned char *cart_network_address;  // Address of CART server
 extern unsigned short cart_network_port;     // Port of CART server
+extern uint64_t       cart_network_ops[CART_OP_MAXVAL]; // Requests sent, per opcode
+extern uint64_t       cart_network_bytes;    // Bytes sent and received
+extern int            cart_network_compress; // Ask the server for packed frames
+extern int            cart_network_packed;   // Server agreed to packed frames
+extern int            cart_network_drives;   // Drives, one server each on consecutive ports
 
 //
 // Functional Prototypes
@@ -32,6 +46,10 @@ extern unsigned short cart_network_port;     // Port of CART server
 CartXferRegister client_cart_bus_request(CartXferRegister reg, void *buf);
 	// This is the implementation of the client operation (cart_client.c)
 
+CartXferRegister client_drive_request(int drive, CartXferRegister reg, void *buf);
+	// Send a request to one drive, cartridge c lives on drive c % cart_network_drives
+	// (requests to different drives may run in parallel threads)
+
 int cart_server( void );
 	// This is the implementation of the server application (cart_server.c)
 
@@ -10,6 +10,8 @@
 
 // Include Files
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
@@ -20,30 +22,51 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
 
 // Project Includes
 #include <cart_driver.h>
 #include <cart_cache.h>
+#include <cart_latency.h>
+#include <cart_workload.h>
+#include <cart_timing.h>
 #include <cart_network.h>
+#include <cart_codec.h>
 #include <cmpsc311_log.h>
 #include <cmpsc311_util.h>
 
 // Defines
 #define CART_WORKLOAD_DIR "workload"
-#define CART_SIM_MAX_OPEN_FILES 128
-#define CART_ARGUMENTS "huvl:c:i:p:"
+#define CART_SIM_MAX_OPEN_FILES CART_WORKLOAD_MAX_FILES
+#define CART_SIM_MAX_VALIDATORS 8
+#define CART_SIM_VALIDATE_CHUNK (64 * 1024)
+#define CART_ARGUMENTS "huvndmxzCF:l:c:i:p:s:t:j:k:"
 #define USAGE \
-	"USAGE: cart_sim [-h] [-v] [-l <logfile>] [-c <sz>] <workload-file>\n" \
+	"USAGE: cart_sim [-h] [-v] [-n] [-d] [-m] [-x] [-z] [-C] [-F <cart>] [-l <logfile>] [-c <sz>] [-s <n>] [-t <trace>] [-j <clients>] [-k <drives>] [--lru|--lfu|--random|--twoq] <workload-file>\n" \
 	"\n" \
 	"where:\n" \
 	"    -h - help mode (display this message)\n" \
 	"    -v - verbose output\n" \
+	"    -n - do not write the .cmm backups of validated files\n" \
+	"    -d - deduplicate frames with identical contents\n" \
+	"    -m - mirror every frame onto a second cartridge\n" \
+	"    -x - keep XOR parity over each group of 8 cartridges\n" \
+	"    -z - ask the server for packed (compressed) frames\n" \
+	"    -C - compact the files onto as few cartridges as possible before validating\n" \
+	"    -F - fail cartridge <cart> after the workload, so validation reads it from the copies\n" \
 	"    -l - write log messages to the filename <logfile>\n" \
 	"    -c - set the cart block cache to size <sz> (disabled for assign #2)\n" \
 	"    -i - IP address of server to connect to.\n" \
 	"    -p - port number of server to connect to.\n" \
+	"    -k - spread the cartridges over <drives> servers, on the port and the ones after it\n" \
+	"    -s - log cache statistics every <n> cache lookups (with -v)\n" \
+	"    -t - record the cache lookup trace to <trace> (see cart_mrc)\n" \
+	"    -j - replay with <clients> threads sharing the session, files split among them\n" \
+	"    --lru, --lfu, --random, --twoq - cache replacement policy (default LRU)\n" \
 	"\n" \
-	"    <workload-file> - file contain the workload to simulate\n" \
+	"    <workload-file> - file contain the workload to simulate (text, or compiled by cart_wlc)\n" \
 	"\n" \
 
 // This is the file table
@@ -52,15 +75,51 @@ typedef struct {
 	int16_t   fhandle;   // This is a file handle for the opened file
 } CartSimulationTable;
 
+// This is the shared state of the validators
+typedef struct {
+	CartSimulationTable *ftable;   // The file table
+	int                  next;     // Next file table entry to claim
+	int                  failed;   // Set if any file failed
+	pthread_mutex_t      lock;     // Protects next
+} CartValidation;
+
+// This is one client of the parallel replay (-j)
+typedef struct {
+	int                  id;        // Client number, owns file ids with owner[file] == id
+	int                 *owner;     // Client owning each file id
+	CartWorkloadCommand *cmds;      // The parsed workload, shared by all clients
+	uint32_t             commands;  // Number of commands in the workload
+	CartWorkload        *workload;  // The workload, for file names
+	CartSimulationTable *ftable;    // The shared file table
+	uint32_t             ops;       // Commands this client executed
+	uint64_t             bytes;     // Bytes this client read and wrote
+	double              *latency;   // Latency of each command (usec)
+	double               seconds;   // Wall time of this client
+	int                  failed;    // Set if a command failed
+} CartSimClient;
+
 //
 // Global Data
 int verbose;
+int sim_backup = 1;                                         // Write .cmm backups when validating
+int sim_compact = 0;                                        // Compact the files before validating
+int sim_failed_cart = -1;                                   // Cartridge to fail before validating (-F), -1 if none
+int sim_clients = 1;                                        // Clients replaying in parallel (-j)
+pthread_mutex_t sim_driver_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes the clients' driver calls
 
 //
 // Functional Prototypes
 
 int simulate_CART( char *wload );             // control loop of the CART simulation
+int execute_command( CartWorkload *workload, CartSimulationTable *ftable, CartWorkloadCommand *cmd,
+		char **rbuf, int32_t *rbuf_size );    // execute one workload command
+int simulate_CART_clients( CartWorkload *workload, CartSimulationTable *ftable ); // parallel replay
+void * simulate_client( void *arg );          // thread body of one client
+void report_sim_clients( CartSimClient *clients, int count, double wall ); // client report
+int validate_files( CartSimulationTable *ftable ); // Validate all files, in parallel
+void * validate_worker( void *arg );          // thread body of a validator
 int validate_file(char *fname, int16_t mfh);  // Validate a file in the filesystem
+void sim_log( unsigned long lvl, const char *fmt, ... ); // log from any thread
 
 //
 // Functions
@@ -78,12 +137,31 @@ int main( int argc, char *argv[] ) {
 
 	// Local variables
 	int ch, verbose = 0, log_initialized = 0, unit_tests = 0;
-	uint32_t cache_size = 0;
+	uint32_t cache_size = 0, stats_interval = 0;
+	ReplacementPolicy replacement_policy = LRU;
+	struct option long_option[] = 
+	{
+		{"lru", no_argument, (int *)&replacement_policy, LRU},
+		{"lfu", no_argument, (int *)&replacement_policy, LFU},
+		{"random", no_argument, (int *)&replacement_policy, RANDOM},
+		{"twoq", no_argument, (int *)&replacement_policy, TWOQ},
+		{0,0,0,0}
+	};
+	int policy_set = 0; // A flag indicate if the policy is set
 
 	// Process the command line parameters
-	while ((ch = getopt(argc, argv, CART_ARGUMENTS)) != -1) {
+	while ((ch = getopt_long(argc, argv, CART_ARGUMENTS, long_option, NULL)) != -1) {
 
 		switch (ch) {
+		case 0: // Replacement policy
+			if (policy_set){
+				fprintf( stderr, "Cannot have more than one replacement policy, aborting.\n" );
+				return( -1 );
+			}
+			set_replacement_policy(replacement_policy);
+			policy_set = 1;
+			break;
+
 		case 'h': // Help, print usage
 			fprintf( stderr, USAGE );
 			return( -1 );
@@ -92,6 +170,43 @@ int main( int argc, char *argv[] ) {
 			verbose = 1;
 			break;
 
+		case 'n': // No backup files
+			sim_backup = 0;
+			break;
+
+		case 'd': // Deduplicate frames
+			cart_setDedup(1);
+			break;
+
+		case 'm': // Mirror frames
+			if ( cart_setMirror(1) == -1 ) {
+				fprintf( stderr, "Cannot have both mirrors (-m) and parity (-x), aborting.\n" );
+				return( -1 );
+			}
+			break;
+
+		case 'x': // Parity over cartridge groups
+			if ( cart_setParity(1) == -1 ) {
+				fprintf( stderr, "Cannot have both mirrors (-m) and parity (-x), aborting.\n" );
+				return( -1 );
+			}
+			break;
+
+		case 'F': // Fail a cartridge before validating
+			if ( (sscanf( optarg, "%d", &sim_failed_cart ) != 1) || (sim_failed_cart < 0) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad cartridge [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 'C': // Compact before validating
+			sim_compact = 1;
+			break;
+
+		case 'z': // Packed frames, if the server agrees
+			cart_network_compress = 1;
+			break;
+
 		case 'u': // Unit test Flag
 			unit_tests = 1;
 			break;
@@ -107,6 +222,27 @@ int main( int argc, char *argv[] ) {
 			}
 			break;
 
+		case 's': // Set the cache statistics interval
+			if ( sscanf( optarg, "%u", &stats_interval ) != 1 ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad statistics interval [%s]", optarg );
+			    return( -1 );
+			}
+			set_cart_cache_stats_interval(stats_interval);
+			break;
+
+		case 'j': // Number of parallel clients
+			if ( (sscanf( optarg, "%d", &sim_clients ) != 1) || (sim_clients < 1) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad client count [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
+		case 't': // Record the cache lookup trace
+			if ( set_cart_cache_trace(optarg) != 0 ) {
+			    return( -1 );
+			}
+			break;
+
         case 'i': // Get the IP address
             if (inet_addr(optarg) == INADDR_NONE) {
 			    logMessage( LOG_ERROR_LEVEL, "Bad IP address [%s]", argv[optind] );
@@ -115,6 +251,14 @@ int main( int argc, char *argv[] ) {
             cart_network_address = (unsigned char *)strdup(optarg);
 			break;
 
+		case 'k': // Number of drives
+			if ( (sscanf( optarg, "%d", &cart_network_drives ) != 1) ||
+				(cart_network_drives < 1) || (cart_network_drives > CART_MAX_DRIVES) ) {
+			    logMessage( LOG_ERROR_LEVEL, "Bad drive count [%s]", optarg );
+			    return( -1 );
+			}
+			break;
+
         case 'p': // Set the network port number
 			if ( sscanf(optarg, "%hu", &cart_network_port) != 1 ) {
 			    logMessage( LOG_ERROR_LEVEL, "Bad  port number [%s]", argv[optind] );
@@ -147,7 +291,8 @@ int main( int argc, char *argv[] ) {
 		// Run the unit tests
 		enableLogLevels( LOG_INFO_LEVEL );
 		logMessage(LOG_INFO_LEVEL, "Running unit tests ....\n\n");
-		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) ) {
+		if ( (cartCacheUnitTest() == 0) && (cartCacheUnitTest() == 0) && (cartCodecUnitTest() == 0) &&
+			(cartDriverUnitTest() == 0) ) {
 			logMessage(LOG_INFO_LEVEL, "Unit tests completed successfully.\n\n");
 		} else {
 			logMessage(LOG_ERROR_LEVEL, "Unit tests failed, aborting.\n\n");
@@ -170,6 +315,12 @@ int main( int argc, char *argv[] ) {
 		} else {
 			logMessage( LOG_INFO_LEVEL, "CART simulation failed.\n\n" );
 		}
+
+		// Report how the frame cache did, finish any trace
+		log_cart_cache_stats( LOG_OUTPUT_LEVEL );
+		log_cart_driver_stats( LOG_OUTPUT_LEVEL );
+		set_cart_cache_trace( NULL );
+		CART_LATENCY_REPORT( LOG_OUTPUT_LEVEL );
 	}
 
 	// Return successfully
@@ -188,212 +339,480 @@ int main( int argc, char *argv[] ) {
 int simulate_CART( char *wload ) {
 
 	// Local variables
-	char line[1024], fname[128], command[128], text[1025], *sep, *rbuf;
-	FILE *fhandle = NULL;
-	int32_t err=0, len, off, fields, linecount;
+	char *rbuf = NULL;
+	int32_t rbuf_size = 0;
+	CartWorkload workload;
+	CartWorkloadCommand cmd;
 	CartSimulationTable ftable[CART_SIM_MAX_OPEN_FILES];
-	int idx, i;
+	int ret;
 
-	// Setup the file table
+	// Setup the file table, indexed by the workload's file ids
 	memset(ftable, 0x0, sizeof(CartSimulationTable)*CART_SIM_MAX_OPEN_FILES);
 
-	// Open the workload file
-	linecount = 0;
-	if ( (fhandle=fopen(wload, "r")) == NULL ) {
-		logMessage( LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n",
-			wload, strerror(errno) );
+	// Map the workload file
+	if ( open_cart_workload(&workload, wload) == -1 ) {
 		return( -1 );
 	}
 
 	// Startup the interface
 	if (cart_poweron() == -1) {
 		logMessage( LOG_ERROR_LEVEL, "CART simulator failed initialization.");
-		fclose( fhandle );
+		close_cart_workload( &workload );
 		return( -1 );
 	}
 	logMessage(CartSimulatorLLevel, "CART simulator initialization complete.");
 
-	// While file not done
-	while (!feof(fhandle)) {
-
-		// Get the line and bail out on fail
-		if (fgets(line, 1024, fhandle) != NULL) {
-
-			// Parse out the string
-			linecount ++;
-			fields = sscanf(line, "%s %s %d %d", fname, command, &len, &off);
-			sep = strchr(line, ':');
-			if ( (fields != 4) || (sep == NULL) ) {
-				logMessage( LOG_ERROR_LEVEL, "CART un-parsable workload string, aborting [%s], line %d",
-						line, linecount );
-				fclose( fhandle );
-				return( -1 );
-			}
+	if ( sim_clients > 1 ) {
 
-			// Just log the contents
-			logMessage(CartSimulatorLLevel, "File [%s], command [%s], len=%d, offset=%d",
-					fname, command, len, off);
-
-			// Now walk the the table looking for the file
-			idx = -1;
-			i = 0;
-			while ( (i < CART_SIM_MAX_OPEN_FILES) && (idx == -1) ) {
-				if ( (ftable[i].filename != NULL) && (strcmp(ftable[i].filename,fname) == 0) ) {
-					idx = i;
-				}
-				i++;
-			}
+		// Replay the files across the clients
+		ret = simulate_CART_clients(&workload, ftable);
 
-			// File is not found, open the file
-			if (idx == -1) {
-
-				// Log message, find unused index and save filename for later use
-				logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
-				idx = 0;
-				while ((ftable[idx].filename != NULL) && (idx < CART_SIM_MAX_OPEN_FILES)) {
-					idx++;
-				}
-				CMPSC_ASSERT1(idx<CART_SIM_MAX_OPEN_FILES, "Too many open files on CART sim [%d]", idx);
-				ftable[idx].filename = strdup(fname);
-
-				// Now perform the open
-				ftable[idx].fhandle = cart_open(ftable[idx].filename);
-				if (ftable[idx].fhandle == -1) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
-					return(-1);
-				}
+	} else {
 
+		// While there are commands in the workload, a failed one ends the replay
+		while ( (ret = next_cart_workload(&workload, &cmd)) == 1 ) {
+			if ( execute_command(&workload, ftable, &cmd, &rbuf, &rbuf_size) == -1 ) {
+				ret = -1;
+				break;
 			}
+		}
+		free(rbuf);
+	}
 
-			// Now execute the specific command
-			if (strncmp(command, "WRITEAT", 7) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes at position %d from file [%s]", len, off, fname);
-
-				// First perform the seek
-				if (cart_seek(ftable[idx].fhandle, off)) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
-
-
-			} else if (strncmp(command, "WRITE", 5) == 0) {
-
-				// Now see if we need more data to fill, terminate the lines
-				CMPSC_ASSERT1(len<1024, "Simulated workload command text too large [%d]", len);
-				CMPSC_ASSERT2((strlen(sep+1)>=len), "Workload str [%d<%d]", strlen(sep+1), len);
-				strncpy(text, sep+1, len);
-				text[len] = 0x0;
-				for (i=0; i<strlen(text); i++) {
-					if (text[i] == '^') {
-						text[i] = '\n';
-					}
-				}
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes to file [%s]", len, fname);
-
-				// Now perform the write
-				if (cart_write(ftable[idx].fhandle, text, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, len);
-					return(-1);
-				}
-
-
-			} else if (strncmp(command, "SEEK", 4) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Seeking to position %d in file [%s]", off, fname);
-
-				// Now perform the seek
-				if (cart_seek(ftable[idx].fhandle, off) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-
-			} else if (strncmp(command, "READ", 4) == 0) {
-
-				// Log the command executed
-				logMessage(CartSimulatorLLevel, "CART_SIM : Reading %d bytes from file [%s]", len, fname);
-
-				// Now perform the read
-				rbuf = malloc(len);
-				if (cart_read(ftable[idx].fhandle, rbuf, len) != len) {
-					// Failed, error out
-					logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, off);
-					return(-1);
-				}
-				free(rbuf);
-				rbuf = NULL;
-
-			} else {
-
-				// Bomb out, don't understand the command
-				CMPSC_ASSERT1(0, "CART_SIM : Failed, unknown command [%s]", command);
+	// Check for the workload failing
+	if ( ret == -1 ) {
+		logMessage( LOG_ERROR_LEVEL, "CART workload [%s] failed, aborting", wload );
+		close_cart_workload( &workload );
+		return( -1 );
+	}
 
-			}
-		}
+	// Lose a cartridge, the files must still read back
+	if ( (sim_failed_cart != -1) && (cart_fail_cartridge(sim_failed_cart) == -1) ) {
+		close_cart_workload( &workload );
+		return( -1 );
+	}
 
-		// Check for the virtual level failing
-		if ( err ) {
-			logMessage( LOG_ERROR_LEVEL, "CRUS system failed, aborting [%d]", err );
-			fclose( fhandle );
+	// Gather the files up for the sequential validation reads
+	if ( sim_compact ) {
+		if ( (ret = cart_compact()) == -1 ) {
+			logMessage( LOG_ERROR_LEVEL, "CART compaction failed, aborting" );
+			close_cart_workload( &workload );
 			return( -1 );
 		}
+		logMessage( LOG_OUTPUT_LEVEL, "CART compaction moved %d frames.", ret );
 	}
 
-	// Now walk the the table of files to validate
-	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
-		if (ftable[i].filename != NULL) {
-			if (validate_file(ftable[i].filename, ftable[i].fhandle) != 0) {
-				logMessage(LOG_ERROR_LEVEL, "CART Validation failed on file [%s].", ftable[i].filename,fname);
-				fclose( fhandle );
-				return(-1);
-			}
-		}		
+	// Now validate the files against their sources
+	if (validate_files(ftable) != 0) {
+		close_cart_workload( &workload );
+		return(-1);
 	}
 
 	// Shut down the interface
 	if (cart_poweroff() == -1) {
 		logMessage( LOG_ERROR_LEVEL, "CART simulator failed shutdown.");
-		fclose( fhandle );
+		close_cart_workload( &workload );
 		return( -1 );
 	}
 	logMessage(CartSimulatorLLevel, "CART simulator shutdown complete.");
 	logMessage(LOG_OUTPUT_LEVEL, "CART simulation: all tests successful!!!.");
 
 	// Close the workload file, successfully
-	fclose( fhandle );
+	close_cart_workload( &workload );
 	return( 0 );
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : execute_command
+// Description  : Execute one workload command against the driver, opening
+//                the file on first use
+//
+// Inputs       : workload - the workload (for file names)
+//                ftable - the file table, indexed by file id
+//                cmd - the command
+//                rbuf - the read buffer, grown as needed and reused
+//                rbuf_size - the size of the read buffer
+// Outputs      : 0 if successful, -1 if failure
+
+int execute_command( CartWorkload *workload, CartSimulationTable *ftable, CartWorkloadCommand *cmd,
+		char **rbuf, int32_t *rbuf_size ) {
+
+	// Just log the contents
+	char *fname = workload->names[cmd->file];
+	logMessage(CartSimulatorLLevel, "File [%s], command [%d], len=%d, offset=%d",
+			fname, cmd->op, cmd->len, cmd->off);
+
+	// File is not open yet, open the file
+	if (ftable[cmd->file].filename == NULL) {
+
+		// Log message, save filename for later use
+		logMessage(CartSimulatorLLevel, "CART_SIM : Opening file [%s]", fname);
+		ftable[cmd->file].filename = fname;
+
+		// Now perform the open
+		ftable[cmd->file].fhandle = cart_open(fname);
+		if (ftable[cmd->file].fhandle == -1) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Open of new file [%s] failed, aborting simulation.", fname);
+			return(-1);
+		}
+
+	}
+
+	// Now execute the specific command
+	switch (cmd->op) {
+	case CART_WL_WRITEAT:
+
+		// Log the command executed
+		logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes at position %d from file [%s]", cmd->len, cmd->off, fname);
+
+		// First perform the seek
+		if (cart_seek(ftable[cmd->file].fhandle, cmd->off)) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Seek/WriteAt file [%s] to position %d failed, aborting simulation.", fname, cmd->off);
+			return(-1);
+		}
+
+		// Now perform the write, straight from the workload
+		if (cart_write(ftable[cmd->file].fhandle, cmd->data, cmd->len) != cmd->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "WriteAt of file [%s], length %d failed, aborting simulation.", fname, cmd->len);
+			return(-1);
+		}
+		break;
+
+	case CART_WL_WRITE:
+
+		// Log the command executed
+		logMessage(CartSimulatorLLevel, "CART_SIM : Writing %d bytes to file [%s]", cmd->len, fname);
+
+		// Now perform the write, straight from the workload
+		if (cart_write(ftable[cmd->file].fhandle, cmd->data, cmd->len) != cmd->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Write of file [%s], length %d failed, aborting simulation.", fname, cmd->len);
+			return(-1);
+		}
+		break;
+
+	case CART_WL_SEEK:
+
+		// Log the command executed
+		logMessage(CartSimulatorLLevel, "CART_SIM : Seeking to position %d in file [%s]", cmd->off, fname);
+
+		// Now perform the seek
+		if (cart_seek(ftable[cmd->file].fhandle, cmd->off) != cmd->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Seek in file [%s] to position %d failed, aborting simulation.", fname, cmd->off);
+			return(-1);
+		}
+		break;
+
+	case CART_WL_READ:
+
+		// Log the command executed
+		logMessage(CartSimulatorLLevel, "CART_SIM : Reading %d bytes from file [%s]", cmd->len, fname);
+
+		// Grow the read buffer as needed, it is reused across reads
+		if (cmd->len > *rbuf_size) {
+			*rbuf = realloc(*rbuf, cmd->len);
+			*rbuf_size = cmd->len;
+		}
+
+		// Now perform the read
+		if (cart_read(ftable[cmd->file].fhandle, *rbuf, cmd->len) != cmd->len) {
+			// Failed, error out
+			logMessage(LOG_ERROR_LEVEL, "Read file [%s] of length %d failed, aborting simulation.", fname, cmd->off);
+			return(-1);
+		}
+		break;
+	}
+
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_CART_clients
+// Description  : Replay the workload with sim_clients threads sharing the
+//                driver's session. Each file belongs to one client, files
+//                are dealt out largest first to the least loaded client,
+//                and commands of one file stay in workload order. The driver holds a single server session,
+//                so calls are serialized by a lock and the latency of a
+//                command includes the wait for it.
+//
+// Inputs       : workload - the opened workload
+//                ftable - the file table, indexed by file id
+// Outputs      : 0 if successful, -1 if failure
+
+int simulate_CART_clients( CartWorkload *workload, CartSimulationTable *ftable ) {
+
+	// Local variables
+	CartWorkloadCommand *cmds = NULL;
+	uint32_t commands = 0, max_commands = 0;
+	CartSimClient *clients;
+	pthread_t *threads;
+	uint32_t file_ops[CART_SIM_MAX_OPEN_FILES] = { 0 }, client_ops[sim_clients], f;
+	int owner[CART_SIM_MAX_OPEN_FILES], best, ret, i;
+	double start, wall;
+
+	// Parse the whole workload first, the reader is not shared
+	while (1) {
+		if (commands == max_commands) {
+			max_commands = (max_commands == 0) ? 4096 : max_commands * 2;
+			cmds = realloc(cmds, max_commands * sizeof(CartWorkloadCommand));
+		}
+		if ( (ret = next_cart_workload(workload, &cmds[commands])) != 1 ) {
+			break;
+		}
+		commands++;
+	}
+	if ( ret == -1 ) {
+		free(cmds);
+		return( -1 );
+	}
+
+	// Deal the files out, busiest first, to the least loaded client
+	for (f = 0; f < commands; f++) {
+		file_ops[cmds[f].file]++;
+	}
+	memset(client_ops, 0x0, sizeof(client_ops));
+	memset(owner, 0xff, sizeof(owner));
+	while (1) {
+		int busiest = -1;
+		for (i = 0; i < (int)workload->files; i++) {
+			if ( owner[i] == -1 && (busiest == -1 || file_ops[i] > file_ops[busiest]) ) {
+				busiest = i;
+			}
+		}
+		if ( busiest == -1 ) {
+			break;
+		}
+		for (i = 1, best = 0; i < sim_clients; i++) {
+			if ( client_ops[i] < client_ops[best] ) {
+				best = i;
+			}
+		}
+		owner[busiest] = best;
+		client_ops[best] += file_ops[busiest];
+	}
+
+	// Start the clients
+	clients = calloc(sim_clients, sizeof(CartSimClient));
+	threads = calloc(sim_clients, sizeof(pthread_t));
+	start = cart_now();
+	for (i = 0; i < sim_clients; i++) {
+		clients[i].id = i;
+		clients[i].owner = owner;
+		clients[i].cmds = cmds;
+		clients[i].commands = commands;
+		clients[i].workload = workload;
+		clients[i].ftable = ftable;
+		clients[i].latency = malloc(((commands > 0) ? commands : 1) * sizeof(double));
+		if ( pthread_create(&threads[i], NULL, simulate_client, &clients[i]) != 0 ) {
+			logMessage( LOG_ERROR_LEVEL, "CART simulator failed to start client %d.", i );
+			clients[i].failed = 1;
+			threads[i] = 0;
+		}
+	}
+
+	// Wait for them all and report
+	ret = 0;
+	for (i = 0; i < sim_clients; i++) {
+		if ( threads[i] != 0 ) {
+			pthread_join(threads[i], NULL);
+		}
+		if ( clients[i].failed ) {
+			ret = -1;
+		}
+	}
+	wall = cart_now() - start;
+	report_sim_clients(clients, sim_clients, wall);
+
+	for (i = 0; i < sim_clients; i++) {
+		free(clients[i].latency);
+	}
+	free(clients);
+	free(threads);
+	free(cmds);
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : simulate_client
+// Description  : Thread body of one simulated client
+//
+// Inputs       : arg - the client (CartSimClient)
+// Outputs      : NULL
+
+void * simulate_client( void *arg ) {
+
+	CartSimClient *client = arg;
+	char *rbuf = NULL;
+	int32_t rbuf_size = 0;
+	double start = cart_now(), issued;
+	uint32_t i;
+
+	for (i = 0; i < client->commands; i++) {
+		CartWorkloadCommand *cmd = &client->cmds[i];
+		if ( client->owner[cmd->file] != client->id ) {
+			continue;
+		}
+
+		// Time from issue to completion, waiting for the driver included
+		issued = cart_now();
+		pthread_mutex_lock(&sim_driver_lock);
+		if ( execute_command(client->workload, client->ftable, cmd, &rbuf, &rbuf_size) == -1 ) {
+			client->failed = 1;
+		}
+		pthread_mutex_unlock(&sim_driver_lock);
+		if ( client->failed ) {
+			break;
+		}
+		client->latency[client->ops++] = (cart_now() - issued) * 1e6;
+		if ( cmd->op != CART_WL_SEEK ) {
+			client->bytes += cmd->len;
+		}
+	}
+
+	client->seconds = cart_now() - start;
+	free(rbuf);
+	return( NULL );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : report_sim_clients
+// Description  : Log throughput and latency per client and in aggregate
+//
+// Inputs       : clients - the finished clients
+//                count - number of clients
+//                wall - wall time of the whole replay
+// Outputs      : none
+
+void report_sim_clients( CartSimClient *clients, int count, double wall ) {
+
+	double *all;
+	uint32_t total = 0, n;
+	uint64_t bytes = 0;
+	int i;
+
+	logMessage(LOG_OUTPUT_LEVEL, "** Clients **       ops      ops/s       KB/s   mean(us)    p50(us)    p99(us)    max(us)");
+	for (i = 0; i < count; i++) {
+		n = clients[i].ops;
+		qsort(clients[i].latency, n, sizeof(double), cart_compare_samples);
+		logMessage(LOG_OUTPUT_LEVEL, "client %-6d %10u %10.1f %10.1f %10.2f %10.2f %10.2f %10.2f", i, n,
+			(clients[i].seconds > 0) ? n / clients[i].seconds : 0.0,
+			(clients[i].seconds > 0) ? clients[i].bytes / clients[i].seconds / 1024 : 0.0,
+			cart_samples_mean(clients[i].latency, n), cart_samples_percentile(clients[i].latency, n, 50.0),
+			cart_samples_percentile(clients[i].latency, n, 99.0), cart_samples_percentile(clients[i].latency, n, 100.0));
+		total += n;
+		bytes += clients[i].bytes;
+	}
+
+	// Aggregate over every command of every client
+	all = malloc(((total > 0) ? total : 1) * sizeof(double));
+	for (i = 0, n = 0; i < count; i++) {
+		memcpy(&all[n], clients[i].latency, clients[i].ops * sizeof(double));
+		n += clients[i].ops;
+	}
+	qsort(all, total, sizeof(double), cart_compare_samples);
+	logMessage(LOG_OUTPUT_LEVEL, "all %-9d %10u %10.1f %10.1f %10.2f %10.2f %10.2f %10.2f", count, total,
+		(wall > 0) ? total / wall : 0.0, (wall > 0) ? bytes / wall / 1024 : 0.0,
+		cart_samples_mean(all, total), cart_samples_percentile(all, total, 50.0),
+		cart_samples_percentile(all, total, 99.0), cart_samples_percentile(all, total, 100.0));
+	free(all);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_files
+// Description  : Validate every file of the simulation, spread over up to
+//                CART_SIM_MAX_VALIDATORS threads. Source reads and compares
+//                run in parallel; driver calls take the driver lock.
+//
+// Inputs       : ftable - the file table
+// Outputs      : 0 if all files are valid, -1 if failure
+
+int validate_files( CartSimulationTable *ftable ) {
+
+	// Local variables
+	CartValidation validation = { ftable, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+	pthread_t threads[CART_SIM_MAX_VALIDATORS];
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int files = 0, workers, started = 0, i;
+
+	for (i=0; i<CART_SIM_MAX_OPEN_FILES; i++) {
+		if (ftable[i].filename != NULL) {
+			files++;
+		}
+	}
+
+	// One worker per file, bounded by the processors and the limit
+	workers = files;
+	if ( workers > cpus && cpus > 0 ) workers = cpus;
+	if ( workers > CART_SIM_MAX_VALIDATORS ) workers = CART_SIM_MAX_VALIDATORS;
+
+	for (i=0; i<workers; i++) {
+		if ( pthread_create(&threads[started], NULL, validate_worker, &validation) == 0 ) {
+			started++;
+		}
+	}
+
+	// Validate on this thread too if no worker could be started
+	if ( started == 0 && files > 0 ) {
+		validate_worker(&validation);
+	}
+	for (i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	return( validation.failed ? -1 : 0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : validate_worker
+// Description  : Thread body of a validator, takes files off the table until
+//                none are left
+//
+// Inputs       : arg - the validation (CartValidation)
+// Outputs      : NULL
+
+void * validate_worker( void *arg ) {
+
+	CartValidation *validation = arg;
+	int idx;
+
+	while (1) {
+
+		// Claim the next file
+		pthread_mutex_lock(&validation->lock);
+		while ( validation->next < CART_SIM_MAX_OPEN_FILES && validation->ftable[validation->next].filename == NULL ) {
+			validation->next++;
+		}
+		idx = validation->next++;
+		pthread_mutex_unlock(&validation->lock);
+
+		if ( idx >= CART_SIM_MAX_OPEN_FILES ) {
+			break;
+		}
+		if (validate_file(validation->ftable[idx].filename, validation->ftable[idx].fhandle) != 0) {
+			sim_log(LOG_ERROR_LEVEL, "CART Validation failed on file [%s].", validation->ftable[idx].filename);
+			validation->failed = 1;
+		}
+	}
+
+	return( NULL );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // Function     : validate_file
-// Description  : Vadliate a file in the filesystem
+// Description  : Vadliate a file in the filesystem, streaming the source file
+//                and the CART file side by side in chunks. The .cmm backup is
+//                written from the same chunks unless disabled (-n).
 //
 // Inputs       : fname - the name of the file to validate
 //                mfh - the memory file handle
@@ -403,72 +822,119 @@ int validate_file(char *fname, int16_t mfh) {
 
 	// Local variables
 	char filename[256], bkfile[256], *filbuf, *membuf;
-	struct stat stats;
-	int idx, fh;
+	int32_t got, ret, seek;
+	off_t length = 0;
+	int idx, fh, bkfh = -1;
 
-	// First figure out how big the file is, setup buffer
+	// Setup the chunk buffers and open the source
 	snprintf(filename, 256, "%s/%s", CART_WORKLOAD_DIR, fname);
-	logMessage(LOG_OUTPUT_LEVEL, "Validating [%s] file ....", fname);
-	if ((stat(filename, &stats) != 0) || (stats.st_size == 0)) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
-			"unknown source.", filename);
-		return(-1);		
-	}
-	if ( ((filbuf = malloc(stats.st_size)) == NULL) || ((membuf = malloc(stats.st_size)) == NULL) ) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
+	sim_log(LOG_OUTPUT_LEVEL, "Validating [%s] file ....", fname);
+	if ( ((filbuf = malloc(CART_SIM_VALIDATE_CHUNK)) == NULL) || ((membuf = malloc(CART_SIM_VALIDATE_CHUNK)) == NULL) ) {
+		sim_log(LOG_ERROR_LEVEL, "Failure validating file [%s], failed "
 			"buffer allocation.", filename);
+		free(filbuf);
 		return(-1);		
 	}
-
-	// Now open the file and read the contents
 	if ((fh=open(filename, O_RDONLY)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], open failed ", filename);
+		sim_log(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
+			"unknown source.", filename);
+		free(filbuf);
+		free(membuf);
 		return(-1);		
 	}
-	if ((read(fh, filbuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
-		return(-1);
-	}
-	close(fh);
 
-	// Seek to the beginning of the memory file, read the contents
-	if (cart_seek(mfh, 0) == -1) {
-		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] see to zero failed.", fname);
-		return(-1);
+	// Now create a backup of the memory file so people can debug
+	if (sim_backup) {
+		snprintf(bkfile, 256, "%s/%s.cmm", CART_WORKLOAD_DIR, fname);
+		if ((bkfh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
+			sim_log(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ", 
+				bkfile, strerror(errno));
+			ret = -1;
+			goto done;
+		}
 	}
-	if (cart_read(mfh, membuf, stats.st_size) != stats.st_size) {
+
+	// Seek to the beginning of the memory file
+	pthread_mutex_lock(&sim_driver_lock);
+	seek = cart_seek(mfh, 0);
+	pthread_mutex_unlock(&sim_driver_lock);
+	if (seek == -1) {
 		// Failed, error out
-		logMessage(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d failed.", fname, stats.st_size);
-		return(-1);
+		sim_log(LOG_ERROR_LEVEL, "Read cart file [%s] see to zero failed.", fname);
+		ret = -1;
+		goto done;
 	}
 
-	// Now create a backup of the memory file so people can debug
-	snprintf(bkfile, 256, "%s/%s.cmm", CART_WORKLOAD_DIR, fname);
-	if ((fh=open(bkfile, O_RDWR|O_CREAT|O_TRUNC, S_IRWXU)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure creating backup file [%s], open failed (%s) ", 
-			bkfile, strerror(errno));
-		return(-1);		
-	}
-	if ((write(fh, membuf, stats.st_size)) == -1) {
-		logMessage(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
-		return(-1);
-	}
-	close(fh);
+	// Walk both files a chunk at a time
+	ret = 0;
+	while ((got = read(fh, filbuf, CART_SIM_VALIDATE_CHUNK)) > 0) {
+
+		pthread_mutex_lock(&sim_driver_lock);
+		seek = cart_read(mfh, membuf, got);
+		pthread_mutex_unlock(&sim_driver_lock);
+		if (seek != got) {
+			// Failed, error out
+			sim_log(LOG_ERROR_LEVEL, "Read cart file [%s] of length %d failed at offset %ld.", fname, got, (long)length);
+			ret = -1;
+			break;
+		}
 
+		if (bkfh != -1 && write(bkfh, membuf, got) != got) {
+			sim_log(LOG_ERROR_LEVEL, "Failure writing backup file [%s].", bkfile);
+			ret = -1;
+			break;
+		}
 
-	// Now walk the buffers and compare byte for byte
-	for (idx=0; idx<stats.st_size; idx++) {
-		if (membuf[idx] != filbuf[idx]) {
-			logMessage(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %d (mem %x/'%c' "
-				"!= fil %x/'%c'", fname, idx, membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
-			return(-1);
+		// Compare the chunk, find the first difference only on a mismatch
+		if (memcmp(membuf, filbuf, got) != 0) {
+			for (idx=0; membuf[idx] == filbuf[idx]; idx++);
+			sim_log(LOG_ERROR_LEVEL, "Validation of [%s] failed at offset %ld (mem %x/'%c' "
+				"!= fil %x/'%c'", fname, (long)(length + idx), membuf[idx], membuf[idx], filbuf[idx], filbuf[idx]);
+			ret = -1;
+			break;
 		}
+		length += got;
+	}
+	if (got == -1) {
+		sim_log(LOG_ERROR_LEVEL, "Failure validating file [%s], read failed ", filename);
+		ret = -1;
+	} else if (ret == 0 && length == 0) {
+		sim_log(LOG_ERROR_LEVEL, "Failure validating file [%s], missing or "
+			"unknown source.", filename);
+		ret = -1;
 	}
 
-	// Free the buffers, log success, and return successfully
+done:
+	// Free the buffers, log success, and return
+	close(fh);
+	if (bkfh != -1) {
+		close(bkfh);
+	}
 	free(filbuf);
 	free(membuf);
-	logMessage(LOG_OUTPUT_LEVEL, "Validation of [%s], length %d sucessful.", fname, stats.st_size);
-	return( 0 );
+	if (ret == 0) {
+		sim_log(LOG_OUTPUT_LEVEL, "Validation of [%s], length %ld sucessful.", fname, (long)length);
+	}
+	return( ret );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : sim_log
+// Description  : Log a message from any simulator thread, holding the driver
+//                lock so messages do not interleave with the driver's own
+//
+// Inputs       : lvl - the log level
+//                fmt - the format, then its arguments
+// Outputs      : none
+
+void sim_log( unsigned long lvl, const char *fmt, ... ) {
+
+	va_list args;
+
+	va_start(args, fmt);
+	pthread_mutex_lock(&sim_driver_lock);
+	vlogMessage(lvl, fmt, args);
+	pthread_mutex_unlock(&sim_driver_lock);
+	va_end(args);
 }
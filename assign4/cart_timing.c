@@ -0,0 +1,84 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_timing.c
+//  Description    : This is the implementation of the clock and the latency
+//                   sample statistics shared by the CART simulator and the
+//                   benchmark harness.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <time.h>
+
+// Project includes
+#include <cart_timing.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_now
+// Description  : Monotonic time in seconds
+//
+// Inputs       : none
+// Outputs      : the time
+
+double cart_now(void) {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return( ts.tv_sec + ts.tv_nsec / 1e9 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_compare_samples
+// Description  : qsort comparator for ascending samples
+//
+// Inputs       : a, b - the samples to compare
+// Outputs      : <0, 0 or >0 as a is below, equal to or above b
+
+int cart_compare_samples(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return( (x > y) - (x < y) );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_samples_mean
+// Description  : Mean of a set of samples
+//
+// Inputs       : samples - the samples
+//                count - number of samples
+// Outputs      : the mean, 0 if there are none
+
+double cart_samples_mean(double *samples, uint32_t count) {
+	double sum = 0.0;
+	uint32_t i;
+
+	for ( i = 0; i < count; i++ ) {
+		sum += samples[i];
+	}
+	return( (count > 0) ? sum / count : 0.0 );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : cart_samples_percentile
+// Description  : Percentile of sorted samples (nearest rank)
+//
+// Inputs       : sorted - the samples in ascending order
+//                count - number of samples
+//                pct - the percentile (0-100)
+// Outputs      : the sample at the percentile, 0 if there are none
+
+double cart_samples_percentile(double *sorted, uint32_t count, double pct) {
+	uint32_t rank;
+
+	if ( count == 0 ) {
+		return( 0.0 );
+	}
+	rank = (uint32_t)(pct / 100.0 * count + 0.5);
+	if ( rank < 1 ) rank = 1;
+	if ( rank > count ) rank = count;
+	return( sorted[rank - 1] );
+}
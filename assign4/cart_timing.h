@@ -0,0 +1,33 @@
+#ifndef CART_TIMING_INCLUDED
+#define CART_TIMING_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_timing.h
+//  Description    : This is the header file for the clock and the latency
+//                   sample statistics shared by the CART simulator and the
+//                   benchmark harness.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdint.h>
+
+//
+// Functional Prototypes
+
+double cart_now(void);
+	// Monotonic time in seconds
+
+int cart_compare_samples(const void *a, const void *b);
+	// qsort comparator for ascending samples
+
+double cart_samples_mean(double *samples, uint32_t count);
+	// Mean of the samples, 0 if there are none
+
+double cart_samples_percentile(double *sorted, uint32_t count, double pct);
+	// Percentile (0-100) of sorted samples by nearest rank, 0 if there are none
+
+#endif
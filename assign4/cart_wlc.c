@@ -0,0 +1,74 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_wlc.c
+//  Description    : This is the workload compiler for the CART simulator. It
+//                   turns a text workload into the binary format replayed
+//                   by cart_sim straight from the mapping (see
+//                   cart_workload.h), so benchmark runs skip the parsing.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Include Files
+#include <stdio.h>
+#include <unistd.h>
+
+// Project Includes
+#include <cart_workload.h>
+#include <cmpsc311_log.h>
+
+// Defines
+#define CART_WLC_ARGUMENTS "h"
+#define USAGE \
+	"USAGE: cart_wlc [-h] <workload-file> <compiled-file>\n" \
+	"\n" \
+	"where:\n" \
+	"    -h - help mode (display this message)\n" \
+	"\n" \
+	"    <workload-file> - text workload to compile\n" \
+	"    <compiled-file> - binary workload to write, replay with cart_sim\n" \
+	"\n"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function     : main
+// Description  : The main function for the workload compiler
+//
+// Inputs       : argc - the number of command line parameters
+//                argv - the parameters
+// Outputs      : 0 if successful, -1 if failure
+
+int main( int argc, char *argv[] ) {
+
+	// Local variables
+	int ch;
+
+	// Process the command line parameters
+	while ((ch = getopt(argc, argv, CART_WLC_ARGUMENTS)) != -1) {
+
+		switch (ch) {
+		case 'h': // Help, print usage
+			fprintf( stderr, USAGE );
+			return( -1 );
+
+		default:  // Default (unknown)
+			fprintf( stderr, "Unknown command line option (%c), aborting.\n", ch );
+			return( -1 );
+		}
+	}
+
+	// The input and output files should be next
+	if ( optind + 2 != argc ) {
+		fprintf( stderr, "Missing command line parameters, use -h to see usage, aborting.\n" );
+		return( -1 );
+	}
+
+	initializeLogWithFilehandle( CMPSC311_LOG_STDERR );
+	if ( write_cart_workload( argv[optind], argv[optind+1] ) != 0 ) {
+		return( -1 );
+	}
+
+	// Return successfully
+	return( 0 );
+}
@@ -0,0 +1,484 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_workload.c
+//  Description    : This is the implementation of the workload reader for the
+//                   CART simulator. The workload is mapped private (copy on
+//                   write), each line is tokenized by hand, file names are
+//                   terminated and payloads translated in place, so a command
+//                   hands cart_write a pointer straight into the mapping.
+//
+//                   write_cart_workload compiles a text workload into the
+//                   binary format of cart_workload.h; open_cart_workload
+//                   recognizes its magic and replays the records directly.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Project includes
+#include <cart_workload.h>
+#include <cmpsc311_log.h>
+
+//
+// Functions
+
+// Parse a decimal integer, advancing the cursor
+int parse_workload_int(char **pos, char *end, int32_t *value);
+
+// Find or add the id of a file name
+int intern_workload_name(CartWorkload *wl, char *name, size_t len);
+
+// Check and index the sections of a compiled workload
+int map_compiled_workload(CartWorkload *wl, const char *path);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: open_cart_workload
+// Description	: Map a workload file for reading
+//
+// Input	: wl - the workload to open
+//		  path - the workload file
+// Output	: 0 if successful, -1 if failure
+
+int open_cart_workload(CartWorkload *wl, const char *path) {
+
+	struct stat stats;
+	int fd;
+
+	memset(wl, 0x0, sizeof(CartWorkload));
+	memset(wl->name_index, 0xff, sizeof(wl->name_index));
+
+	if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &stats) == -1) {
+		logMessage(LOG_ERROR_LEVEL, "Failure opening the workload file [%s], error: %s.\n", path, strerror(errno));
+		if (fd != -1) close(fd);
+		return(-1);
+	}
+
+	// An empty workload has nothing to map
+	wl->size = stats.st_size;
+	if (wl->size > 0) {
+		wl->map = mmap(NULL, wl->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (wl->map == MAP_FAILED) {
+			logMessage(LOG_ERROR_LEVEL, "Failure mapping the workload file [%s], error: %s.\n", path, strerror(errno));
+			close(fd);
+			wl->map = NULL;
+			return(-1);
+		}
+		madvise(wl->map, wl->size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+
+	wl->pos = wl->map;
+
+	// Compiled workloads start with the magic
+	if (wl->size >= sizeof(CartWorkloadHeader) && memcmp(wl->map, CART_WORKLOAD_MAGIC, 4) == 0) {
+		if (map_compiled_workload(wl, path) == -1) {
+			close_cart_workload(wl);
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: next_cart_workload
+// Description	: Tokenize the next line of the workload. A line reads
+//		  "<file> <COMMAND> <len> <offset> :<payload>"; blank lines
+//		  are skipped.
+//
+// Input	: wl - the workload
+//		  cmd - the command to fill in
+// Output	: 1 if a command was returned, 0 at the end, -1 if failure
+
+int next_cart_workload(CartWorkload *wl, CartWorkloadCommand *cmd) {
+
+	char *end = wl->map + wl->size;
+	char *line, *eol, *p, *token;
+	CartWorkloadRecord *rec;
+	int id;
+
+	// Compiled workloads only need their bounds checked
+	if (wl->binary) {
+		if (wl->next == wl->commands) {
+			return(0);
+		}
+		rec = &wl->records[wl->next++];
+		if (rec->op > CART_WL_READ || rec->file >= wl->files ||
+			((rec->op == CART_WL_WRITE || rec->op == CART_WL_WRITEAT) &&
+			 (rec->len < 0 || rec->data + (uint64_t)rec->len > wl->blob_size))) {
+			logMessage(LOG_ERROR_LEVEL, "Corrupt compiled workload record %u", wl->next - 1);
+			return(-1);
+		}
+		cmd->op = rec->op;
+		cmd->file = rec->file;
+		cmd->len = rec->len;
+		cmd->off = rec->off;
+		cmd->data = wl->blob + rec->data;
+		return(1);
+	}
+
+	// Skip blank lines
+	while (wl->pos < end && *wl->pos == '\n') {
+		wl->pos++;
+		wl->line++;
+	}
+	if (wl->pos >= end) {
+		return(0);
+	}
+
+	line = p = wl->pos;
+	if ((eol = memchr(line, '\n', end - line)) == NULL) {
+		eol = end;
+	}
+	wl->pos = (eol < end) ? eol + 1 : end;
+	wl->line++;
+
+	// File name, terminated in place
+	while (p < eol && *p != ' ' && *p != '\t') p++;
+	if (p == line || p == eol) {
+		goto unparsable;
+	}
+	*p = '\0';
+	if ((id = intern_workload_name(wl, line, p - line)) == -1) {
+		return(-1);
+	}
+	cmd->file = id;
+	p++;
+
+	// Command, matched by prefix as the simulator always has
+	while (p < eol && (*p == ' ' || *p == '\t')) p++;
+	token = p;
+	while (p < eol && *p != ' ' && *p != '\t') p++;
+	if (p - token >= 7 && memcmp(token, "WRITEAT", 7) == 0) {
+		cmd->op = CART_WL_WRITEAT;
+	} else if (p - token >= 5 && memcmp(token, "WRITE", 5) == 0) {
+		cmd->op = CART_WL_WRITE;
+	} else if (p - token >= 4 && memcmp(token, "SEEK", 4) == 0) {
+		cmd->op = CART_WL_SEEK;
+	} else if (p - token >= 4 && memcmp(token, "READ", 4) == 0) {
+		cmd->op = CART_WL_READ;
+	} else {
+		logMessage(LOG_ERROR_LEVEL, "CART_SIM : Failed, unknown command on line %u", wl->line);
+		return(-1);
+	}
+
+	// Length, offset and the payload separator
+	if (parse_workload_int(&p, eol, &cmd->len) || parse_workload_int(&p, eol, &cmd->off)) {
+		goto unparsable;
+	}
+	while (p < eol && *p != ':') p++;
+	if (p == eol) {
+		goto unparsable;
+	}
+	cmd->data = p + 1;
+
+	// Writes carry the payload, which may run up to the newline
+	if (cmd->op == CART_WL_WRITE || cmd->op == CART_WL_WRITEAT) {
+		if (cmd->len < 0 || cmd->len >= CART_WORKLOAD_MAX_LINE) {
+			logMessage(LOG_ERROR_LEVEL, "Simulated workload command text too large [%d], line %u", cmd->len, wl->line);
+			return(-1);
+		}
+		if (cmd->len > (wl->pos - cmd->data)) {
+			logMessage(LOG_ERROR_LEVEL, "Workload str [%d<%d], line %u", (int)(wl->pos - cmd->data), cmd->len, wl->line);
+			return(-1);
+		}
+		translate_workload_text(cmd->data, cmd->len);
+	}
+
+	return(1);
+
+unparsable:
+	logMessage(LOG_ERROR_LEVEL, "CART un-parsable workload string, aborting, line %u", wl->line);
+	return(-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: close_cart_workload
+// Description	: Unmap the workload
+//
+// Input	: wl - the workload
+// Output	: 0 if successful
+
+int close_cart_workload(CartWorkload *wl) {
+
+	if (wl->map != NULL) {
+		munmap(wl->map, wl->size);
+	}
+	memset(wl, 0x0, sizeof(CartWorkload));
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: write_cart_workload
+// Description	: Compile a text workload into the binary format. Payloads are
+//		  stored translated, so replay does no work on them.
+//
+// Input	: text_path - the text workload
+//		  bin_path - the compiled workload to write
+// Output	: 0 if successful, -1 if failure
+
+int write_cart_workload(const char *text_path, const char *bin_path) {
+
+	CartWorkload wl;
+	CartWorkloadCommand cmd;
+	CartWorkloadHeader header;
+	CartWorkloadRecord *records = NULL, *rec;
+	char *blob = NULL, pad[8] = { 0 };
+	uint32_t commands = 0, max_commands = 0, i;
+	uint64_t blob_size = 0, max_blob = 0, names_size = 0;
+	FILE *out;
+	int ret;
+
+	if (open_cart_workload(&wl, text_path) == -1) {
+		return(-1);
+	}
+	if (wl.binary) {
+		logMessage(LOG_ERROR_LEVEL, "Workload [%s] is already compiled", text_path);
+		close_cart_workload(&wl);
+		return(-1);
+	}
+
+	// Collect the records and payloads
+	while ((ret = next_cart_workload(&wl, &cmd)) == 1) {
+		if (commands == max_commands) {
+			max_commands = (max_commands == 0) ? 4096 : max_commands * 2;
+			records = realloc(records, max_commands * sizeof(CartWorkloadRecord));
+		}
+		rec = &records[commands++];
+		memset(rec, 0x0, sizeof(CartWorkloadRecord));
+		rec->op = cmd.op;
+		rec->file = cmd.file;
+		rec->len = cmd.len;
+		rec->off = cmd.off;
+		if (cmd.op == CART_WL_WRITE || cmd.op == CART_WL_WRITEAT) {
+			if (blob_size + cmd.len > max_blob) {
+				max_blob = (max_blob == 0) ? 65536 : max_blob * 2;
+				if (max_blob < blob_size + cmd.len) max_blob = blob_size + cmd.len;
+				blob = realloc(blob, max_blob);
+			}
+			if (blob_size + cmd.len > UINT32_MAX) {
+				logMessage(LOG_ERROR_LEVEL, "Workload [%s] payloads too large to compile", text_path);
+				ret = -1;
+				break;
+			}
+			memcpy(blob + blob_size, cmd.data, cmd.len);
+			rec->data = blob_size;
+			blob_size += cmd.len;
+		}
+	}
+	if (ret == -1) {
+		free(records);
+		free(blob);
+		close_cart_workload(&wl);
+		return(-1);
+	}
+
+	// Header, names, records, then the blob
+	for (i = 0; i < wl.files; i++) {
+		names_size += strlen(wl.names[i]) + 1;
+	}
+	memcpy(header.magic, CART_WORKLOAD_MAGIC, 4);
+	header.version = CART_WORKLOAD_VERSION;
+	header.commands = commands;
+	header.files = wl.files;
+	header.names_size = (names_size + 7) & ~7ULL;
+	header.blob_size = blob_size;
+
+	if ((out = fopen(bin_path, "wb")) == NULL) {
+		logMessage(LOG_ERROR_LEVEL, "Failure creating compiled workload [%s], error: %s.", bin_path, strerror(errno));
+		ret = -1;
+	} else {
+		ret = (fwrite(&header, sizeof(header), 1, out) == 1) ? 0 : -1;
+		for (i = 0; i < wl.files && ret == 0; i++) {
+			if (fwrite(wl.names[i], strlen(wl.names[i]) + 1, 1, out) != 1) ret = -1;
+		}
+		if (ret == 0 && header.names_size > names_size &&
+			fwrite(pad, header.names_size - names_size, 1, out) != 1) ret = -1;
+		if (ret == 0 && commands > 0 && fwrite(records, sizeof(CartWorkloadRecord), commands, out) != commands) ret = -1;
+		if (ret == 0 && blob_size > 0 && fwrite(blob, blob_size, 1, out) != 1) ret = -1;
+		if (fclose(out) != 0) ret = -1;
+		if (ret == -1) {
+			logMessage(LOG_ERROR_LEVEL, "Failure writing compiled workload [%s].", bin_path);
+		}
+	}
+
+	free(records);
+	free(blob);
+	close_cart_workload(&wl);
+	return(ret);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: map_compiled_workload
+// Description	: Check the header of a compiled workload and point at its
+//		  names, records and blob in the mapping
+//
+// Input	: wl - the mapped workload
+//		  path - the workload file, for messages
+// Output	: 0 if successful, -1 if failure
+
+int map_compiled_workload(CartWorkload *wl, const char *path) {
+
+	CartWorkloadHeader *header = (CartWorkloadHeader *)wl->map;
+	char *names, *name;
+	uint64_t need;
+	uint32_t i;
+
+	if (header->version != CART_WORKLOAD_VERSION || header->files > CART_WORKLOAD_MAX_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "Unsupported compiled workload [%s]", path);
+		return(-1);
+	}
+
+	// All sections must lie inside the file
+	need = sizeof(CartWorkloadHeader) + header->names_size +
+		(uint64_t)header->commands * sizeof(CartWorkloadRecord) + header->blob_size;
+	if (header->names_size % 8 != 0 || need != wl->size) {
+		logMessage(LOG_ERROR_LEVEL, "Truncated compiled workload [%s]", path);
+		return(-1);
+	}
+
+	// The names are packed back to back, each terminated
+	names = wl->map + sizeof(CartWorkloadHeader);
+	name = names;
+	for (i = 0; i < header->files; i++) {
+		char *nul = memchr(name, '\0', names + header->names_size - name);
+		if (nul == NULL || nul == name) {
+			logMessage(LOG_ERROR_LEVEL, "Corrupt names in compiled workload [%s]", path);
+			return(-1);
+		}
+		wl->names[i] = name;
+		name = nul + 1;
+	}
+
+	wl->binary = 1;
+	wl->files = header->files;
+	wl->commands = header->commands;
+	wl->records = (CartWorkloadRecord *)(names + header->names_size);
+	wl->blob = (char *)(wl->records + header->commands);
+	wl->blob_size = header->blob_size;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: translate_workload_text
+// Description	: Turn the '^' line markers of a payload into newlines, 16
+//		  bytes at a time where SSE2 is available. Blocks without a
+//		  marker are not stored, so their pages stay shared.
+//
+// Input	: text - the payload
+//		  len - bytes in the payload
+// Output	: none
+
+void translate_workload_text(char *text, size_t len) {
+
+	size_t i = 0;
+
+#ifdef __SSE2__
+	const __m128i caret = _mm_set1_epi8('^');
+	const __m128i delta = _mm_set1_epi8('^' - '\n');
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+		__m128i hits = _mm_cmpeq_epi8(block, caret);
+		if (_mm_movemask_epi8(hits) != 0) {
+			_mm_storeu_si128((__m128i *)(text + i), _mm_sub_epi8(block, _mm_and_si128(hits, delta)));
+		}
+	}
+#endif
+
+	// The tail, or everything without SSE2
+	for (; i < len; i++) {
+		if (text[i] == '^') {
+			text[i] = '\n';
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: parse_workload_int
+// Description	: Parse a decimal integer after optional blanks
+//
+// Input	: pos - the cursor, advanced past the number
+//		  end - end of the line
+//		  value - the parsed value
+// Output	: 0 if successful, -1 if there is no number
+
+int parse_workload_int(char **pos, char *end, int32_t *value) {
+
+	char *p = *pos;
+	int32_t sign = 1, v = 0;
+
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	if (p < end && (*p == '-' || *p == '+')) {
+		sign = (*p == '-') ? -1 : 1;
+		p++;
+	}
+	if (p == end || *p < '0' || *p > '9') {
+		return(-1);
+	}
+	while (p < end && *p >= '0' && *p <= '9') {
+		v = v * 10 + (*p - '0');
+		p++;
+	}
+
+	*value = sign * v;
+	*pos = p;
+	return(0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Function	: intern_workload_name
+// Description	: Find the id of a file name, adding it if it is new
+//
+// Input	: wl - the workload
+//		  name - the terminated name
+//		  len - length of the name
+// Output	: the file id, -1 if there are too many files
+
+int intern_workload_name(CartWorkload *wl, char *name, size_t len) {
+
+	uint32_t hash = 2166136261u, slot;
+	size_t i;
+
+	// FNV-1a into a table twice the number of files
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	slot = hash % (2 * CART_WORKLOAD_MAX_FILES);
+
+	while (wl->name_index[slot] != -1) {
+		if (strcmp(wl->names[wl->name_index[slot]], name) == 0) {
+			return(wl->name_index[slot]);
+		}
+		slot = (slot + 1) % (2 * CART_WORKLOAD_MAX_FILES);
+	}
+
+	if (wl->files == CART_WORKLOAD_MAX_FILES) {
+		logMessage(LOG_ERROR_LEVEL, "Too many files in the workload [%u], line %u", wl->files, wl->line);
+		return(-1);
+	}
+
+	wl->names[wl->files] = name;
+	wl->name_index[slot] = wl->files;
+	return(wl->files++);
+}
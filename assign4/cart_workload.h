@@ -0,0 +1,102 @@
+#ifndef CART_WORKLOAD_INCLUDED
+#define CART_WORKLOAD_INCLUDED
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//  File           : cart_workload.h
+//  Description    : This is the header file for the workload reader used by
+//                   the CART simulator. The workload is mapped into memory and
+//                   tokenized in place, so commands are handed out without
+//                   copying or allocating. Workloads compiled by cart_wlc are
+//                   recognized by their magic and replayed straight from the
+//                   mapping.
+//
+//  Author         : Xuannan Su
+//  Last Modified  : 10/18/2026
+//
+
+// Includes
+#include <stdint.h>
+#include <stddef.h>
+
+// Defines
+#define CART_WORKLOAD_MAX_FILES 128	// Distinct file names in a workload
+#define CART_WORKLOAD_MAX_LINE 1024	// Longest line the simulator accepted
+
+typedef enum {
+	CART_WL_WRITEAT = 0,	// seek to the offset and write the payload
+	CART_WL_WRITE   = 1,	// write the payload at the current position
+	CART_WL_SEEK    = 2,	// seek to the offset
+	CART_WL_READ    = 3	// read len bytes from the current position
+} CartWorkloadOp;
+
+// Compiled (binary) workloads, in host byte order:
+//
+//   header | names (NUL terminated, padded to 8) | commands | payload blob
+//
+#define CART_WORKLOAD_MAGIC "CWLB"
+#define CART_WORKLOAD_VERSION 1
+
+typedef struct {
+	char magic[4];		// CART_WORKLOAD_MAGIC
+	uint32_t version;	// CART_WORKLOAD_VERSION
+	uint32_t commands;	// number of command records
+	uint32_t files;		// number of file names
+	uint64_t names_size;	// bytes in the name section, padding included
+	uint64_t blob_size;	// bytes in the payload blob
+} CartWorkloadHeader;
+
+typedef struct {
+	uint8_t op;		// CartWorkloadOp
+	uint8_t unused;
+	uint16_t file;		// file id
+	int32_t len;		// bytes to write or read
+	int32_t off;		// offset for WRITEAT and SEEK
+	uint32_t data;		// payload offset in the blob (translated already)
+} CartWorkloadRecord;
+
+// One workload command, pointing into the mapped workload
+typedef struct {
+	CartWorkloadOp op;	// the command
+	uint32_t file;		// file id, index into the workload's names
+	int32_t len;		// bytes to write or read
+	int32_t off;		// offset for WRITEAT and SEEK
+	char *data;		// payload of WRITE/WRITEAT, '^' already turned into '\n'
+} CartWorkloadCommand;
+
+// An open workload
+typedef struct {
+	char *map;		// the private (copy-on-write) mapping
+	size_t size;		// bytes mapped
+	char *pos;		// next unread byte
+	uint32_t line;		// lines consumed, for error messages
+	uint32_t files;		// distinct file names seen so far
+	char *names[CART_WORKLOAD_MAX_FILES];	// file names, terminated in place
+	int16_t name_index[2 * CART_WORKLOAD_MAX_FILES];	// hash of names to file ids, -1 if empty
+	int binary;		// compiled workload, read from the records below
+	CartWorkloadRecord *records;	// command records of a compiled workload
+	uint32_t commands;	// number of records
+	uint32_t next;		// next record to return
+	char *blob;		// payloads of a compiled workload
+	uint64_t blob_size;	// bytes in the blob
+} CartWorkload;
+
+//
+// Interface functions
+
+int open_cart_workload(CartWorkload *wl, const char *path);
+	// Map a text or compiled workload file for reading
+
+int next_cart_workload(CartWorkload *wl, CartWorkloadCommand *cmd);
+	// Get the next command, 1 if one was returned, 0 at the end, -1 on error
+
+int close_cart_workload(CartWorkload *wl);
+	// Unmap the workload (names and payloads become invalid)
+
+int write_cart_workload(const char *text_path, const char *bin_path);
+	// Compile a text workload into the binary format
+
+void translate_workload_text(char *text, size_t len);
+	// Turn the '^' line markers of a payload into newlines, in place
+
+#endif